@@ -0,0 +1,498 @@
+/* Benchmarks of clog, written to standard output as CSV: throughput by
+ * message size and format, the cost per byte of long messages, per-call
+ * latency percentiles, scaling with threads on one and on several loggers,
+ * the cost of calls at a disabled level, and of appending numbers and level
+ * names to a line.  Progress goes to standard error. */
+
+#define _XOPEN_SOURCE 600
+
+#include <sys/time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CLOG_SILENT
+#define CLOG_MAIN
+#include "clog.h"
+
+/* Largest message size, and the most bytes a throughput run writes. */
+#define BENCH_MAX_MESSAGE 8192
+#define BENCH_MAX_BYTES (64 * 1024 * 1024)
+
+enum bench_sink {
+    BENCH_DEVNULL,
+    BENCH_FILE,
+    BENCH_PIPE
+};
+
+const char *const BENCH_SINK_NAMES[] = { "devnull", "file", "pipe" };
+
+struct bench_format {
+    const char *name;
+    const char *fmt;
+};
+
+const struct bench_format BENCH_FORMATS[] = {
+    { "bare", "%m\n" },
+    { "default", CLOG_DEFAULT_FORMAT },
+    { "full", "%d %t.%u %l %f:%n (%r): %m\n" },
+};
+
+const size_t BENCH_SIZES[] = { 16, 128, 1024, BENCH_MAX_MESSAGE };
+
+#define BENCH_COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Options. */
+long bench_lines = 200000;
+int bench_max_threads = 0;
+const char *bench_dir = ".";
+
+char bench_message[BENCH_MAX_MESSAGE + 1];
+
+/* A logger's output, and what it takes to tear it down. */
+struct bench_target {
+    enum bench_sink sink;
+    char path[4096];
+    int pipe_fd[2];
+    pthread_t reader;
+};
+
+void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-n LINES] [-t THREADS] [-d DIR]\n"
+            "Benchmarks clog and writes the results to standard output as "
+            "CSV.\n"
+            "  -n LINES    Lines per throughput run (default 200000).\n"
+            "  -t THREADS  Most threads to scale to (default: CPUs).\n"
+            "  -d DIR      Directory for the file sink (default .).\n",
+            name);
+}
+
+double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Read a pipe sink out until the logger's end is closed. */
+void *drain_pipe(void *arg)
+{
+    char buf[65536];
+    int fd = *(int *) arg;
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+int open_target(struct bench_target *target, enum bench_sink sink, int id)
+{
+    target->sink = sink;
+    switch (sink) {
+        case BENCH_DEVNULL:
+            return clog_init_path(id, "/dev/null");
+        case BENCH_FILE:
+            snprintf(target->path, sizeof(target->path),
+                     "%s/clog_bench.%d.out", bench_dir, id);
+            unlink(target->path);
+            return clog_init_path(id, target->path);
+        case BENCH_PIPE:
+            if (pipe(target->pipe_fd) == -1) {
+                perror("pipe");
+                return 1;
+            }
+            if (pthread_create(&target->reader, NULL, drain_pipe,
+                               &target->pipe_fd[0]) != 0) {
+                close(target->pipe_fd[0]);
+                close(target->pipe_fd[1]);
+                return 1;
+            }
+            return clog_init_fd(id, target->pipe_fd[1]);
+    }
+    return 1;
+}
+
+void close_target(struct bench_target *target, int id)
+{
+    clog_free(id);
+    switch (target->sink) {
+        case BENCH_DEVNULL:
+            break;
+        case BENCH_FILE:
+            unlink(target->path);
+            break;
+        case BENCH_PIPE:
+            close(target->pipe_fd[1]);
+            pthread_join(target->reader, NULL);
+            close(target->pipe_fd[0]);
+            break;
+    }
+}
+
+void print_row(const char *benchmark, const char *sink, const char *format,
+               size_t size, int threads, int loggers, long lines,
+               double seconds)
+{
+    printf("%s,%s,%s,%lu,%d,%d,%ld,%.0f,%.1f", benchmark, sink, format,
+           (unsigned long) size, threads, loggers, lines, lines / seconds,
+           seconds * 1e9 / lines);
+}
+
+/* Lines per second from one thread, for each sink, format and size. */
+int bench_throughput(void)
+{
+    struct bench_target target;
+    size_t s, f, k;
+    long lines, i;
+    double start, seconds;
+
+    for (k = 0; k < BENCH_COUNT(BENCH_SINK_NAMES); k++) {
+        for (f = 0; f < BENCH_COUNT(BENCH_FORMATS); f++) {
+            for (s = 0; s < BENCH_COUNT(BENCH_SIZES); s++) {
+                const size_t size = BENCH_SIZES[s];
+                lines = bench_lines;
+                if (lines * (long) size > BENCH_MAX_BYTES) {
+                    lines = BENCH_MAX_BYTES / (long) size;
+                }
+                if (open_target(&target, (enum bench_sink) k, 0)
+                    || clog_set_fmt(0, BENCH_FORMATS[f].fmt)) {
+                    return 1;
+                }
+                start = now_sec();
+                for (i = 0; i < lines; i++) {
+                    CLOG_INFO_(0, "%.*s", (int) size, bench_message);
+                }
+                seconds = now_sec() - start;
+                close_target(&target, 0);
+
+                print_row("throughput", BENCH_SINK_NAMES[k],
+                          BENCH_FORMATS[f].name, size, 1, 1, lines, seconds);
+                printf(",,,\n");
+            }
+        }
+    }
+    return 0;
+}
+
+/* Lines of up to 64 KB, with text after the message, which appending used
+ * to rescan the whole line for: the time per byte should not grow with the
+ * length. */
+int bench_message_length(void)
+{
+    const size_t sizes[] = { 64, 1024, 16 * 1024, 64 * 1024 };
+    const char *fmt = "%d %t %l: %m (logged from %f line %n)\n";
+    struct bench_target target;
+    char *message;
+    size_t s;
+    long lines, i;
+    double start, seconds;
+
+    message = (char *) malloc(sizes[BENCH_COUNT(sizes) - 1] + 1);
+    if (message == NULL) {
+        return 1;
+    }
+    for (s = 0; s < BENCH_COUNT(sizes); s++) {
+        const size_t size = sizes[s];
+        memset(message, 'c', size);
+        message[size] = 0;
+        lines = BENCH_MAX_BYTES / 4 / (long) size;
+        if (open_target(&target, BENCH_DEVNULL, 0)
+            || clog_set_fmt(0, fmt)) {
+            free(message);
+            return 1;
+        }
+        start = now_sec();
+        for (i = 0; i < lines; i++) {
+            CLOG_INFO_(0, "%s", message);
+        }
+        seconds = now_sec() - start;
+        close_target(&target, 0);
+
+        print_row("length", "devnull", "trailing", size, 1, 1, lines,
+                  seconds);
+        printf(",,,\n");
+    }
+    free(message);
+    return 0;
+}
+
+int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Percentiles of the time of single calls, clock reads included. */
+int bench_latency(void)
+{
+    struct bench_target target;
+    const size_t size = 128;
+    long *times, lines = bench_lines, i, start;
+    size_t k;
+
+    times = (long *) malloc(lines * sizeof(long));
+    if (times == NULL) {
+        return 1;
+    }
+    for (k = 0; k < BENCH_COUNT(BENCH_SINK_NAMES); k++) {
+        if (open_target(&target, (enum bench_sink) k, 0)) {
+            free(times);
+            return 1;
+        }
+        for (i = 0; i < lines; i++) {
+            start = now_ns();
+            CLOG_INFO_(0, "%.*s", (int) size, bench_message);
+            times[i] = now_ns() - start;
+        }
+        close_target(&target, 0);
+
+        qsort(times, lines, sizeof(long), compare_long);
+        start = 0;
+        for (i = 0; i < lines; i++) {
+            start += times[i];
+        }
+        print_row("latency", BENCH_SINK_NAMES[k], "default", size, 1, 1,
+                  lines, start / 1e9);
+        printf(",%ld,%ld,%ld\n", times[lines / 2], times[lines * 99 / 100],
+               times[lines * 999 / 1000]);
+    }
+    free(times);
+    return 0;
+}
+
+struct bench_thread {
+    pthread_t thread;
+    int id;
+    long lines;
+};
+
+void *log_lines(void *arg)
+{
+    struct bench_thread *t = (struct bench_thread *) arg;
+    long i;
+    for (i = 0; i < t->lines; i++) {
+        CLOG_INFO_(t->id, "%.*s", 128, bench_message);
+    }
+    return NULL;
+}
+
+/* Thread counts double up to bench_max_threads, which is always run. */
+int next_threads(int n)
+{
+    if (n < bench_max_threads && n * 2 > bench_max_threads) {
+        return bench_max_threads;
+    }
+    return n * 2;
+}
+
+/* Total lines per second from 1 to bench_max_threads threads, all on one
+ * logger or each on its own. */
+int bench_scaling(void)
+{
+    struct bench_target targets[CLOG_MAX_LOGGERS];
+    struct bench_thread threads[CLOG_MAX_LOGGERS];
+    const enum bench_sink sinks[] = { BENCH_DEVNULL, BENCH_FILE };
+    int n, i, loggers, several;
+    size_t k;
+    double start, seconds;
+
+    for (k = 0; k < BENCH_COUNT(sinks); k++) {
+        for (several = 0; several < 2; several++) {
+            for (n = 1; n <= bench_max_threads; n = next_threads(n)) {
+                loggers = several ? n : 1;
+                for (i = 0; i < loggers; i++) {
+                    if (open_target(&targets[i], sinks[k], i)) {
+                        return 1;
+                    }
+                }
+                start = now_sec();
+                for (i = 0; i < n; i++) {
+                    threads[i].id = several ? i : 0;
+                    threads[i].lines = bench_lines / n;
+                    if (pthread_create(&threads[i].thread, NULL, log_lines,
+                                       &threads[i]) != 0) {
+                        return 1;
+                    }
+                }
+                for (i = 0; i < n; i++) {
+                    pthread_join(threads[i].thread, NULL);
+                }
+                seconds = now_sec() - start;
+                for (i = 0; i < loggers; i++) {
+                    close_target(&targets[i], i);
+                }
+
+                print_row("scaling", BENCH_SINK_NAMES[sinks[k]], "default",
+                          128, n, loggers, bench_lines / n * n, seconds);
+                printf(",,,\n");
+            }
+        }
+    }
+    return 0;
+}
+
+/* Cost of a call under the logger's level, through the function and through
+ * the macro with its inline check. */
+int bench_disabled(void)
+{
+    const long lines = bench_lines * 50;
+    double start, seconds;
+    long i;
+
+    if (clog_init_path(0, "/dev/null") || clog_set_level(0, CLOG_WARN)) {
+        return 1;
+    }
+    start = now_sec();
+    for (i = 0; i < lines; i++) {
+        clog_debug(CLOG(0), "%s %ld", "disabled", i);
+    }
+    seconds = now_sec() - start;
+    print_row("disabled", "devnull", "function", 0, 1, 1, lines, seconds);
+    printf(",,,\n");
+
+    start = now_sec();
+    for (i = 0; i < lines; i++) {
+        CLOG_DEBUG_(0, "%s %ld", "disabled", i);
+    }
+    seconds = now_sec() - start;
+    print_row("disabled", "devnull", "macro", 0, 1, 1, lines, seconds);
+    printf(",,,\n");
+    clog_free(0);
+    return 0;
+}
+
+/* How lines were built before: snprintf() for numbers, strlen() for level
+ * names.  Kept to compare against. */
+void append_int_snprintf(struct clog_buf *b, long int d)
+{
+    char buf[40];
+    int len = snprintf(buf, 40, "%ld", d);
+    if (len < 0 || len >= 40) {
+        return;
+    }
+    _clog_append_str(b, buf, len);
+}
+
+/* Seconds to append a number (or a level name) lines times, the old way or
+ * the way lines are built now. */
+double time_appends(long lines, int old_way, int level)
+{
+    struct clog_buf b;
+    char buf[4096];
+    double start, seconds;
+    long i;
+
+    _clog_buf_init(&b, buf, sizeof(buf));
+    start = now_sec();
+    for (i = 0; i < lines; i++) {
+        if (level) {
+            const char *name = CLOG_LEVEL_NAMES[i & 3];
+            _clog_append_str(&b, name, old_way ? strlen(name)
+                                               : _clog_level_lengths[i & 3]);
+        } else if (old_way) {
+            append_int_snprintf(&b, i * 7919 - lines);
+        } else {
+            _clog_append_int(&b, i * 7919 - lines);
+        }
+        if (b.len > sizeof(buf) - 64) {
+            b.len = 0;
+        }
+    }
+    seconds = now_sec() - start;
+    _clog_buf_free(&b);
+    return seconds;
+}
+
+/* Cost of appending a number or a level name to a line. */
+int bench_appends(void)
+{
+    const char *const names[] = { "int_snprintf", "int", "level_strlen",
+                                  "level" };
+    const long lines = bench_lines * 10;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        print_row("append", "none", names[i], 0, 1, 0, lines,
+                  time_appends(lines, i % 2 == 0, i >= 2));
+        printf(",,,\n");
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:d:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                bench_lines = atol(optarg);
+                break;
+            case 't':
+                bench_max_threads = atoi(optarg);
+                break;
+            case 'd':
+                bench_dir = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (bench_lines < 1000) {
+        bench_lines = 1000;
+    }
+    if (bench_max_threads <= 0) {
+        bench_max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (bench_max_threads < 1) {
+        bench_max_threads = 1;
+    } else if (bench_max_threads > CLOG_MAX_LOGGERS) {
+        bench_max_threads = CLOG_MAX_LOGGERS;
+    }
+    memset(bench_message, 'x', BENCH_MAX_MESSAGE);
+
+    printf("benchmark,sink,format,message_bytes,threads,loggers,lines,"
+           "lines_per_sec,ns_per_line,p50_ns,p99_ns,p999_ns\n");
+    fprintf(stderr, "Throughput...\n");
+    if (bench_throughput()) {
+        return 1;
+    }
+    fflush(stdout);
+    fprintf(stderr, "Message lengths...\n");
+    if (bench_message_length()) {
+        return 1;
+    }
+    fflush(stdout);
+    fprintf(stderr, "Latency...\n");
+    if (bench_latency()) {
+        return 1;
+    }
+    fflush(stdout);
+    fprintf(stderr, "Scaling to %d threads...\n", bench_max_threads);
+    if (bench_scaling()) {
+        return 1;
+    }
+    fflush(stdout);
+    fprintf(stderr, "Disabled levels...\n");
+    if (bench_disabled()) {
+        return 1;
+    }
+    fflush(stdout);
+    fprintf(stderr, "Appends...\n");
+    if (bench_appends()) {
+        return 1;
+    }
+    return 0;
+}
@@ -9,7 +9,11 @@
  *
  * Dependencies:
  * - Should conform to C89, C++98 (but requires vsnprintf, unfortunately).
- * - POSIX environment.
+ * - POSIX environment.  In strict modes such as -std=c99, the file with
+ *   CLOG_MAIN must ask for POSIX first, e.g. with #define _XOPEN_SOURCE 500.
+ *   Memory-mapped loggers preallocate their files and advise the kernel of
+ *   sequential access only with POSIX.1-2001 (_XOPEN_SOURCE 600 or
+ *   _POSIX_C_SOURCE 200112L).
  *
  * USAGE:
  *
@@ -23,7 +27,10 @@
  * This will define the actual objects that all the other units will use.
  *
  * Loggers are identified by integers (0 - 15).  It's expected that you'll
- * create meaningful constants and then refer to the loggers as such.
+ * create meaningful constants and then refer to the loggers as such.  More
+ * loggers can be created at run time with clog_create_path() and
+ * clog_create_fd(), which hand out ids of their own and can give loggers
+ * names to find them by.
  *
  * Example:
  *
@@ -43,12 +50,34 @@
  *
  * The CLOG macro used in the call to clog_info is a helper that passes the
  * __FILE__ and __LINE__ parameters for you, so you don't have to type them
- * every time. (It could be prettier with variadic macros, but that requires
- * C99 or C++11 to be standards compliant.)
+ * every time.  With C99 or C++11, the variadic macros are shorter still, and
+ * cost next to nothing for filtered levels:
+ *
+ *      CLOG_INFO_(MY_LOGGER, "Hello, %s!", "world");
  *
  * Errors encountered by clog will be printed to stderr.  You can suppress
  * these by defining a macro called CLOG_SILENT before including clog.h.
  *
+ * Thread safety:
+ *
+ * Unless built with CLOG_NO_THREADS, any number of threads may log to the
+ * same logger at once, while others initialize, reconfigure, rotate or free
+ * loggers.  Log calls take no locks: they announce themselves in a per-logger
+ * read-side counter, and clog_free, clog_rotate and the clog_set_* functions
+ * publish their change atomically and then wait for the log calls that may
+ * still see the old state to finish before freeing or closing it.
+ *
+ * Every line is formatted completely before it is written, and goes to the
+ * file with a single write() (buffered and asynchronous loggers write whole
+ * lines with write() or writev()).  Lines from different threads therefore
+ * never interleave in a file opened with O_APPEND, as clog_init_path does,
+ * nor in a pipe as long as a line is at most PIPE_BUF bytes.
+ *
+ * The child of a fork() may keep logging: its first log call starts the
+ * background threads again.  Lines the parent had queued or buffered are
+ * left to the parent.  A memory-mapped logger must only be used by one of
+ * the two, since both would write to the same pages.
+ *
  * License: Do whatever you want. It would be nice if you contribute
  * improvements as pull requests here:
  *
@@ -66,7 +95,9 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <locale.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -85,12 +116,59 @@
 #endif
 
 #else
+#include <limits.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
-/* Number of loggers that can be defined. */
+/* SSE2 for scanning strings for characters JSON needs escaped. */
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define CLOG_SSE2
+#include <emmintrin.h>
+#endif
+
+/* C99 and C++11 have variadic macros, long long and <stdint.h>. */
+#if (defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L) \
+    || (defined(__cplusplus) && __cplusplus >= 201103L)
+#define CLOG_C99
+#include <stdint.h>
+#endif
+
+/* Background threads (asynchronous mode) need POSIX threads.  Define
+ * CLOG_NO_THREADS to build without them. */
+#if !defined(_MSC_VER) && !defined(CLOG_NO_THREADS)
+#define CLOG_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/* Memory-mapped loggers need mmap() and, for rolling segments, threads. */
+#if defined(CLOG_THREADS) && !defined(_WIN32)
+#define CLOG_MMAP
+#include <sys/mman.h>
+#endif
+
+/* Rotated files are compressed with zlib if CLOG_ZLIB is defined (link with
+ * -lz), otherwise in clog's own LZ format (see clog_uncompress()). */
+#ifdef CLOG_ZLIB
+#include <zlib.h>
+#define CLOG_COMPRESS_SUFFIX ".gz"
+#else
+#define CLOG_COMPRESS_SUFFIX ".lz"
+#endif
+
+/* Share of a CPU, in percent, the compressing thread may use. */
+#ifndef CLOG_COMPRESS_CPU
+#define CLOG_COMPRESS_CPU 10
+#endif
+
+/* Number of loggers with fixed ids (0 to CLOG_MAX_LOGGERS - 1).  Loggers
+ * created with clog_create_*() get ids from CLOG_MAX_LOGGERS up. */
 #define CLOG_MAX_LOGGERS 16
 
+/* Names of loggers must be shorter than this. */
+#define CLOG_NAME_LENGTH 64
+
 /* Format strings cannot be longer than this. */
 #define CLOG_FORMAT_LENGTH 256
 
@@ -98,6 +176,13 @@
  * they will not appear in the log. */
 #define CLOG_DATETIME_LENGTH 256
 
+/* Most lines handed to one writev() call. */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define CLOG_IOV_MAX IOV_MAX
+#else
+#define CLOG_IOV_MAX 1024
+#endif
+
 /* Default format strings. */
 #define CLOG_DEFAULT_FORMAT "%d %t %f(%n): %l: %m\n"
 #define CLOG_DEFAULT_DATE_FORMAT "%Y-%m-%d"
@@ -133,19 +218,146 @@ int clog_init_path(int id, const char *const path);
 
 /**
  * Rotate logger with the given file path.  The file will be rotated with .old
- * suffixes, and create new one.
+ * suffixes (or, with a rotation policy keeping old files, to path.1), and
+ * create new one.  The old file is synced and closed by a background thread,
+ * which also moves the older files up one to make room for it: until then,
+ * it waits under a name of its own next to path.
  *
  * @param id
  * A constant integer between 0 and 15 that uniquely identifies this logger.
  *
  * @param path
- * Path to the file where log messages will be written.
+ * Path to the file where log messages will be written, or NULL for the path
+ * the logger is writing to now.
  *
  * @return
  * Zero on success, non-zero on failure.
  */
 int clog_rotate(int id, const char *const path);
 
+/**
+ * Ask for a logger's file to be opened again by its path, after a tool such
+ * as logrotate has moved it away.  Only sets flags with atomic stores, taking
+ * no lock, so it is safe to call from a signal handler (a SIGHUP handler,
+ * say) where the atomics are lock-free.  The next log call wakes the
+ * background thread, which opens the path and switches the logger to the new
+ * file atomically: lines already being written finish in the old file, which
+ * is closed after them, and no line is lost.
+ *
+ * @param id
+ * The logger's id, or -1 for all loggers.
+ *
+ * @return
+ * Zero on success, non-zero if id is not a logger.  Loggers without a path
+ * ignore the request.
+ */
+int clog_request_reopen(int id);
+
+/**
+ * Open a logger's file again by its path, like clog_request_reopen() but at
+ * once.  Not for signal handlers.
+ *
+ * @param id
+ * The logger's id.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_reopen(int id);
+
+/**
+ * Rotate a logger's file automatically, once it has grown past max_bytes
+ * and at every multiple of interval_sec seconds of wall-clock time (so 3600
+ * rotates on the hour).  Log calls only count the bytes they write; the
+ * rotation itself is done by a background thread, shortly after.
+ *
+ * Old files are named path.1 (the newest) up to path.keep, and older ones
+ * are deleted.  With keep zero, only the last is kept, as path.old.
+ *
+ * Only for loggers that opened their file themselves.  Not available with
+ * CLOG_NO_THREADS.
+ *
+ * @param id
+ * The logger's id.
+ *
+ * @param max_bytes
+ * Size to rotate at, or zero for no limit.
+ *
+ * @param interval_sec
+ * Seconds between rotations, or zero for none.
+ *
+ * @param keep
+ * Number of old files to keep.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_rotation(int id, size_t max_bytes, unsigned int interval_sec,
+                      unsigned int keep);
+
+/**
+ * Compress the files rotated out of a logger: path.old (or path.1 and so
+ * on, see clog_set_rotation()) is replaced with path.old.gz when built with
+ * CLOG_ZLIB, or path.old.lz otherwise.  A background thread does it, at the
+ * lowest priority and using at most CLOG_COMPRESS_CPU percent of a CPU; log
+ * calls and rotations never wait for it.  Until it is done, the file is
+ * named path.rotated.PID.N, and it stays so if the program exits first.
+ * With CLOG_NO_THREADS, clog_rotate() compresses the file itself.
+ *
+ * @param id
+ * The logger's id.
+ *
+ * @param compress
+ * Non-zero to compress, zero not to.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_compress(int id, int compress);
+
+/**
+ * Uncompress a file compressed by clog without zlib (an .lz file).
+ *
+ * @param in_fd
+ * File descriptor to read the compressed file from.
+ *
+ * @param out_fd
+ * File descriptor to write its contents to.
+ *
+ * @return
+ * Zero on success, non-zero if the file is corrupt or cannot be read or
+ * written.
+ */
+int clog_uncompress(int in_fd, int out_fd);
+
+/**
+ * Have clog allocate memory with functions of the application's own rather
+ * than malloc(), realloc() and free().  Set them before initializing any
+ * logger, so that all memory goes back to the allocator it came from.
+ *
+ * Lines too long for the stack buffer of a log call (4096 bytes) are
+ * formatted in buffers each thread keeps for the next long line, up to
+ * CLOG_SCRATCH_MAX bytes each, so only a line longer than any before it on
+ * the thread reaches the allocator.  The buffers are released when the
+ * thread exits.
+ *
+ * @param malloc_fn
+ * Replaces malloc().
+ *
+ * @param realloc_fn
+ * Replaces realloc().
+ *
+ * @param free_fn
+ * Replaces free().  NULL for all three goes back to the standard functions.
+ *
+ * @return
+ * Zero on success, non-zero if only some of the functions are given or a
+ * logger is initialized.
+ */
+int clog_set_allocator(void *(*malloc_fn)(size_t),
+                       void *(*realloc_fn)(void *, size_t),
+                       void (*free_fn)(void *));
+
 /**
  * Create a new logger writing to a file descriptor.
  *
@@ -160,9 +372,172 @@ int clog_rotate(int id, const char *const path);
  */
 int clog_init_fd(int id, int fd);
 
+/**
+ * Create a new logger writing to the given file path, with an id chosen by
+ * clog.  The file will always be opened in append mode.
+ *
+ * @param name
+ * A unique name for the logger, shorter than CLOG_NAME_LENGTH, to find it
+ * with clog_lookup(); or NULL.
+ *
+ * @param path
+ * Path to the file where log messages will be written.
+ *
+ * @return
+ * The id of the new logger, for use like the fixed ids; or -1 on failure.
+ */
+int clog_create_path(const char *name, const char *const path);
+
+/**
+ * Create a new logger writing to a file descriptor, with an id chosen by
+ * clog.  See clog_create_path().
+ */
+int clog_create_fd(const char *name, int fd);
+
+/**
+ * Find a logger created with clog_create_path() or clog_create_fd() by name.
+ *
+ * @return
+ * The id of the logger, or -1 if there is no logger with that name (or name
+ * is NULL).
+ */
+int clog_lookup(const char *name);
+
+/**
+ * What an asynchronous logger does with a line when its ring buffer is full.
+ */
+enum clog_overflow {
+    /* Wait for the writer thread to make room (the default). */
+    CLOG_OVERFLOW_BLOCK,
+
+    /* Drop the line being logged. */
+    CLOG_OVERFLOW_DROP_NEWEST,
+
+    /* Drop DEBUG lines as soon as the ring is half full, keeping the rest of
+     * it for more important lines, which are dropped only when it is full. */
+    CLOG_OVERFLOW_DROP_DEBUG
+};
+
+/**
+ * Create a new asynchronous logger writing to the given file path.  Log calls
+ * format the line and queue it in a lock-free ring buffer; a background
+ * thread writes the queued lines out in batches, so callers never wait for
+ * the disk.  Lines longer than the ring buffer are written directly.
+ *
+ * @param id
+ * A constant integer between 0 and 15 that uniquely identifies this logger.
+ *
+ * @param path
+ * Path to the file where log messages will be written.
+ *
+ * @param ring_bytes
+ * Size of the ring buffer, rounded up to a power of two (at least 4096).
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_init_path_async(int id, const char *const path, size_t ring_bytes);
+
+/**
+ * Create a new asynchronous logger writing to a file descriptor.  See
+ * clog_init_path_async().
+ */
+int clog_init_fd_async(int id, int fd, size_t ring_bytes);
+
+/**
+ * Create a new logger writing to a memory-mapped file.  The file is extended
+ * and mapped a segment at a time, and log calls copy their lines into the
+ * mapping, without a system call; when a segment is full the next one is
+ * mapped.  Lines are in the kernel's page cache as soon as they are copied,
+ * so they survive a crash of the process (though not of the machine).  The
+ * unused end of the last segment is cut off when the logger is freed or
+ * rotated; after a crash it is left as zero bytes.
+ *
+ * Memory-mapped loggers cannot be buffered or asynchronous.  Not available
+ * on Windows or with CLOG_NO_THREADS.
+ *
+ * @param id
+ * A constant integer between 0 and 15 that uniquely identifies this logger.
+ *
+ * @param path
+ * Path to the file where log messages will be written.
+ *
+ * @param segment_bytes
+ * Size of the segments mapped, rounded up to whole pages.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_init_path_mmap(int id, const char *const path, size_t segment_bytes);
+
+/**
+ * Set what an asynchronous logger does when its ring buffer is full.
+ *
+ * @param id
+ * The identifier of the logger, which must be asynchronous.
+ *
+ * @param policy
+ * The new overflow policy.  The default is CLOG_OVERFLOW_BLOCK.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_overflow(int id, enum clog_overflow policy);
+
+/**
+ * Number of lines an asynchronous logger has dropped because of its overflow
+ * policy.
+ */
+unsigned long clog_dropped(int id);
+
+/**
+ * Buffer log lines in memory instead of writing each one as it is logged.
+ * The buffer is written out when the next line does not fit, when a line of
+ * the flush level (see clog_set_flush_level) or above is logged, every
+ * flush_ms milliseconds, on clog_flush() and clog_free(), and when the
+ * program exits.
+ *
+ * @param id
+ * The identifier of the logger, which must not be asynchronous.
+ *
+ * @param size
+ * Size of the buffer in bytes.  Zero writes out the buffer and turns
+ * buffering off again.
+ *
+ * @param flush_ms
+ * Write the buffer out at least this often, or zero for no time limit.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_buffer(int id, size_t size, unsigned int flush_ms);
+
+/**
+ * Set the level at which a buffered logger writes out its buffer right after
+ * the line is added.  The default is CLOG_ERROR.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_flush_level(int id, enum clog_level level);
+
+/**
+ * Write out all lines a logger has buffered or queued.  For asynchronous
+ * loggers, this waits until the writer thread has written every line queued
+ * before the call.
+ *
+ * @param id
+ * The identifier of the logger.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_flush(int id);
+
 /**
  * Destroy (clean up) a logger.  You should do this at the end of execution,
- * or when you are done using the logger.
+ * or when you are done using the logger.  Buffered and asynchronous loggers
+ * write out all pending lines first.
  *
  * @param id
  * The id of the logger to destroy.
@@ -203,6 +578,229 @@ void clog_error(const char *sfile, int sline, int id, const char *fmt, ...);
  */
 void clog_do(enum clog_level level, const char *sfile, int sline, int id, const char *fmt, ...);
 
+/* Bytes of the arguments of the last message a call site keeps for
+ * clog_set_dedup() to compare, beyond which it compares their hash. */
+#ifndef CLOG_DEDUP_BYTES
+#define CLOG_DEDUP_BYTES 32
+#endif
+
+/**
+ * A log call site, described once in a static variable rather than passed
+ * piece by piece on every call.  The log macros below define one for each
+ * call; CLOG_CALLSITE() initializes one by hand:
+ *
+ *     static struct clog_callsite site = CLOG_CALLSITE(CLOG_INFO);
+ *     clog_log_site(&site, MY_LOGGER_ID, "Opened %s.", path);
+ */
+struct clog_callsite {
+
+    /* The source file and line of the call, e.g. __FILE__ and __LINE__. */
+    const char *file;
+    int line;
+
+    /* The level of the lines logged. */
+    enum clog_level level;
+
+    /* The base name of file, as %f shows it.  NULL to have it worked out
+     * from file on first use. */
+    const char *name;
+
+    /* For clog_set_rate_limit(): when the next line is due, in
+     * microseconds, and the lines dropped since one was written. */
+    unsigned long due;
+    unsigned long limited;
+
+    /* For clog_set_dedup(): the times the last message was repeated since
+     * it was written.  A site with repeats to report is on its logger's
+     * list, through next_repeated. */
+    unsigned long repeats;
+    unsigned long repeat_listed;
+    struct clog_callsite *next_repeated;
+
+    /* For clog_set_dedup(): the last message, as its format and its
+     * arguments as binary records store them: a hash of them, their length
+     * and their first CLOG_DEDUP_BYTES.  Held through last_busy. */
+    const char *last_fmt;
+    unsigned long last_hash;
+    size_t last_len;
+    unsigned long last_busy;
+    unsigned char last_args[CLOG_DEDUP_BYTES];
+};
+
+/* The base name of the current file, where the compiler provides it. */
+#ifdef __FILE_NAME__
+#define CLOG_FILE_NAME_ __FILE_NAME__
+#else
+#define CLOG_FILE_NAME_ NULL
+#endif
+
+#define CLOG_CALLSITE(level) \
+    { __FILE__, __LINE__, level, CLOG_FILE_NAME_, 0, 0, 0, 0, 0, 0, 0, 0, 0, \
+      { 0 } }
+
+/**
+ * Log a message from a call site.
+ *
+ * @param site
+ * The call site, which must outlive the call (a static variable).
+ *
+ * @param id
+ * The id of the logger to write to.
+ *
+ * @param fmt
+ * The format string for the message (printf formatting).
+ *
+ * @param ...
+ * Any additional format arguments.
+ */
+void clog_log_site(struct clog_callsite *site, int id, const char *fmt, ...);
+
+/**
+ * Writes a message for clog_lazy() into buf, of size bytes, like snprintf():
+ * returns the length of the whole message, and is called again with a
+ * buffer large enough if that did not fit.  Negative on failure.
+ */
+typedef int (*clog_message_fn)(char *buf, size_t size, void *ctx);
+
+/**
+ * Log a message built by a callback, which only runs if the line is
+ * written: not when the level or a rate limit (see clog_set_rate_limit())
+ * filters it out.  Messages logged this way are not checked for repeats
+ * (see clog_set_dedup()).
+ *
+ *     clog_lazy(CLOG(MY_LOGGER_ID), CLOG_DEBUG, describe_state, state);
+ *
+ * @param level
+ * The level of the line.
+ *
+ * @param message
+ * Writes the message, given ctx.
+ */
+void clog_lazy(const char *sfile, int sline, int id, enum clog_level level,
+               clog_message_fn message, void *ctx);
+
+/* clog_lazy() from a call site, as used by CLOG_LAZY_(). */
+void clog_lazy_site(struct clog_callsite *site, int id,
+                    clog_message_fn message, void *ctx);
+
+/* clog_lazy() with a static call site, see CLOG_DEBUG_() below. */
+#define CLOG_LAZY_(level, id, message, ctx) \
+    do { \
+        static struct clog_callsite _clog_callsite_ = CLOG_CALLSITE(level); \
+        const int _clog_id_ = (id); \
+        if ((level) >= CLOG_COMPILE_LEVEL \
+            && _clog_expect(clog_enabled(_clog_id_, level), \
+                            (level) > CLOG_DEBUG)) { \
+            clog_lazy_site(&_clog_callsite_, _clog_id_, message, ctx); \
+        } \
+    } while (0)
+
+/* Types of the values of struct clog_field. */
+enum clog_field_type {
+    CLOG_FIELD_INT,
+    CLOG_FIELD_DOUBLE,
+    CLOG_FIELD_STRING,
+    CLOG_FIELD_BYTES
+};
+
+/**
+ * A key/value pair logged along with a message by clog_fields().  Make one
+ * with clog_int(), clog_double(), clog_str() or clog_bytes().
+ */
+struct clog_field {
+    const char *key;
+    enum clog_field_type type;
+    union {
+        long i;
+        double d;
+        const char *s;
+    } value;
+
+    /* Length of a string or bytes value. */
+    size_t len;
+};
+
+/**
+ * Log a message with fields.  Text lines show the fields after the message
+ * as key=value (strings quoted when they need to be, bytes in hex); in JSON
+ * mode (see clog_set_json()) each is a member of the line's object.
+ *
+ *     struct clog_field fields[] = {
+ *         clog_str("user", name), clog_int("status", status)
+ *     };
+ *     clog_fields(CLOG(MY_LOGGER_ID), CLOG_INFO, fields, 2, "Request done.");
+ *
+ * @param level
+ * The level of the line.
+ *
+ * @param fields
+ * The fields, which may be NULL if count is zero.
+ *
+ * @param count
+ * The number of fields.
+ *
+ * @param fmt
+ * The format string for the message (printf formatting).
+ */
+void clog_fields(const char *sfile, int sline, int id, enum clog_level level,
+                 const struct clog_field *fields, size_t count,
+                 const char *fmt, ...);
+
+/* clog_fields() from a call site. */
+void clog_fields_site(struct clog_callsite *site, int id,
+                      const struct clog_field *fields, size_t count,
+                      const char *fmt, ...);
+
+/* Log calls made with the macros below that are under this level compile to
+ * nothing.  Define it before including clog.h, e.g. as CLOG_INFO for release
+ * builds. */
+#ifndef CLOG_COMPILE_LEVEL
+#define CLOG_COMPILE_LEVEL CLOG_DEBUG
+#endif
+
+#ifdef CLOG_C99
+/**
+ * Log macros (one per level), for C99 and C++11:
+ *
+ *     CLOG_INFO_(MY_LOGGER_ID, "Opened %s.", path);
+ *
+ * Unlike the functions above, they check the logger's level inline, before
+ * evaluating the format arguments or making a call, and lines under
+ * CLOG_COMPILE_LEVEL are removed at compile time.  Each call site is a
+ * static struct clog_callsite, so a call passes one pointer for the file,
+ * line and level, and the file's base name is only worked out once.  The id
+ * is evaluated once.
+ */
+#define CLOG_DEBUG_(id, ...) CLOG_DO_(CLOG_DEBUG, id, __VA_ARGS__)
+#define CLOG_INFO_(id, ...) CLOG_DO_(CLOG_INFO, id, __VA_ARGS__)
+#define CLOG_WARN_(id, ...) CLOG_DO_(CLOG_WARN, id, __VA_ARGS__)
+#define CLOG_ERROR_(id, ...) CLOG_DO_(CLOG_ERROR, id, __VA_ARGS__)
+
+#define CLOG_DO_(level, id, ...) \
+    do { \
+        static struct clog_callsite _clog_callsite_ = CLOG_CALLSITE(level); \
+        const int _clog_id_ = (id); \
+        if ((level) >= CLOG_COMPILE_LEVEL \
+            && _clog_expect((level) >= _clog_level(_clog_id_), \
+                            (level) > CLOG_DEBUG)) { \
+            clog_log_site(&_clog_callsite_, _clog_id_, __VA_ARGS__); \
+        } \
+    } while (0)
+
+/* clog_fields() with a static call site. */
+#define CLOG_FIELDS_(level, id, fields, count, ...) \
+    do { \
+        static struct clog_callsite _clog_callsite_ = CLOG_CALLSITE(level); \
+        const int _clog_id_ = (id); \
+        if ((level) >= CLOG_COMPILE_LEVEL \
+            && _clog_expect((level) >= _clog_level(_clog_id_), \
+                            (level) > CLOG_DEBUG)) { \
+            clog_fields_site(&_clog_callsite_, _clog_id_, fields, count, \
+                             __VA_ARGS__); \
+        } \
+    } while (0)
+#endif
+
 /**
  * Set the minimum level of messages that should be written to the log.
  * Messages below this level will not be written.  By default, loggers are
@@ -253,8 +851,15 @@ int clog_set_date_fmt(int id, const char *fmt);
  *     %d: The current date, formatted using the logger's date format.
  *     %t: The current time, formatted using the logger's time format.
  *     %l: The log level (one of "DEBUG", "INFO", "WARN", or "ERROR").
+ *     %M: Milliseconds within the current second (3 digits).
+ *     %u: Microseconds within the current second (6 digits).
+ *     %N: Nanoseconds within the current second (9 digits).
+ *     %r: Seconds elapsed since the logger was created, from a monotonic
+ *         clock, with microseconds (e.g. "12.000345").
  *     %%: A literal percent sign.
  *
+ * For example, "%t.%u" gives times like "15:34:27.123456".
+ *
  * The default format string is CLOG_DEFAULT_FORMAT.
  *
  * @param fmt
@@ -266,14 +871,250 @@ int clog_set_date_fmt(int id, const char *fmt);
  */
 int clog_set_fmt(int id, const char *fmt);
 
-int clog_log(struct clog *logger, const char *data, size_t sz);
-
-/*
- * No need to read below this point.
- */
-
-/*
- * Portability stuff.
+/**
+ * Write binary records instead of text lines.  A log call then stores only a
+ * small header (time, level and call site) and the raw printf arguments,
+ * leaving all formatting to clog_decode(), or the clog_decode tool in
+ * tools/.  The format strings and file names of call sites are written once,
+ * so binary logging needs them to be string literals (as with CLOG()).
+ *
+ * Switch a logger to binary before it writes anything to its file, and do
+ * not mix text and binary output in one file.
+ *
+ * @param id
+ * The identifier of the logger.
+ *
+ * @param binary
+ * Non-zero for binary records, zero for text lines again.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_binary(int id, int binary);
+
+/**
+ * Write each line as a JSON object instead of with the logger's format:
+ *
+ *     {"time":"2024-05-01T12:00:00.123456Z","level":"INFO","file":"main.c",
+ *      "line":42,"msg":"Request done.","user":"bob","status":200}
+ *
+ * (on one line), with the time in UTC and any fields given to clog_fields()
+ * after the message.  Extra sinks with a format of their own still write
+ * text.  Binary loggers ignore this.
+ *
+ * @param id
+ * The identifier of the logger.
+ *
+ * @param json
+ * Non-zero for JSON lines, zero for text lines again.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_json(int id, int json);
+
+/**
+ * Limit how many lines each call site may write to a logger: on average
+ * lines_per_sec a second, in bursts of up to burst lines.  The next line a
+ * call site writes after some were dropped is preceded by a line saying how
+ * many.
+ *
+ * Call sites keep their state in their struct clog_callsite, so only calls
+ * made with the log macros or clog_log_site() are limited.  The checks take
+ * place before the message is formatted.
+ *
+ * @param id
+ * The identifier of the logger.
+ *
+ * @param lines_per_sec
+ * Lines a second allowed per call site, or zero for no limit (the default).
+ *
+ * @param burst
+ * Lines a call site may write at once after being quiet (at least 1).
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_rate_limit(int id, unsigned int lines_per_sec,
+                        unsigned int burst);
+
+/**
+ * Collapse identical consecutive messages from a call site: repeats are not
+ * written, and a "Last message repeated N times" line goes before the next
+ * different message from the call site, or out with clog_flush(),
+ * clog_free(), a rotation or (with threads) within about a second.
+ * Messages are compared by their format arguments, before formatting.
+ * Like clog_set_rate_limit(), this applies to calls made with the log
+ * macros or clog_log_site().
+ *
+ * @param id
+ * The identifier of the logger.
+ *
+ * @param dedup
+ * Non-zero to collapse repeats, zero to write them all (the default).
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_dedup(int id, int dedup);
+
+/**
+ * Send a logger's lines to one more destination (a sink), besides the file
+ * descriptor or path it was initialized with.  Lines must pass the
+ * logger's level, and then the sink's own.  The message of a line is only
+ * formatted once for all sinks, and sinks in the logger's format share the
+ * whole line.  Sinks are written to directly, without the logger's
+ * buffering or asynchronous writer, and are not rotated.
+ *
+ * @param id
+ * The identifier of the logger.
+ *
+ * @param fd
+ * The file descriptor to write to; the caller keeps ownership of it.
+ *
+ * @param level
+ * The minimum level of lines written to the sink.
+ *
+ * @param fmt
+ * The format of lines for the sink, as for clog_set_fmt(), or NULL for the
+ * logger's.  Dates and times use the logger's formats at the time of the
+ * call.
+ *
+ * @return
+ * A number identifying the sink, for clog_remove_sink(), or -1 on failure.
+ */
+int clog_add_sink_fd(int id, int fd, enum clog_level level, const char *fmt);
+
+/**
+ * Like clog_add_sink_fd(), for a file that clog opens and closes.
+ */
+int clog_add_sink_path(int id, const char *path, enum clog_level level,
+                       const char *fmt);
+
+/**
+ * Stop writing to a sink added with clog_add_sink_fd() or
+ * clog_add_sink_path().
+ *
+ * @param id
+ * The identifier of the logger.
+ *
+ * @param sink
+ * The number the sink was added as.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_remove_sink(int id, int sink);
+
+/**
+ * Get the number of lines a logger did not write because of
+ * clog_set_rate_limit() or clog_set_dedup().
+ *
+ * @param id
+ * The identifier of the logger.
+ *
+ * @return
+ * The number of lines suppressed, or zero if there is no such logger.
+ */
+unsigned long clog_suppressed(int id);
+
+/**
+ * Counters of a logger since it was initialized (see clog_stats()).  They
+ * are kept per group of threads and added up when read, so they cost log
+ * calls no locking, and a snapshot taken while other threads log may be a
+ * few lines behind.
+ */
+struct clog_stats {
+
+    /* Lines written, or queued, buffered or mapped to be, and their bytes
+     * (sinks not included). */
+    unsigned long lines;
+    unsigned long bytes;
+
+    /* Calls to the log functions under the logger's level.  The log macros
+     * check the level inline, so their calls are not counted. */
+    unsigned long filtered;
+
+    /* Lines not written because of the rate limit or as repeats (as
+     * clog_suppressed()), or because the queue was full (as
+     * clog_dropped()). */
+    unsigned long suppressed;
+    unsigned long dropped;
+
+    /* Lines too long for the stack buffer of a log call, formatted in heap
+     * memory. */
+    unsigned long heap_lines;
+
+    /* write() calls that failed, and that were retried after EAGAIN or
+     * EINTR. */
+    unsigned long write_errors;
+    unsigned long write_retries;
+
+    /* Time spent in write(), in microseconds, while clog_set_write_timing()
+     * is on. */
+    unsigned long write_usec;
+};
+
+/**
+ * Get the counters of a logger.
+ *
+ * @param id
+ * The identifier of the logger.
+ *
+ * @param stats
+ * Filled in with the counters.
+ *
+ * @return
+ * Zero on success, non-zero if there is no such logger.
+ */
+int clog_stats(int id, struct clog_stats *stats);
+
+/**
+ * Time the writes of a logger for clog_stats().  Off by default, as it reads
+ * the clock twice for each write.
+ *
+ * @param id
+ * The identifier of the logger.
+ *
+ * @param timing
+ * Non-zero to time writes, zero not to.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_write_timing(int id, int timing);
+
+/**
+ * Render a binary log as text.  A call site's SITE record is written before
+ * any record from it, except that a call site first used while the logger
+ * switched files may have records in the new file ahead of its SITE record
+ * there.  So the log is read whole, and records matched with the call sites
+ * of their session wherever they are in it.
+ *
+ * @param in_fd
+ * The binary log to read, to its end.
+ *
+ * @param out_fd
+ * Where to write the lines.
+ *
+ * @param fmt, date_fmt, time_fmt
+ * The formats to render lines with, as for clog_set_fmt(),
+ * clog_set_date_fmt() and clog_set_time_fmt(); NULL for the defaults.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_decode(int in_fd, int out_fd, const char *fmt,
+                const char *date_fmt, const char *time_fmt);
+
+int clog_log(struct clog *logger, const char *data, size_t sz);
+
+/*
+ * No need to read below this point.
+ */
+
+/*
+ * Portability stuff.
  */
 
 /* This is not portable, but should work on old Visual C++ compilers. Visual
@@ -284,6 +1125,354 @@ int clog_log(struct clog *logger, const char *data, size_t sz);
 #endif
 #endif
 
+/* Atomic operations, using the GCC/Clang builtins. */
+#if defined(__GNUC__) || defined(__clang__)
+#define _clog_load(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define _clog_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define _clog_load_relaxed(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define _clog_store(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define _clog_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define _clog_cas(p, expected, desired) \
+    __atomic_compare_exchange_n(p, expected, desired, 0, \
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define _clog_add(p, v) __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define _clog_sub(p, v) __atomic_fetch_sub(p, v, __ATOMIC_SEQ_CST)
+#define _clog_count(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define _clog_swap(p, v) __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#else
+/* Not atomic: only safe when a logger is used from a single thread. */
+#define _clog_load(p) (*(p))
+#define _clog_load_acquire(p) (*(p))
+#define _clog_load_relaxed(p) (*(p))
+#define _clog_store(p, v) (*(p) = (v))
+#define _clog_store_release(p, v) (*(p) = (v))
+#define _clog_cas(p, expected, desired) \
+    (*(p) == *(expected) ? (*(p) = (desired), 1) : (*(expected) = *(p), 0))
+#define _clog_add(p, v) (*(p) += (v))
+#define _clog_sub(p, v) (*(p) -= (v))
+#define _clog_count(p, v) (*(p) += (v))
+#define _clog_swap(p, v) _clog_swap_ulong(p, v)
+#define CLOG_SWAP_FUNCTION
+#endif
+
+#if defined(__cplusplus) \
+    || (defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L)
+#define CLOG_INLINE static inline
+#elif defined(__GNUC__)
+#define CLOG_INLINE static __inline__
+#else
+#define CLOG_INLINE static
+#endif
+
+/* Branch prediction hint: cond is expected to be (constant) likely. */
+#if defined(__GNUC__) || defined(__clang__)
+#define _clog_expect(cond, likely) __builtin_expect(!!(cond), likely)
+#else
+#define _clog_expect(cond, likely) (cond)
+#endif
+
+#ifdef CLOG_SWAP_FUNCTION
+CLOG_INLINE unsigned long
+_clog_swap_ulong(unsigned long *p, unsigned long v)
+{
+    unsigned long old = *p;
+    *p = v;
+    return old;
+}
+#endif
+
+/* Thread-local storage. */
+#if defined(__GNUC__) || defined(__clang__)
+#define CLOG_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define CLOG_THREAD_LOCAL __declspec(thread)
+#else
+#define CLOG_THREAD_LOCAL
+#endif
+
+/* Assumed size of a cache line, to keep counters of different threads
+ * apart. */
+#define CLOG_CACHE_LINE 64
+
+/**
+ * Operations of a compiled format string.
+ */
+enum clog_op_code {
+    CLOG_OP_LITERAL,
+    CLOG_OP_DATE,
+    CLOG_OP_TIME,
+    CLOG_OP_FILE,
+    CLOG_OP_LINE,
+    CLOG_OP_LEVEL,
+    CLOG_OP_MESSAGE,
+    CLOG_OP_MSEC,
+    CLOG_OP_USEC,
+    CLOG_OP_NSEC,
+    CLOG_OP_ELAPSED
+};
+
+/* Clocks a compiled format reads (clog_format.clocks). */
+#define CLOG_CLOCK_SECONDS 1
+#define CLOG_CLOCK_PRECISE 2
+#define CLOG_CLOCK_MONOTONIC 4
+
+struct clog_op {
+    /* One of enum clog_op_code. */
+    unsigned char code;
+
+    /* For CLOG_OP_LITERAL: the run of text within clog_format.text. */
+    unsigned short offset;
+    unsigned short length;
+};
+
+/**
+ * A format string compiled by clog_set_fmt(), so that log calls only walk a
+ * short list of operations instead of parsing the format every time.
+ */
+struct clog_format {
+
+    /* The operations, in output order. */
+    struct clog_op ops[CLOG_FORMAT_LENGTH];
+    size_t num_ops;
+
+    /* Literal runs, each terminated by a NUL. */
+    char text[2 * CLOG_FORMAT_LENGTH];
+
+    /* CLOG_CLOCK_* flags for the time substitutions used. */
+    int clocks;
+
+    /* The date and time formats for %d and %t.  They are part of the
+     * compiled format so that a log call sees all three formats change at
+     * once. */
+    char date_fmt[CLOG_FORMAT_LENGTH];
+    char time_fmt[CLOG_FORMAT_LENGTH];
+
+    /* Unique number of this compiled format, keying rendered dates and
+     * times in struct clog_time_cache. */
+    unsigned long generation;
+};
+
+/* Number of dates and times each thread keeps rendered. */
+#define CLOG_TIME_CACHES 4
+
+/**
+ * Date and time rendered with a format's date_fmt and time_fmt for one
+ * second, so strftime runs at most once per second.  Each thread has its own
+ * (see _clog_time_caches), so no locking is needed.
+ */
+struct clog_time_cache {
+
+    /* Generation of the format rendered, zero when empty. */
+    unsigned long generation;
+    time_t sec;
+
+    char date[CLOG_DATETIME_LENGTH];
+    size_t date_len;
+    char time[CLOG_DATETIME_LENGTH];
+    size_t time_len;
+};
+
+/* Buffers a thread keeps for long lines: a log call may need the line, the
+ * message and a sink's line at once. */
+#define CLOG_SCRATCH_BUFS 4
+
+/* Largest buffer kept for the next long line. */
+#ifndef CLOG_SCRATCH_MAX
+#define CLOG_SCRATCH_MAX (1 << 20)
+#endif
+
+/**
+ * Heap buffers a thread has grown lines into and reuses for later long
+ * lines (see _clog_scratch).  Free slots hold NULL.
+ */
+struct clog_scratch {
+    char *data[CLOG_SCRATCH_BUFS];
+    size_t size[CLOG_SCRATCH_BUFS];
+
+    /* The free function of the allocator the buffers came from. */
+    void (*free_fn)(void *);
+
+    /* Whether the buffers are released when the thread exits. */
+    int registered;
+};
+
+/* Threads get one of these stripes of read-side counters. */
+#define CLOG_RCU_STRIPES 8
+
+/* Counters of struct clog_stats kept per stripe of threads. */
+enum clog_counter {
+    CLOG_COUNT_LINES,
+    CLOG_COUNT_BYTES,
+    CLOG_COUNT_HEAP,
+    CLOG_COUNT_ERRORS,
+    CLOG_COUNT_RETRIES,
+    CLOG_COUNT_WRITE_USEC,
+    CLOG_COUNTERS
+};
+
+/**
+ * A logger's counters for the threads of one stripe (see _clog_stripe),
+ * on cache lines of their own.
+ */
+struct clog_counters {
+    unsigned long counts[CLOG_COUNTERS];
+    char pad[CLOG_CACHE_LINE
+             - CLOG_COUNTERS * sizeof(unsigned long) % CLOG_CACHE_LINE];
+};
+
+/**
+ * Read-side critical sections of one logger slot, in the manner of RCU.  A
+ * log call counts itself in readers[epoch & 1] of its thread's stripe while
+ * it uses the logger in the slot.  To replace or retire something a log call
+ * may be using, the logger, its fd, format or buffer, clog publishes the
+ * replacement, flips epoch and waits for the counters of the old epoch to
+ * drop to zero (_clog_synchronize).
+ */
+struct clog_rcu {
+
+    unsigned int epoch;
+    char pad[CLOG_CACHE_LINE - sizeof(unsigned int)];
+
+    struct {
+        unsigned long readers[2];
+        char pad[CLOG_CACHE_LINE - 2 * sizeof(unsigned long)];
+    } stripes[CLOG_RCU_STRIPES];
+};
+
+/* Types of binary records. */
+#define CLOG_BINARY_START 1
+#define CLOG_BINARY_SITE 2
+#define CLOG_BINARY_LOG 3
+#define CLOG_BINARY_TEXT 4
+
+/* Start of the payload of START records. */
+#define CLOG_BINARY_MAGIC "CLOGBIN1"
+
+/**
+ * Header of a binary record, followed by its payload:
+ *
+ *   START: CLOG_BINARY_MAGIC, then the sizes of int, long, long double and
+ *          pointers as bytes.  Begins a session, which has its own call site
+ *          ids; sec and nsec are the logger's creation time, for %r.
+ *   SITE:  The call site numbered site: the line (an int), then the source
+ *          file and the format string, each an unsigned int length
+ *          followed by the text and a NUL.
+ *   LOG:   A log call at call site site: its printf arguments, each stored
+ *          as its native type, strings as for SITE (length ~0 for NULL).
+ *          Width and precision arguments come first, as int.
+ *   TEXT:  A log call whose arguments could not be stored: the formatted
+ *          message.
+ *
+ * Everything is written in native byte order and sizes, for decoding on the
+ * same kind of machine.
+ */
+struct clog_binary_header {
+
+    /* Bytes in the record, header included. */
+    unsigned int size;
+
+    unsigned short type;
+    unsigned short level;
+    unsigned int site;
+
+    /* Time of the log call. */
+    unsigned int nsec;
+    long sec;
+};
+
+/* Call sites a binary logger can number. */
+#define CLOG_SITES 2048
+
+/**
+ * A call site of a binary logger, identified by the format string, source
+ * file and line passed to the log call.
+ */
+struct clog_site {
+
+    /* Claims the entry, then file and line are set, then id is published
+     * (zero until then). */
+    const char *fmt;
+    const char *file;
+    int line;
+    unsigned int id;
+};
+
+/**
+ * Call sites a binary logger has written out, in an open addressing hash
+ * table keyed by the fmt pointer.  Entries are never removed.
+ */
+struct clog_sites {
+
+    struct clog_site sites[CLOG_SITES];
+    unsigned int next_id;
+};
+
+/* How a printf argument is passed, and stored in LOG records. */
+enum clog_arg_type {
+    CLOG_ARG_NONE,      /* %% */
+    CLOG_ARG_INT,       /* Also char and short, promoted to int */
+    CLOG_ARG_LONG,
+    CLOG_ARG_LLONG,
+    CLOG_ARG_SIZE,
+    CLOG_ARG_PTRDIFF,
+    CLOG_ARG_INTMAX,
+    CLOG_ARG_DOUBLE,
+    CLOG_ARG_LDOUBLE,
+    CLOG_ARG_POINTER,
+    CLOG_ARG_STRING,
+    CLOG_ARG_UNSUPPORTED /* Wide characters, %n and unknown conversions */
+};
+
+/* A printf conversion specification. */
+struct clog_conv {
+    enum clog_arg_type type;
+
+    /* Set if the width or precision is an argument (a '*'). */
+    int width_star;
+    int precision_star;
+
+    /* The precision given in the specification, or -1. */
+    int precision;
+};
+
+/* A call site read back by clog_decode(), pointing into the log read. */
+struct clog_decoded_site {
+    const char *fmt;
+    const char *file;
+    int line;
+};
+
+/* Sinks a logger can have besides its own file. */
+#define CLOG_MAX_SINKS 8
+
+/**
+ * An extra destination of a logger's lines (see clog_add_sink_fd()).
+ */
+struct clog_sink {
+
+    /* Number given out by clog_add_sink_*(). */
+    int id;
+
+    int fd;
+
+    /* Set if clog opened fd. */
+    int opened;
+
+    enum clog_level level;
+
+    /* The sink's own format, or NULL for the logger's. */
+    struct clog_format *format;
+};
+
+/**
+ * The sinks of a logger.  Replaced as a whole when sinks are added or
+ * removed, so log calls see a consistent list.
+ */
+struct clog_sinks {
+    int count;
+    struct clog_sink *sinks[CLOG_MAX_SINKS];
+};
+
 /**
  * The C logger structure.
  */
@@ -298,6 +1487,9 @@ struct clog {
     /* The format specifier. */
     char fmt[CLOG_FORMAT_LENGTH];
 
+    /* The format specifier, compiled. */
+    struct clog_format *format;
+
     /* Date format */
     char date_fmt[CLOG_FORMAT_LENGTH];
 
@@ -309,384 +1501,6243 @@ struct clog {
 
     /* If is atty, flush data */
     int isatty;
-};
 
-void _clog_err(const char *fmt, ...);
+    /* Monotonic time of creation, for %r. */
+    struct timespec start;
 
-#ifdef CLOG_MAIN
-struct clog *_clog_loggers[CLOG_MAX_LOGGERS] = { 0 };
-#else
-extern struct clog *_clog_loggers[CLOG_MAX_LOGGERS];
-#endif
+    /* Queue and writer thread in asynchronous mode, otherwise NULL. */
+    struct clog_async *async;
 
-#ifdef CLOG_MAIN
+    /* Line buffer in buffered mode, otherwise NULL. */
+    struct clog_buffer *buffer;
 
-#ifdef WIN32
-#define fsync _commit
-#endif
+    /* Mapped segments of a memory-mapped logger, otherwise NULL. */
+    struct clog_mmap *mapped;
 
-const char *const CLOG_LEVEL_NAMES[] = {
-    "DEBUG",
-    "INFO",
-    "WARN",
-    "ERROR",
-};
+    /* Lines of this level and above write out the buffer at once. */
+    enum clog_level flush_level;
 
-int
-clog_init_path(int id, const char *const path)
-{
-    int fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0666);
-    if (fd == -1) {
-        _clog_err("Unable to open %s: %s\n", path, strerror(errno));
-        return 1;
-    }
-    if (clog_init_fd(id, fd)) {
-        close(fd);
+    /* The slot this logger was created for. */
+    int id;
+
+    /* Name given to clog_create_*(), or empty. */
+    char name[CLOG_NAME_LENGTH];
+
+    /* Set to write binary records, with the call sites seen so far (which
+     * are kept if binary is cleared again). */
+    int binary;
+    struct clog_sites *sites;
+
+    /* Set by clog_set_rate_limit(): microseconds between lines (zero for no
+     * limit), and how far ahead of time a burst may go. */
+    unsigned long rate_interval;
+    unsigned long rate_burst;
+
+    /* Set by clog_set_dedup(), and the call sites with repeats not yet
+     * reported. */
+    int dedup;
+    struct clog_callsite *repeated;
+
+    /* Lines dropped by the rate limit or as repeats. */
+    unsigned long suppressed;
+
+    /* Extra destinations, or NULL for none, and the number for the next
+     * one added. */
+    struct clog_sinks *sinks;
+    int next_sink;
+
+    /* Path of the file, if the logger opened it. */
+    char *path;
+
+    /* Set by clog_set_rotation(). */
+    size_t rotate_bytes;
+    unsigned int rotate_interval;
+    unsigned int rotate_keep;
+
+    /* Bytes written since the last rotation, when the next time-based one
+     * is due, and set once a log call has asked for a rotation. */
+    size_t written;
+    time_t rotate_due;
+    unsigned long rotate_requested;
+
+    /* Set by clog_set_compress(). */
+    int compress;
+
+    /* Set by clog_set_json(). */
+    int json;
+
+    /* For clog_stats(), and set by clog_set_write_timing(). */
+    struct clog_counters counters[CLOG_RCU_STRIPES];
+    int write_timing;
+};
+
+/**
+ * A line being formatted.  It starts out in a caller-provided (stack) buffer
+ * and moves to the heap only if it outgrows it.
+ */
+struct clog_buf {
+
+    /* The text so far, always NUL terminated. */
+    char *data;
+    size_t len;
+
+    /* Capacity of data. */
+    size_t size;
+
+    /* The initial buffer, which must not be freed. */
+    char *stack;
+
+    /* Set if memory ran out and the line is incomplete. */
+    int failed;
+};
+
+/**
+ * The message of a line: formatted from fmt and ap, or if message is not
+ * NULL, written by it given ctx, and followed by count fields.  The line
+ * formatter puts it in place of the first %m and records where in offset
+ * and len, so the text can be used again without formatting it twice.
+ */
+struct clog_text {
+    const char *fmt;
+    va_list ap;
+    clog_message_fn message;
+    void *ctx;
+    const struct clog_field *fields;
+    size_t count;
+
+    /* Where the message is in the line, or CLOG_TEXT_UNPLACED. */
+    size_t offset;
+    size_t len;
+};
+
+#define CLOG_TEXT_UNPLACED ((size_t) -1)
+
+/* Bit of clog_buffer.state selecting the buffer being filled. */
+#define CLOG_BUFFER_SWAP ((size_t) 1 << (sizeof(size_t) * 8 - 1))
+
+/**
+ * State of a buffered logger.  Lines are copied into one of two buffers
+ * while the other one is written out.  state holds the CLOG_BUFFER_SWAP bit
+ * and the bytes reserved in the current buffer; writers reserve space by
+ * advancing it with compare-and-swap, counting themselves in writers[] until
+ * their copy is done.  A flush switches buffers and waits for the old one's
+ * writers to finish before writing it.
+ */
+struct clog_buffer {
+
+    char *data[2];
+    size_t size;
+
+    size_t state;
+    size_t writers[2];
+
+    /* Only one flush at a time. */
+    int flushing;
+
+    /* The buffer this one replaced, while log calls may still be adding to
+     * it.  Flushes write it out first, keeping lines in order. */
+    struct clog_buffer *previous;
+
+    /* Interval of time-based flushes, and monotonic time of the last flush,
+     * both in milliseconds. */
+    unsigned int flush_ms;
+    unsigned long last_flush;
+};
+
+#ifdef CLOG_THREADS
+/**
+ * State of an asynchronous logger: a multi-producer, single-consumer ring of
+ * records, each an unsigned int header followed by the line, padded to 8
+ * bytes.  Producers reserve space by advancing head with compare-and-swap,
+ * copy their line in and then publish the header.  The writer thread writes
+ * out published records with one writev() call, zeroes them and advances
+ * tail.
+ */
+struct clog_async {
+
+    char *ring;
+    size_t size;
+
+    /* Total bytes ever reserved (head) and consumed (tail). */
+    size_t head;
+    size_t tail;
+
+    enum clog_overflow overflow;
+    unsigned long dropped;
+
+    /* Queued lines, handed to writev() straight from the ring. */
+    struct iovec iov[CLOG_IOV_MAX];
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+
+    /* Set while there is a writer thread: cleared in the child of a fork()
+     * until its first log call starts one. */
+    int running;
+
+    /* Set while the writer waits for wakeup. */
+    int sleeping;
+
+    /* Set by clog_free: write what is queued, then exit. */
+    int stop;
+};
+#endif
+
+#ifdef CLOG_MMAP
+/* Set in a segment's reserved count once it takes no more lines. */
+#define CLOG_SEGMENT_CLOSED (~(~(size_t) 0 >> 1))
+
+/**
+ * A mapped segment of the file of a memory-mapped logger.  Writers reserve
+ * space by advancing reserved with compare-and-swap, copy their line in and
+ * add its length to committed.  The segment is unmapped once closed and
+ * committed has caught up with reserved.
+ */
+struct clog_segment {
+
+    char *map;
+    size_t size;
+
+    /* File descriptor and offset of map in the file, a multiple of the
+     * page size. */
+    int fd;
+    off_t offset;
+
+    /* Bytes of map reserved (including any before the segment's first
+     * line), plus CLOG_SEGMENT_CLOSED, and bytes copied. */
+    size_t reserved;
+    size_t committed;
+
+    /* The segment this one replaced.  A log call may still be looking at
+     * it, so it is only freed by clog_rotate() and clog_free(); the
+     * background thread unmaps it once its last line is copied. */
+    struct clog_segment *retired;
+};
+
+/**
+ * State of a memory-mapped logger.
+ */
+struct clog_mmap {
+
+    size_t segment_bytes;
+    struct clog_segment *segment;
+
+    /* The next segment, mapped ahead by the background thread from the
+     * last page of the current one on (and a page longer), or NULL. */
+    struct clog_segment *spare;
+
+    /* Held while mapping the next segment. */
+    pthread_mutex_t lock;
+};
+#endif
+
+/* States of clog_callsite.repeat_listed: not on its logger's list, on it
+ * and repeated since the background thread last looked, on it and not, and
+ * a call site on the stack. */
+#define CLOG_REPEATS_UNLISTED 0
+#define CLOG_REPEATS_FRESH 1
+#define CLOG_REPEATS_AGED 2
+#define CLOG_REPEATS_TRANSIENT 3
+
+#ifdef CLOG_THREADS
+/* A rotated file waiting to be compressed, under a name of its own until it
+ * takes its place among the logger's rotated files. */
+struct clog_compress_job {
+    char *path;
+    /* The logger's path, and the number of the rotated file (0 for .old),
+     * which goes up as later rotations move the files. */
+    char *base;
+    unsigned int slot;
+    unsigned int keep;
+    struct clog_compress_job *next;
+};
+#endif
+
+void _clog_err(const char *fmt, ...);
+struct clog_format *_clog_compile_format(const char *fmt,
+                                         const char *date_fmt,
+                                         const char *time_fmt);
+void _clog_monotonic(struct timespec *ts);
+int _clog_write(struct clog *logger, enum clog_level level,
+                const char *data, size_t sz);
+int _clog_start_async(struct clog *logger, size_t ring_bytes);
+void _clog_stop_async(struct clog *logger);
+void _clog_register_atexit(void);
+int _clog_flush(struct clog *logger);
+int _clog_encode(struct clog *logger, struct clog_buf *b,
+                 const char *sfile, int sline, enum clog_level level,
+                 const char *fmt, va_list ap);
+void _clog_binary_start(struct clog *logger, struct clog_buf *b);
+void _clog_dump_sites(struct clog *logger, struct clog_buf *b,
+                      unsigned int first);
+ssize_t _clog_write_all(int fd, const char *data, size_t sz);
+unsigned int _clog_my_stripe(void);
+unsigned long *_clog_filtered_slot(int id, unsigned int stripe);
+unsigned long *_clog_reopen_slot(int id);
+void _clog_count_filtered(int id);
+void _clog_add_stat(struct clog *logger, enum clog_counter counter,
+                    unsigned long n);
+ssize_t _clog_write_fd(struct clog *logger, const char *data, size_t sz);
+int _clog_format_line(const struct clog_format *format,
+                      const struct timespec *start, struct clog_buf *b,
+                      const char *sfile, int sline, enum clog_level level,
+                      const struct timespec *when, const char *fmt,
+                      va_list ap);
+int _clog_format_text(const struct clog_format *format,
+                      const struct timespec *start, struct clog_buf *b,
+                      const char *sfile, int sline, enum clog_level level,
+                      const struct timespec *when, struct clog_text *text);
+void _clog_append_text(struct clog_buf *b, struct clog_text *text);
+void _clog_buf_init(struct clog_buf *b, char *stack, size_t size);
+void *_clog_malloc(size_t size);
+void *_clog_calloc(size_t count, size_t size);
+void *_clog_realloc(void *p, size_t size);
+void _clog_free(void *p);
+void _clog_free_sink(struct clog_sink *sink);
+int _clog_mmap_write(struct clog *logger, const char *data, size_t sz);
+int _clog_mmap_switch(struct clog *logger, int fd);
+void _clog_mmap_retire(struct clog *logger);
+void _clog_stop_mmap(struct clog *logger);
+void _clog_mmap_tend(struct clog *logger);
+void _clog_report_repeats(struct clog *logger, int aged_only);
+void _clog_note(struct clog *logger, struct clog_callsite *site,
+                const char *fmt, ...);
+const char *_clog_site_name(struct clog_callsite *site);
+int _clog_bg_schedule(unsigned int interval);
+void _clog_bg_tend_mmap(void);
+void _clog_watch_fork(void);
+void _clog_after_fork(void);
+void _clog_destroy(struct clog *logger);
+void _clog_close_later(int fd);
+void _clog_shift_later(const char *path, unsigned int keep,
+                       const char *old_path, int compress);
+void _clog_bg_shift(void);
+void _clog_compress_name(const char *path, char *old_path, size_t size);
+void _clog_compress_later(const char *path, const char *old_path,
+                          unsigned int keep);
+void _clog_compress_shift(const char *path);
+void _clog_compress_shift_done(void);
+void _clog_buf_free(struct clog_buf *b);
+int _clog_buffer_flush(struct clog *logger, struct clog_buffer *buffer);
+void _clog_free_buffer(struct clog_buffer *buffer);
+struct clog *_clog_get(int id);
+int _clog_id_limit(void);
+struct clog_rcu *_clog_rcu_of(int id);
+unsigned int _clog_read_lock(int id);
+void _clog_read_unlock(int id, unsigned int token);
+void _clog_synchronize(int id);
+void _clog_lock_config(void);
+void _clog_unlock_config(void);
+
+#ifdef CLOG_MAIN
+struct clog *_clog_loggers[CLOG_MAX_LOGGERS] = { 0 };
+#else
+extern struct clog *_clog_loggers[CLOG_MAX_LOGGERS];
+#endif
+
+/* The level of each logger, readable without entering the logger, for inline
+ * checks.  CLOG_DEBUG while there is no logger, so that logging to it still
+ * reports the error. */
+#ifdef CLOG_MAIN
+int _clog_levels[CLOG_MAX_LOGGERS] = { 0 };
+#else
+extern int _clog_levels[CLOG_MAX_LOGGERS];
+#endif
+
+/* Created loggers live in chunks of this many, allocated as needed and never
+ * freed, so the registry grows without moving anything a log call may be
+ * looking at. */
+#define CLOG_CHUNK_SIZE 64
+#define CLOG_MAX_CHUNKS 1024
+
+/**
+ * A chunk of the registry of created loggers, for ids CLOG_MAX_LOGGERS +
+ * CLOG_CHUNK_SIZE * (index of the chunk) up.
+ */
+struct clog_chunk {
+
+    /* Like _clog_loggers and _clog_levels. */
+    struct clog *loggers[CLOG_CHUNK_SIZE];
+    int levels[CLOG_CHUNK_SIZE];
+
+    /* Read-side sections of all loggers in the chunk. */
+    struct clog_rcu rcu;
+
+    /* Like _clog_filtered and _clog_reopens. */
+    unsigned long filtered[CLOG_RCU_STRIPES][CLOG_CHUNK_SIZE];
+    unsigned long reopens[CLOG_CHUNK_SIZE];
+};
+
+#ifdef CLOG_MAIN
+struct clog_chunk *_clog_chunks[CLOG_MAX_CHUNKS] = { 0 };
+int _clog_num_chunks = 0;
+#else
+extern struct clog_chunk *_clog_chunks[CLOG_MAX_CHUNKS];
+extern int _clog_num_chunks;
+#endif
+
+/* The registry entry of logger id, or NULL for ids that cannot have a
+ * logger. */
+CLOG_INLINE struct clog_chunk *
+_clog_chunk(int id)
+{
+    unsigned int index = (unsigned int) id - CLOG_MAX_LOGGERS;
+    if (index >= CLOG_MAX_CHUNKS * CLOG_CHUNK_SIZE) {
+        return NULL;
+    }
+    return _clog_load_acquire(&_clog_chunks[index / CLOG_CHUNK_SIZE]);
+}
+
+CLOG_INLINE struct clog **
+_clog_slot(int id)
+{
+    struct clog_chunk *chunk;
+    if ((unsigned int) id < CLOG_MAX_LOGGERS) {
+        return &_clog_loggers[id];
+    }
+    chunk = _clog_chunk(id);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    return &chunk->loggers[(id - CLOG_MAX_LOGGERS) % CLOG_CHUNK_SIZE];
+}
+
+CLOG_INLINE int *
+_clog_level_slot(int id)
+{
+    struct clog_chunk *chunk;
+    if ((unsigned int) id < CLOG_MAX_LOGGERS) {
+        return &_clog_levels[id];
+    }
+    chunk = _clog_chunk(id);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    return &chunk->levels[(id - CLOG_MAX_LOGGERS) % CLOG_CHUNK_SIZE];
+}
+
+/* The level of logger id, for the inline checks. */
+CLOG_INLINE int
+_clog_level(int id)
+{
+    int *level = _clog_level_slot(id);
+    return level ? _clog_load_relaxed(level) : (int) CLOG_DEBUG;
+}
+
+/**
+ * Whether logger id would write a line of level, as far as levels go, so
+ * that expensive arguments are only built when needed:
+ *
+ *     if (clog_enabled(MY_LOGGER_ID, CLOG_DEBUG)) {
+ *         ...
+ *     }
+ *
+ * Levels under CLOG_COMPILE_LEVEL are never enabled.  Inline, without
+ * locking.
+ */
+CLOG_INLINE int
+clog_enabled(int id, enum clog_level level)
+{
+    return (int) level >= CLOG_COMPILE_LEVEL
+           && (int) level >= _clog_level(id);
+}
+
+/* Fields for clog_fields().  Strings and bytes are not copied, and must last
+ * until the call returns. */
+CLOG_INLINE struct clog_field
+clog_int(const char *key, long value)
+{
+    struct clog_field field;
+    field.key = key;
+    field.type = CLOG_FIELD_INT;
+    field.value.i = value;
+    field.len = 0;
+    return field;
+}
+
+CLOG_INLINE struct clog_field
+clog_double(const char *key, double value)
+{
+    struct clog_field field;
+    field.key = key;
+    field.type = CLOG_FIELD_DOUBLE;
+    field.value.d = value;
+    field.len = 0;
+    return field;
+}
+
+CLOG_INLINE struct clog_field
+clog_str(const char *key, const char *value)
+{
+    struct clog_field field;
+    field.key = key;
+    field.type = CLOG_FIELD_STRING;
+    field.value.s = value ? value : "";
+    field.len = strlen(field.value.s);
+    return field;
+}
+
+CLOG_INLINE struct clog_field
+clog_bytes(const char *key, const void *data, size_t len)
+{
+    struct clog_field field;
+    field.key = key;
+    field.type = CLOG_FIELD_BYTES;
+    field.value.s = (const char *) data;
+    field.len = len;
+    return field;
+}
+
+#ifdef CLOG_MAIN
+
+#ifdef WIN32
+#define fsync _commit
+#endif
+
+const char *const CLOG_LEVEL_NAMES[] = {
+    "DEBUG",
+    "INFO",
+    "WARN",
+    "ERROR",
+};
+
+/* strlen() of each of CLOG_LEVEL_NAMES. */
+const size_t _clog_level_lengths[] = {
+    sizeof("DEBUG") - 1,
+    sizeof("INFO") - 1,
+    sizeof("WARN") - 1,
+    sizeof("ERROR") - 1,
+};
+
+/* "00" to "99", so numbers are converted two digits at a time. */
+const char _clog_digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+struct clog_rcu _clog_rcu[CLOG_MAX_LOGGERS];
+
+/* Log calls turned away by the level of each logger, per stripe of threads,
+ * for clog_stats().  Counted by slot, as the quick level check does not
+ * enter the logger. */
+unsigned long _clog_filtered[CLOG_RCU_STRIPES][CLOG_MAX_LOGGERS];
+
+/* Set by clog_request_reopen() for each slot.  Kept by slot rather than in
+ * the logger so that a signal handler can set it without entering one. */
+unsigned long _clog_reopens[CLOG_MAX_LOGGERS];
+
+/* This thread's stripe of _clog_rcu counters plus one, zero until its first
+ * log call, and the next stripe to hand out. */
+CLOG_THREAD_LOCAL unsigned int _clog_stripe = 0;
+
+/* Nanoseconds of this thread's timed writes short of a whole microsecond,
+ * for the next one. */
+CLOG_THREAD_LOCAL unsigned int _clog_nsec_carry = 0;
+unsigned int _clog_next_stripe = 0;
+
+/* Dates and times this thread has rendered.  (Shared by all threads if the
+ * compiler has no thread-local storage.) */
+CLOG_THREAD_LOCAL struct clog_time_cache _clog_time_caches[CLOG_TIME_CACHES];
+
+/* The UTC second last stamped on a JSON line by this thread, in date. */
+CLOG_THREAD_LOCAL struct clog_time_cache _clog_json_time;
+
+/* Next clog_format.generation to hand out. */
+unsigned long _clog_generation = 1;
+
+/* Set by clog_request_reopen() for the next log call to act on. */
+unsigned long _clog_reopen_pending = 0;
+
+#ifdef CLOG_THREADS
+/* Serializes changes to loggers: clog_init_*, clog_rotate, clog_free and the
+ * clog_set_* functions.  Log calls never take it. */
+pthread_mutex_t _clog_config_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* The allocator, set by clog_set_allocator(). */
+void *(*_clog_malloc_fn)(size_t) = malloc;
+void *(*_clog_realloc_fn)(void *, size_t) = realloc;
+void (*_clog_free_fn)(void *) = free;
+
+/* This thread's buffers for long lines.  (Shared by all threads if the
+ * compiler has no thread-local storage.) */
+CLOG_THREAD_LOCAL struct clog_scratch _clog_scratch;
+
+#ifdef CLOG_THREADS
+/* Key whose destructor releases a thread's _clog_scratch as it exits. */
+pthread_key_t _clog_scratch_key;
+pthread_once_t _clog_scratch_once = PTHREAD_ONCE_INIT;
+int _clog_scratch_key_ok = 0;
+#endif
+
+void *
+_clog_malloc(size_t size)
+{
+    return _clog_malloc_fn(size);
+}
+
+void *
+_clog_calloc(size_t count, size_t size)
+{
+    void *p;
+    if (size != 0 && count > (size_t) -1 / size) {
+        return NULL;
+    }
+    p = _clog_malloc_fn(count * size);
+    if (p != NULL) {
+        memset(p, 0, count * size);
+    }
+    return p;
+}
+
+void *
+_clog_realloc(void *p, size_t size)
+{
+    return _clog_realloc_fn(p, size);
+}
+
+void
+_clog_free(void *p)
+{
+    _clog_free_fn(p);
+}
+
+/* Release this thread's buffers for long lines. */
+void
+_clog_scratch_clear(void)
+{
+    struct clog_scratch *scratch = &_clog_scratch;
+    int i;
+
+    for (i = 0; i < CLOG_SCRATCH_BUFS; i++) {
+        if (scratch->data[i] != NULL) {
+            scratch->free_fn(scratch->data[i]);
+            scratch->data[i] = NULL;
+        }
+    }
+    scratch->free_fn = NULL;
+}
+
+#ifdef CLOG_THREADS
+void
+_clog_scratch_exit(void *arg)
+{
+    (void) arg;
+    _clog_scratch_clear();
+    _clog_scratch.registered = 0;
+}
+
+void
+_clog_scratch_key_init(void)
+{
+    _clog_scratch_key_ok =
+        pthread_key_create(&_clog_scratch_key, _clog_scratch_exit) == 0;
+}
+#endif
+
+/* A heap buffer of at least size bytes for a line outgrowing its stack
+ * buffer, preferably one this thread kept from an earlier line.  Its
+ * capacity is stored in *size. */
+char *
+_clog_scratch_take(size_t *size)
+{
+    struct clog_scratch *scratch = &_clog_scratch;
+    char *data;
+    int i, best = -1;
+
+    if (scratch->free_fn != _clog_free_fn) {
+        _clog_scratch_clear();
+    }
+    /* The smallest buffer that fits, or else the largest to grow. */
+    for (i = 0; i < CLOG_SCRATCH_BUFS; i++) {
+        if (scratch->data[i] == NULL) {
+            continue;
+        }
+        if (best == -1) {
+            best = i;
+        } else if (scratch->size[best] < *size) {
+            if (scratch->size[i] > scratch->size[best]) {
+                best = i;
+            }
+        } else if (scratch->size[i] >= *size
+                   && scratch->size[i] < scratch->size[best]) {
+            best = i;
+        }
+    }
+    if (best == -1) {
+        return (char *) _clog_malloc(*size);
+    }
+    data = scratch->data[best];
+    if (scratch->size[best] < *size) {
+        data = (char *) _clog_realloc(data, *size);
+        if (data == NULL) {
+            return NULL;
+        }
+    } else {
+        *size = scratch->size[best];
+    }
+    scratch->data[best] = NULL;
+    return data;
+}
+
+/* Keep a buffer from _clog_scratch_take() for the next long line, or free
+ * it if it is too big or there is no room. */
+void
+_clog_scratch_give(char *data, size_t size)
+{
+    struct clog_scratch *scratch = &_clog_scratch;
+    int i;
+
+    if (scratch->free_fn != _clog_free_fn) {
+        _clog_scratch_clear();
+        scratch->free_fn = _clog_free_fn;
+    }
+#ifdef CLOG_THREADS
+    if (!scratch->registered) {
+        pthread_once(&_clog_scratch_once, _clog_scratch_key_init);
+        scratch->registered = _clog_scratch_key_ok
+            && pthread_setspecific(_clog_scratch_key, scratch) == 0;
+    }
+    if (!scratch->registered) {
+        _clog_free(data);
+        return;
+    }
+#endif
+    if (size <= CLOG_SCRATCH_MAX) {
+        for (i = 0; i < CLOG_SCRATCH_BUFS; i++) {
+            if (scratch->data[i] == NULL) {
+                scratch->data[i] = data;
+                scratch->size[i] = size;
+                return;
+            }
+        }
+    }
+    _clog_free(data);
+}
+
+int
+clog_set_allocator(void *(*malloc_fn)(size_t),
+                   void *(*realloc_fn)(void *, size_t),
+                   void (*free_fn)(void *))
+{
+    int id, result = 0;
+
+    if ((malloc_fn == NULL) != (realloc_fn == NULL)
+        || (malloc_fn == NULL) != (free_fn == NULL)) {
+        _clog_err("clog_set_allocator: Give all three functions or none.\n");
+        return 1;
+    }
+    _clog_lock_config();
+    for (id = 0; id < _clog_id_limit(); id++) {
+        if (_clog_get(id) != NULL) {
+            _clog_err("clog_set_allocator: Logger %d is initialized.\n", id);
+            result = 1;
+            break;
+        }
+    }
+    if (result == 0) {
+        _clog_scratch_clear();
+        _clog_malloc_fn = malloc_fn ? malloc_fn : malloc;
+        _clog_realloc_fn = realloc_fn ? realloc_fn : realloc;
+        _clog_free_fn = free_fn ? free_fn : free;
+    }
+    _clog_unlock_config();
+    return result;
+}
+
+int
+_clog_open(const char *const path)
+{
+    int fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0666);
+    if (fd == -1) {
+        _clog_err("Unable to open %s: %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+char *
+_clog_copy_path(const char *const path)
+{
+    char *copy = (char *) _clog_malloc(strlen(path) + 1);
+    if (copy == NULL) {
+        _clog_err("Out of memory copying %s.\n", path);
+        return NULL;
+    }
+    return strcpy(copy, path);
+}
+
+/* Create a logger for slot id, not yet visible to log calls. */
+struct clog *
+_clog_new(int id, int fd)
+{
+    struct clog **slot = _clog_slot(id);
+    struct clog *logger;
+    int i;
+
+    if (slot == NULL) {
+        _clog_err("No such logger id: %d\n", id);
+        return NULL;
+    }
+    if (_clog_load(slot) != NULL) {
+        _clog_err("Logger %d already initialized.\n", id);
+        return NULL;
+    }
+
+    logger = (struct clog *) _clog_malloc(sizeof(struct clog));
+    if (logger == NULL) {
+        _clog_err("Failed to allocate logger: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    logger->level = CLOG_DEBUG;
+    logger->fd = fd;
+    logger->opened = 0;
+    logger->isatty = 0;
+    strcpy(logger->fmt, CLOG_DEFAULT_FORMAT);
+    strcpy(logger->date_fmt, CLOG_DEFAULT_DATE_FORMAT);
+    strcpy(logger->time_fmt, CLOG_DEFAULT_TIME_FORMAT);
+    logger->async = NULL;
+    logger->buffer = NULL;
+    logger->mapped = NULL;
+    logger->flush_level = CLOG_ERROR;
+    logger->id = id;
+    logger->name[0] = 0;
+    logger->binary = 0;
+    logger->sites = NULL;
+    logger->rate_interval = 0;
+    logger->rate_burst = 0;
+    logger->dedup = 0;
+    logger->repeated = NULL;
+    logger->suppressed = 0;
+    logger->sinks = NULL;
+    logger->next_sink = 1;
+    logger->path = NULL;
+    logger->rotate_bytes = 0;
+    logger->rotate_interval = 0;
+    logger->rotate_keep = 0;
+    logger->written = 0;
+    logger->rotate_due = 0;
+    logger->rotate_requested = 0;
+    logger->compress = 0;
+    _clog_store(_clog_reopen_slot(id), 0);
+    logger->json = 0;
+    memset(logger->counters, 0, sizeof(logger->counters));
+    for (i = 0; i < CLOG_RCU_STRIPES; i++) {
+        _clog_store(_clog_filtered_slot(id, i), 0);
+    }
+    logger->write_timing = 0;
+    _clog_monotonic(&logger->start);
+    logger->format = _clog_compile_format(logger->fmt, logger->date_fmt,
+                                          logger->time_fmt);
+    if (logger->format == NULL) {
+        _clog_free(logger);
+        return NULL;
+    }
+    return logger;
+}
+
+struct clog *
+_clog_new_path(int id, const char *const path)
+{
+    struct clog *logger;
+    int fd = _clog_open(path);
+    if (fd == -1) {
+        return NULL;
+    }
+    logger = _clog_new(id, fd);
+    if (logger == NULL) {
+        close(fd);
+        return NULL;
+    }
+    logger->opened = 1;
+    logger->path = _clog_copy_path(path);
+    if (logger->path == NULL) {
+        _clog_destroy(logger);
+        return NULL;
+    }
+    logger->isatty = isatty(fd);
+    return logger;
+}
+
+/* Free a logger that no log call can reach any more, writing out what it
+ * has buffered or queued first. */
+void
+_clog_destroy(struct clog *logger)
+{
+    int i;
+
+    _clog_report_repeats(logger, 0);
+    if (logger->async) {
+        _clog_stop_async(logger);
+    }
+    if (logger->buffer) {
+        _clog_buffer_flush(logger, logger->buffer);
+        _clog_free_buffer(logger->buffer);
+    }
+    if (logger->mapped) {
+        _clog_stop_mmap(logger);
+    }
+    if (logger->opened) {
+        close(logger->fd);
+    }
+    if (logger->sinks) {
+        for (i = 0; i < logger->sinks->count; i++) {
+            _clog_free_sink(logger->sinks->sinks[i]);
+        }
+        _clog_free(logger->sinks);
+    }
+    _clog_free(logger->format);
+    _clog_free(logger->sites);
+    _clog_free(logger->path);
+    _clog_free(logger);
+}
+
+/* Make a new logger visible to log calls, unless another thread took its
+ * slot first. */
+int
+_clog_publish(struct clog *logger)
+{
+    struct clog *expected = NULL;
+    if (!_clog_cas(_clog_slot(logger->id), &expected, logger)) {
+        _clog_err("Logger %d already initialized.\n", logger->id);
+        _clog_destroy(logger);
+        return 1;
+    }
+    return 0;
+}
+
+int
+clog_init_path(int id, const char *const path)
+{
+    struct clog *logger = _clog_new_path(id, path);
+    if (logger == NULL) {
+        return 1;
+    }
+    return _clog_publish(logger);
+}
+
+/* Make room for the file being rotated out: path.old, or with keep old
+ * files, path.1 after moving the others up one and deleting the oldest. */
+void
+_clog_shift_files(const char *const path, unsigned int keep,
+                  char *old_path, size_t size)
+{
+    char from[4096], to[4096];
+    unsigned int i;
+
+    if (keep == 0) {
+        snprintf(old_path, size, "%s.old", path);
+        return;
+    }
+    _clog_compress_shift(path);
+    snprintf(to, sizeof(to), "%s.%u", path, keep);
+    unlink(to);
+    snprintf(to, sizeof(to), "%s.%u" CLOG_COMPRESS_SUFFIX, path, keep);
+    unlink(to);
+    for (i = keep - 1; i > 0; i--) {
+        snprintf(from, sizeof(from), "%s.%u", path, i);
+        snprintf(to, sizeof(to), "%s.%u", path, i + 1);
+        rename(from, to);
+        snprintf(from, sizeof(from), "%s.%u" CLOG_COMPRESS_SUFFIX, path, i);
+        snprintf(to, sizeof(to), "%s.%u" CLOG_COMPRESS_SUFFIX, path, i + 1);
+        rename(from, to);
+    }
+    _clog_compress_shift_done();
+    snprintf(old_path, size, "%s.1", path);
+}
+
+/* Shift the files rotated out of path up one, and put old_path, the one
+ * just rotated out, in the first place (or queue it for compression). */
+void
+_clog_place_rotated(const char *path, unsigned int keep,
+                    const char *old_path, int compress)
+{
+    char first[4096];
+
+    _clog_shift_files(path, keep, first, sizeof(first));
+    if (compress) {
+        _clog_compress_later(path, old_path, keep);
+    } else {
+        rename(old_path, first);
+    }
+}
+
+/* Ways for _clog_switch_file() to move the old file out of the way:
+ * shifting the older ones up first, or, for rotations asked for by a
+ * caller who should not wait on the file system, leaving that to the
+ * background thread. */
+#define CLOG_MOVE_NOW 1
+#define CLOG_MOVE_LATER 2
+
+/* Switch a logger to a newly opened path (by default, its own), first
+ * moving the old file out of the way if move is one of the CLOG_MOVE_*. */
+int
+_clog_switch_file(int id, const char *path, int move)
+{
+    struct clog *logger = _clog_get(id);
+    int fd, old_fd;
+    char old_path[4096] = { 0 };
+    char *new_path = NULL;
+    char buf[4096];
+    struct clog_buf b;
+    unsigned int first = 0;
+    if (logger == NULL) {
+        _clog_err("Logger %d not initialized.\n", id);
+        return 1;
+    }
+    if (!logger->opened) {
+        _clog_err("Logger %d not opened by clog.\n", id);
+        return 1;
+    }
+    if (path == NULL) {
+        path = logger->path;
+    } else if (logger->path == NULL || strcmp(path, logger->path) != 0) {
+        new_path = _clog_copy_path(path);
+        if (new_path == NULL) {
+            return 1;
+        }
+    }
+    if (path == NULL) {
+        _clog_err("Logger %d has no path.\n", id);
+        return 1;
+    }
+
+    /* Lines logged so far belong in the old file. */
+    _clog_flush(logger);
+
+    if (move == CLOG_MOVE_LATER && logger->rotate_keep > 0) {
+        /* The old file waits under a name of its own while the background
+         * thread shifts the older ones up. */
+        _clog_compress_name(path, old_path, sizeof(old_path));
+        rename(path, old_path);
+    } else if (move) {
+        /* Shifts left by earlier rotations go first. */
+#ifdef CLOG_THREADS
+        _clog_bg_shift();
+#endif
+        move = CLOG_MOVE_NOW;
+        _clog_shift_files(path, logger->rotate_keep, old_path,
+                          sizeof(old_path));
+        if (logger->compress) {
+            _clog_compress_name(path, old_path, sizeof(old_path));
+        }
+        rename(path, old_path);
+    }
+
+    if (logger->mapped) {
+        fd = open(path, O_CREAT | O_RDWR, 0666);
+    } else {
+        fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0666);
+    }
+    if (fd == -1) {
+        _clog_err("Unable to open %s: %s\n", path, strerror(errno));
+        _clog_free(new_path);
+        return 1;
+    }
+
+    /* A binary log starts a new session in the new file, with the call
+     * sites numbered so far. */
+    _clog_buf_init(&b, buf, sizeof(buf));
+    if (logger->binary) {
+        first = _clog_load(&logger->sites->next_id);
+        _clog_binary_start(logger, &b);
+        _clog_dump_sites(logger, &b, 0);
+        if (b.failed || _clog_write_all(fd, b.data, b.len) == -1) {
+            _clog_err("Unable to write to %s.\n", path);
+        }
+    }
+
+    /* Memory-mapped loggers map the new file, after anything written to it
+     * above. */
+    if (logger->mapped && _clog_mmap_switch(logger, fd)) {
+        _clog_buf_free(&b);
+        close(fd);
+        _clog_free(new_path);
+        return 1;
+    }
+
+    /* Start counting for the next rotation before switching, so that one
+     * asked for by a line in the new file is not lost. */
+    _clog_store(&logger->written, b.len);
+    _clog_store(&logger->rotate_requested, 0);
+    if (logger->rotate_interval > 0) {
+        logger->rotate_due = (time(NULL) / logger->rotate_interval + 1)
+                             * logger->rotate_interval;
+    }
+
+    /* Log calls switch to the new file at once; the old one is closed when
+     * the writes already started on it are done.  Only the holder of the
+     * config lock changes fd, so a plain store will do. */
+    old_fd = _clog_load(&logger->fd);
+    _clog_store(&logger->fd, fd);
+    _clog_synchronize(id);
+
+    if (logger->mapped) {
+        _clog_mmap_retire(logger);
+    }
+    if (new_path != NULL) {
+        _clog_free(logger->path);
+        logger->path = new_path;
+    }
+
+    /* Call sites numbered meanwhile may only be in the old file. */
+    if (logger->binary) {
+        b.len = 0;
+        _clog_dump_sites(logger, &b, first);
+        if (b.len > 0 && !b.failed) {
+            _clog_write(logger, CLOG_ERROR, b.data, b.len);
+        }
+    }
+    _clog_buf_free(&b);
+
+    _clog_close_later(old_fd);
+    if (move == CLOG_MOVE_LATER) {
+        _clog_shift_later(path, logger->rotate_keep, old_path,
+                          logger->compress);
+    } else if (move && logger->compress) {
+        _clog_compress_later(path, old_path, logger->rotate_keep);
+    }
+    return 0;
+}
+
+int
+_clog_rotate(int id, const char *path)
+{
+    return _clog_switch_file(id, path, CLOG_MOVE_NOW);
+}
+
+int
+clog_rotate(int id, const char *const path)
+{
+    int result;
+    _clog_lock_config();
+#ifdef CLOG_THREADS
+    result = _clog_switch_file(id, path, CLOG_MOVE_LATER);
+#else
+    result = _clog_rotate(id, path);
+#endif
+    _clog_unlock_config();
+    return result;
+}
+
+int
+clog_init_fd(int id, int fd)
+{
+    struct clog *logger = _clog_new(id, fd);
+    if (logger == NULL) {
+        return 1;
+    }
+    return _clog_publish(logger);
+}
+
+/* Find a free id for a created logger, adding a chunk to the registry if
+ * all are taken.  Called with the config lock held. */
+int
+_clog_free_id(void)
+{
+    int id, limit = _clog_id_limit();
+    struct clog_chunk *chunk;
+
+    for (id = CLOG_MAX_LOGGERS; id < limit; id++) {
+        if (_clog_load(_clog_slot(id)) == NULL) {
+            return id;
+        }
+    }
+
+    if (_clog_num_chunks == CLOG_MAX_CHUNKS) {
+        _clog_err("Too many loggers.\n");
+        return -1;
+    }
+    chunk = (struct clog_chunk *) _clog_calloc(1, sizeof(struct clog_chunk));
+    if (chunk == NULL) {
+        _clog_err("Failed to allocate logger: %s\n", strerror(errno));
+        return -1;
+    }
+    /* Publish the chunk before the ids in it. */
+    _clog_store_release(&_clog_chunks[_clog_num_chunks], chunk);
+    _clog_store_release(&_clog_num_chunks, _clog_num_chunks + 1);
+    return limit;
+}
+
+int
+_clog_create(const char *name, const char *const path, int fd)
+{
+    struct clog *logger;
+    int id;
+
+    if (name != NULL && *name != 0) {
+        if (strlen(name) >= CLOG_NAME_LENGTH) {
+            _clog_err("Logger name too long: %s\n", name);
+            return -1;
+        }
+        if (clog_lookup(name) != -1) {
+            _clog_err("Logger %s already exists.\n", name);
+            return -1;
+        }
+    }
+
+    id = _clog_free_id();
+    if (id == -1) {
+        return -1;
+    }
+    logger = path ? _clog_new_path(id, path) : _clog_new(id, fd);
+    if (logger == NULL) {
+        return -1;
+    }
+    if (name != NULL) {
+        strcpy(logger->name, name);
+    }
+    if (_clog_publish(logger)) {
+        return -1;
+    }
+    return id;
+}
+
+int
+clog_create_path(const char *name, const char *const path)
+{
+    int id;
+    _clog_lock_config();
+    id = _clog_create(name, path, -1);
+    _clog_unlock_config();
+    return id;
+}
+
+int
+clog_create_fd(const char *name, int fd)
+{
+    int id;
+    _clog_lock_config();
+    id = _clog_create(name, NULL, fd);
+    _clog_unlock_config();
+    return id;
+}
+
+int
+clog_lookup(const char *name)
+{
+    int id, limit = _clog_id_limit();
+
+    if (name == NULL || *name == 0) {
+        return -1;
+    }
+    for (id = CLOG_MAX_LOGGERS; id < limit; id++) {
+        unsigned int token = _clog_read_lock(id);
+        struct clog *logger = _clog_get(id);
+        int found = logger != NULL && strcmp(logger->name, name) == 0;
+        _clog_read_unlock(id, token);
+        if (found) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+void
+clog_free(int id)
+{
+    struct clog *logger;
+
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger) {
+        /* Unpublish it, then wait for log calls still using it. */
+        _clog_store(_clog_slot(id), NULL);
+        _clog_store(_clog_level_slot(id), (int) CLOG_DEBUG);
+        _clog_synchronize(id);
+        _clog_destroy(logger);
+#ifdef CLOG_THREADS
+        /* Leave no rotated file waiting for its place. */
+        _clog_bg_shift();
+#endif
+    }
+    _clog_unlock_config();
+}
+
+int
+clog_set_level(int id, enum clog_level level)
+{
+    struct clog *logger;
+    if ((unsigned) level > CLOG_ERROR) {
+        return 1;
+    }
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger) {
+        _clog_store(&logger->level, level);
+        _clog_store(_clog_level_slot(id), (int) level);
+    }
+    _clog_unlock_config();
+    return logger == NULL;
+}
+
+/* Compile a new format for logger, replacing those of fmt, date_fmt and
+ * time_fmt which are not NULL, and swap it in.  Called with the config
+ * lock held. */
+int
+_clog_replace_format(struct clog *logger, const char *fmt,
+                     const char *date_fmt, const char *time_fmt)
+{
+    struct clog_format *format, *old;
+
+    format = _clog_compile_format(fmt ? fmt : logger->fmt,
+                                  date_fmt ? date_fmt : logger->date_fmt,
+                                  time_fmt ? time_fmt : logger->time_fmt);
+    if (format == NULL) {
+        return 1;
+    }
+    if (fmt) {
+        strcpy(logger->fmt, fmt);
+    }
+    if (date_fmt) {
+        strcpy(logger->date_fmt, date_fmt);
+    }
+    if (time_fmt) {
+        strcpy(logger->time_fmt, time_fmt);
+    }
+
+    old = logger->format;
+    _clog_store(&logger->format, format);
+    _clog_synchronize(logger->id);
+    _clog_free(old);
+    return 0;
+}
+
+int
+clog_set_time_fmt(int id, const char *fmt)
+{
+    struct clog *logger;
+    int result = 1;
+    if (strlen(fmt) >= CLOG_FORMAT_LENGTH) {
+        _clog_err("clog_set_time_fmt: Format specifier too long.\n");
+        return 1;
+    }
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger == NULL) {
+        _clog_err("clog_set_time_fmt: No such logger: %d\n", id);
+    } else {
+        result = _clog_replace_format(logger, NULL, NULL, fmt);
+    }
+    _clog_unlock_config();
+    return result;
+}
+
+int
+clog_set_date_fmt(int id, const char *fmt)
+{
+    struct clog *logger;
+    int result = 1;
+    if (strlen(fmt) >= CLOG_FORMAT_LENGTH) {
+        _clog_err("clog_set_date_fmt: Format specifier too long.\n");
+        return 1;
+    }
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger == NULL) {
+        _clog_err("clog_set_date_fmt: No such logger: %d\n", id);
+    } else {
+        result = _clog_replace_format(logger, NULL, fmt, NULL);
+    }
+    _clog_unlock_config();
+    return result;
+}
+
+int
+clog_set_fmt(int id, const char *fmt)
+{
+    struct clog *logger;
+    int result = 1;
+    if (strlen(fmt) >= CLOG_FORMAT_LENGTH) {
+        _clog_err("clog_set_fmt: Format specifier too long.\n");
+        return 1;
+    }
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger == NULL) {
+        _clog_err("clog_set_fmt: No such logger: %d\n", id);
+    } else {
+        result = _clog_replace_format(logger, fmt, NULL, NULL);
+    }
+    _clog_unlock_config();
+    return result;
+}
+
+/* Internal functions */
+
+/* The logger with the given id, or NULL.  Only for use in a read-side
+ * section or with the config lock held. */
+struct clog *
+_clog_get(int id)
+{
+    struct clog **slot = _clog_slot(id);
+    return slot ? _clog_load(slot) : NULL;
+}
+
+/* Ids of all loggers are below this. */
+int
+_clog_id_limit(void)
+{
+    return CLOG_MAX_LOGGERS
+           + _clog_load_acquire(&_clog_num_chunks) * CLOG_CHUNK_SIZE;
+}
+
+/* The read-side counters covering logger id, which must have a slot. */
+struct clog_rcu *
+_clog_rcu_of(int id)
+{
+    struct clog_chunk *chunk;
+    if ((unsigned int) id < CLOG_MAX_LOGGERS) {
+        return &_clog_rcu[id];
+    }
+    /* Callers check the slot first.  Should an id without one get here,
+     * counting it in logger 0's sections is safe, if slower for that
+     * logger's writers. */
+    chunk = _clog_chunk(id);
+    return chunk ? &chunk->rcu : &_clog_rcu[0];
+}
+
+void
+_clog_yield(void)
+{
+#ifdef CLOG_THREADS
+    sched_yield();
+#endif
+}
+
+/* This thread's stripe, handed out on first use. */
+unsigned int
+_clog_my_stripe(void)
+{
+    unsigned int stripe = _clog_stripe;
+    if (stripe == 0) {
+        stripe = _clog_count(&_clog_next_stripe, 1) % CLOG_RCU_STRIPES + 1;
+        _clog_stripe = stripe;
+    }
+    return stripe - 1;
+}
+
+unsigned int
+_clog_read_lock(int id)
+{
+    struct clog_rcu *rcu = _clog_rcu_of(id);
+    unsigned int stripe = _clog_my_stripe() + 1;
+    unsigned int epoch;
+
+    /* A flip between reading the epoch and counting in it would let the
+     * writer miss this call, and the next flip back wait only for the
+     * other epoch: count again until the epoch holds still. */
+    for (;;) {
+        epoch = _clog_load(&rcu->epoch) & 1;
+        _clog_add(&rcu->stripes[stripe - 1].readers[epoch], 1);
+        if ((_clog_load(&rcu->epoch) & 1) == epoch) {
+            break;
+        }
+        _clog_sub(&rcu->stripes[stripe - 1].readers[epoch], 1);
+    }
+    return (stripe - 1) << 1 | epoch;
+}
+
+void
+_clog_read_unlock(int id, unsigned int token)
+{
+    _clog_sub(&_clog_rcu_of(id)->stripes[token >> 1].readers[token & 1], 1);
+}
+
+/* Add n to a counter of logger, in the stripe of this thread (or the first,
+ * for threads that never logged). */
+void
+_clog_add_stat(struct clog *logger, enum clog_counter counter,
+               unsigned long n)
+{
+    unsigned int stripe = _clog_stripe;
+    _clog_count(&logger->counters[stripe ? stripe - 1 : 0].counts[counter],
+                n);
+}
+
+/* The counter of _clog_filtered for slot id and stripe, or NULL for ids
+ * that cannot have a logger. */
+unsigned long *
+_clog_filtered_slot(int id, unsigned int stripe)
+{
+    struct clog_chunk *chunk;
+    if ((unsigned int) id < CLOG_MAX_LOGGERS) {
+        return &_clog_filtered[stripe][id];
+    }
+    chunk = _clog_chunk(id);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    return &chunk->filtered[stripe]
+                           [(id - CLOG_MAX_LOGGERS) % CLOG_CHUNK_SIZE];
+}
+
+/* The flag of _clog_reopens for slot id, or NULL for ids that cannot have a
+ * logger. */
+unsigned long *
+_clog_reopen_slot(int id)
+{
+    struct clog_chunk *chunk;
+    if ((unsigned int) id < CLOG_MAX_LOGGERS) {
+        return &_clog_reopens[id];
+    }
+    chunk = _clog_chunk(id);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    return &chunk->reopens[(id - CLOG_MAX_LOGGERS) % CLOG_CHUNK_SIZE];
+}
+
+/* Count a log call under the level of logger id. */
+void
+_clog_count_filtered(int id)
+{
+    unsigned long *filtered = _clog_filtered_slot(id, _clog_my_stripe());
+    if (filtered != NULL) {
+        _clog_count(filtered, 1);
+    }
+}
+
+/* Wait until every log call that may have seen slot id before the change
+ * just published is done.  Log calls starting later count themselves in the
+ * other epoch, and see the change.  Called with the config lock held. */
+void
+_clog_synchronize(int id)
+{
+    struct clog_rcu *rcu = _clog_rcu_of(id);
+    unsigned int old = _clog_load(&rcu->epoch) & 1;
+    int i;
+
+    _clog_store(&rcu->epoch, old ^ 1);
+    for (i = 0; i < CLOG_RCU_STRIPES; i++) {
+        while (_clog_load(&rcu->stripes[i].readers[old]) != 0) {
+            _clog_yield();
+        }
+    }
+}
+
+void
+_clog_lock_config(void)
+{
+#ifdef CLOG_THREADS
+    pthread_mutex_lock(&_clog_config_lock);
+#endif
+}
+
+void
+_clog_unlock_config(void)
+{
+#ifdef CLOG_THREADS
+    pthread_mutex_unlock(&_clog_config_lock);
+#endif
+}
+
+void
+_clog_buf_init(struct clog_buf *b, char *stack, size_t size)
+{
+    b->data = stack;
+    b->stack = stack;
+    b->len = 0;
+    b->size = size;
+    b->failed = 0;
+    b->data[0] = 0;
+}
+
+int
+_clog_buf_reserve(struct clog_buf *b, size_t extra)
+{
+    size_t new_size = b->size;
+    char *data;
+
+    if (b->failed) {
+        return 1;
+    }
+    while (b->len + extra >= new_size) {
+        new_size *= 2;
+    }
+    if (new_size == b->size) {
+        return 0;
+    }
+    if (b->data == b->stack) {
+        data = _clog_scratch_take(&new_size);
+        if (data != NULL) {
+            memcpy(data, b->data, b->len + 1);
+        }
+    } else {
+        data = (char *) _clog_realloc(b->data, new_size);
+    }
+    if (data == NULL) {
+        b->failed = 1;
+        return 1;
+    }
+    b->data = data;
+    b->size = new_size;
+    return 0;
+}
+
+void
+_clog_buf_free(struct clog_buf *b)
+{
+    if (b->data != b->stack) {
+        _clog_scratch_give(b->data, b->size);
+    }
+    b->data = b->stack;
+}
+
+void
+_clog_append_str(struct clog_buf *b, const char *src, size_t len)
+{
+    if (_clog_buf_reserve(b, len)) {
+        return;
+    }
+    memcpy(b->data + b->len, src, len);
+    b->len += len;
+    b->data[b->len] = 0;
+}
+
+void
+_clog_append_vprintf(struct clog_buf *b, const char *fmt, va_list ap)
+{
+    va_list ap_copy;
+    int result;
+
+    if (b->failed) {
+        return;
+    }
+    va_copy(ap_copy, ap);
+    result = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap_copy);
+    va_end(ap_copy);
+    if (result < 0) {
+        b->failed = 1;
+        return;
+    }
+    if ((size_t) result >= b->size - b->len) {
+        /* Too large for the remaining space: grow and format again. */
+        if (_clog_buf_reserve(b, result)) {
+            return;
+        }
+        va_copy(ap_copy, ap);
+        vsnprintf(b->data + b->len, b->size - b->len, fmt, ap_copy);
+        va_end(ap_copy);
+    }
+    b->len += result;
+}
+
+void
+_clog_append_digits(struct clog_buf *b, unsigned long value, int digits)
+{
+    char *p;
+    int i;
+
+    if (_clog_buf_reserve(b, digits)) {
+        return;
+    }
+    p = b->data + b->len;
+    for (i = digits - 1; i >= 0; --i) {
+        p[i] = (char) ('0' + value % 10);
+        value /= 10;
+    }
+    b->len += digits;
+    b->data[b->len] = 0;
+}
+
+void
+_clog_append_int(struct clog_buf *b, long int d)
+{
+    char buf[40]; /* Enough for 128-bit decimal */
+    char *p = buf + sizeof(buf);
+    unsigned long value = d < 0 ? 0UL - (unsigned long) d : (unsigned long) d;
+
+    /* From the last digits back, without snprintf() and its locale. */
+    while (value >= 100) {
+        p -= 2;
+        memcpy(p, _clog_digit_pairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, _clog_digit_pairs + value * 2, 2);
+    } else {
+        *--p = (char) ('0' + value);
+    }
+    if (d < 0) {
+        *--p = '-';
+    }
+    _clog_append_str(b, p, (size_t) (buf + sizeof(buf) - p));
+}
+
+void
+_clog_now(struct timespec *ts, int precise)
+{
+#ifdef CLOCK_REALTIME_COARSE
+    /* Second resolution is all %d and %t need, and the coarse clock is
+     * cheaper. */
+    if (!precise && clock_gettime(CLOCK_REALTIME_COARSE, ts) == 0) {
+        return;
+    }
+#endif
+#ifdef CLOCK_REALTIME
+    if (clock_gettime(CLOCK_REALTIME, ts) == 0) {
+        return;
+    }
+#endif
+    (void) precise;
+    ts->tv_sec = time(NULL);
+    ts->tv_nsec = 0;
+}
+
+void
+_clog_monotonic(struct timespec *ts)
+{
+#ifdef CLOCK_MONOTONIC
+    if (clock_gettime(CLOCK_MONOTONIC, ts) == 0) {
+        return;
+    }
+#endif
+    ts->tv_sec = time(NULL);
+    ts->tv_nsec = 0;
+}
+
+/* The date and time of second now rendered with format's date_fmt and
+ * time_fmt, from this thread's cache if it has them. */
+const struct clog_time_cache *
+_clog_get_time_cache(const struct clog_format *format, time_t now)
+{
+    struct clog_time_cache *cache =
+        &_clog_time_caches[format->generation % CLOG_TIME_CACHES];
+    struct tm lt;
+
+    if (cache->generation == format->generation && cache->sec == now) {
+        return cache;
+    }
+
+#ifdef _WIN32
+    localtime_s(&lt, &now);
+#else
+    localtime_r(&now, &lt);
+#endif
+    /* strftime returns zero if the result did not fit; nothing is shown. */
+    cache->date_len = strftime(cache->date, CLOG_DATETIME_LENGTH,
+                               format->date_fmt, &lt);
+    cache->time_len = strftime(cache->time, CLOG_DATETIME_LENGTH,
+                               format->time_fmt, &lt);
+    cache->generation = format->generation;
+    cache->sec = now;
+    return cache;
+}
+
+/* Second now in UTC as JSON lines stamp it, from this thread's cache if it
+ * has it. */
+const struct clog_time_cache *
+_clog_get_json_time(time_t now)
+{
+    struct clog_time_cache *cache = &_clog_json_time;
+    struct tm tm;
+
+    if (cache->generation != 0 && cache->sec == now) {
+        return cache;
+    }
+#ifdef _WIN32
+    gmtime_s(&tm, &now);
+#else
+    gmtime_r(&now, &tm);
+#endif
+    cache->date_len = strftime(cache->date, CLOG_DATETIME_LENGTH,
+                               "%Y-%m-%dT%H:%M:%S", &tm);
+    cache->generation = 1;
+    cache->sec = now;
+    return cache;
+}
+
+const char *
+_clog_basename(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash) {
+        path = slash + 1;
+    }
+#ifdef _WIN32
+    slash = strrchr(path, '\\');
+    if (slash) {
+        path = slash + 1;
+    }
+#endif
+    return path;
+}
+
+struct clog_format *
+_clog_compile_format(const char *fmt, const char *date_fmt,
+                     const char *time_fmt)
+{
+    struct clog_format *format;
+    struct clog_op *op = NULL;
+    size_t text_len = 0;
+    enum { NORMAL, SUBST } state = NORMAL;
+
+    format = (struct clog_format *) _clog_malloc(sizeof(struct clog_format));
+    if (format == NULL) {
+        _clog_err("Failed to allocate format: %s\n", strerror(errno));
+        return NULL;
+    }
+    format->num_ops = 0;
+    format->clocks = 0;
+    strcpy(format->date_fmt, date_fmt);
+    strcpy(format->time_fmt, time_fmt);
+    format->generation = _clog_add(&_clog_generation, 1);
+
+    for (; *fmt; ++fmt) {
+        char literal = 0;
+        if (state == NORMAL) {
+            if (*fmt == '%') {
+                state = SUBST;
+                continue;
+            }
+            literal = *fmt;
+        } else {
+            unsigned char code;
+            state = NORMAL;
+            switch (*fmt) {
+                case '%': literal = '%'; break;
+                case 'd': code = CLOG_OP_DATE; break;
+                case 't': code = CLOG_OP_TIME; break;
+                case 'f': code = CLOG_OP_FILE; break;
+                case 'n': code = CLOG_OP_LINE; break;
+                case 'l': code = CLOG_OP_LEVEL; break;
+                case 'm': code = CLOG_OP_MESSAGE; break;
+                case 'M': code = CLOG_OP_MSEC; break;
+                case 'u': code = CLOG_OP_USEC; break;
+                case 'N': code = CLOG_OP_NSEC; break;
+                case 'r': code = CLOG_OP_ELAPSED; break;
+                default:
+                    /* Unknown substitutions produce no output. */
+                    continue;
+            }
+            if (!literal) {
+                if (code == CLOG_OP_DATE || code == CLOG_OP_TIME) {
+                    format->clocks |= CLOG_CLOCK_SECONDS;
+                } else if (code == CLOG_OP_ELAPSED) {
+                    format->clocks |= CLOG_CLOCK_MONOTONIC;
+                } else if (code >= CLOG_OP_MSEC) {
+                    format->clocks |= CLOG_CLOCK_PRECISE;
+                }
+                format->ops[format->num_ops++].code = code;
+                op = NULL;
+                continue;
+            }
+        }
+
+        /* Extend the current literal run, or start a new one. */
+        if (op == NULL) {
+            if (text_len > 0) {
+                text_len++; /* Keep the previous run's terminator */
+            }
+            op = &format->ops[format->num_ops++];
+            op->code = CLOG_OP_LITERAL;
+            op->offset = (unsigned short) text_len;
+            op->length = 0;
+        }
+        format->text[text_len++] = literal;
+        format->text[text_len] = 0;
+        op->length++;
+    }
+
+    return format;
+}
+
+/* Format a line, from the file with base name sfile.  The time is now, or
+ * when if not NULL, in which case %r counts from logger->start as a real
+ * time rather than a monotonic one. */
+int
+_clog_format(struct clog *logger, struct clog_buf *b,
+             const char *sfile, int sline, enum clog_level level,
+             const struct timespec *when, const char *fmt, va_list ap)
+{
+    return _clog_format_line(_clog_load(&logger->format), &logger->start, b,
+                             sfile, sline, level, when, fmt, ap);
+}
+
+/* _clog_format() with the given format, and %r counting from start. */
+int
+_clog_format_line(const struct clog_format *format,
+                  const struct timespec *start, struct clog_buf *b,
+                  const char *sfile, int sline, enum clog_level level,
+                  const struct timespec *when, const char *fmt, va_list ap)
+{
+    struct clog_text text;
+    int result;
+
+    text.fmt = fmt;
+    va_copy(text.ap, ap);
+    text.message = NULL;
+    text.ctx = NULL;
+    text.fields = NULL;
+    text.count = 0;
+    result = _clog_format_text(format, start, b, sfile, sline, level, when,
+                               &text);
+    va_end(text.ap);
+    return result;
+}
+
+/* _clog_format_line() with the message described by text, which is told
+ * where the message went. */
+int
+_clog_format_text(const struct clog_format *format,
+                  const struct timespec *start, struct clog_buf *b,
+                  const char *sfile, int sline, enum clog_level level,
+                  const struct timespec *when, struct clog_text *text)
+{
+    const struct clog_time_cache *cache = NULL;
+    size_t i;
+    struct timespec now, elapsed;
+
+    text->offset = CLOG_TEXT_UNPLACED;
+    text->len = 0;
+    if (when) {
+        now = *when;
+    } else if (format->clocks & (CLOG_CLOCK_SECONDS | CLOG_CLOCK_PRECISE)) {
+        _clog_now(&now, format->clocks & CLOG_CLOCK_PRECISE);
+    }
+    if (format->clocks & CLOG_CLOCK_SECONDS) {
+        cache = _clog_get_time_cache(format, now.tv_sec);
+    }
+    if (format->clocks & CLOG_CLOCK_MONOTONIC) {
+        if (when) {
+            elapsed = *when;
+        } else {
+            _clog_monotonic(&elapsed);
+        }
+        elapsed.tv_sec -= start->tv_sec;
+        elapsed.tv_nsec -= start->tv_nsec;
+        if (elapsed.tv_nsec < 0) {
+            elapsed.tv_sec--;
+            elapsed.tv_nsec += 1000000000L;
+        }
+    }
+
+    for (i = 0; i < format->num_ops; ++i) {
+        const struct clog_op *op = &format->ops[i];
+        switch (op->code) {
+            case CLOG_OP_LITERAL:
+                _clog_append_str(b, format->text + op->offset, op->length);
+                break;
+            case CLOG_OP_TIME:
+                _clog_append_str(b, cache->time, cache->time_len);
+                break;
+            case CLOG_OP_DATE:
+                _clog_append_str(b, cache->date, cache->date_len);
+                break;
+            case CLOG_OP_MSEC:
+                _clog_append_digits(b, now.tv_nsec / 1000000, 3);
+                break;
+            case CLOG_OP_USEC:
+                _clog_append_digits(b, now.tv_nsec / 1000, 6);
+                break;
+            case CLOG_OP_NSEC:
+                _clog_append_digits(b, now.tv_nsec, 9);
+                break;
+            case CLOG_OP_ELAPSED:
+                _clog_append_int(b, (long int) elapsed.tv_sec);
+                _clog_append_str(b, ".", 1);
+                _clog_append_digits(b, elapsed.tv_nsec / 1000, 6);
+                break;
+            case CLOG_OP_LEVEL:
+                _clog_append_str(b, CLOG_LEVEL_NAMES[level],
+                                 _clog_level_lengths[level]);
+                break;
+            case CLOG_OP_LINE:
+                _clog_append_int(b, sline);
+                break;
+            case CLOG_OP_FILE:
+                _clog_append_str(b, sfile, strlen(sfile));
+                break;
+            case CLOG_OP_MESSAGE:
+                if (text->offset == CLOG_TEXT_UNPLACED) {
+                    /* Format the message text right into the line. */
+                    _clog_append_text(b, text);
+                } else if (!_clog_buf_reserve(b, text->len)) {
+                    /* Repeated %m: copy the text formatted before. */
+                    memcpy(b->data + b->len, b->data + text->offset,
+                           text->len);
+                    b->len += text->len;
+                    b->data[b->len] = 0;
+                }
+                break;
+        }
+    }
+
+    return b->failed;
+}
+
+/* Binary records */
+
+/* Parse the conversion specification after a '%' at p into conv, returning
+ * where it ends. */
+const char *
+_clog_parse_conv(const char *p, struct clog_conv *conv)
+{
+    enum { NONE, HH, H, L, LL, BIG_L, J, Z, T } length = NONE;
+
+    conv->width_star = 0;
+    conv->precision_star = 0;
+    conv->precision = -1;
+
+    while (*p && strchr("-+ #0'", *p)) {
+        p++;
+    }
+    if (*p == '*') {
+        conv->width_star = 1;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            conv->precision_star = 1;
+            p++;
+        } else {
+            conv->precision = 0;
+            while (*p >= '0' && *p <= '9') {
+                if (conv->precision < 100000000) {
+                    conv->precision = conv->precision * 10 + (*p - '0');
+                }
+                p++;
+            }
+        }
+    }
+
+    switch (*p) {
+        case 'h':
+            length = *++p == 'h' ? (p++, HH) : H;
+            break;
+        case 'l':
+            length = *++p == 'l' ? (p++, LL) : L;
+            break;
+        case 'L':
+            length = BIG_L;
+            p++;
+            break;
+        case 'j':
+            length = J;
+            p++;
+            break;
+        case 'z':
+            length = Z;
+            p++;
+            break;
+        case 't':
+            length = T;
+            p++;
+            break;
+    }
+
+    conv->type = CLOG_ARG_UNSUPPORTED;
+    switch (*p) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+            switch (length) {
+                case NONE: case HH: case H:
+                    conv->type = CLOG_ARG_INT;
+                    break;
+                case L:
+                    conv->type = CLOG_ARG_LONG;
+                    break;
+#ifdef CLOG_C99
+                case LL:
+                    conv->type = CLOG_ARG_LLONG;
+                    break;
+                case J:
+                    conv->type = CLOG_ARG_INTMAX;
+                    break;
+#endif
+                case Z:
+                    conv->type = CLOG_ARG_SIZE;
+                    break;
+                case T:
+                    conv->type = CLOG_ARG_PTRDIFF;
+                    break;
+                default:
+                    break;
+            }
+            break;
+        case 'f': case 'F': case 'e': case 'E':
+        case 'g': case 'G': case 'a': case 'A':
+            if (length == NONE || length == L) {
+                conv->type = CLOG_ARG_DOUBLE;
+            } else if (length == BIG_L) {
+                conv->type = CLOG_ARG_LDOUBLE;
+            }
+            break;
+        case 'c':
+            if (length == NONE) {
+                conv->type = CLOG_ARG_INT;
+            }
+            break;
+        case 's':
+            if (length == NONE) {
+                conv->type = CLOG_ARG_STRING;
+            }
+            break;
+        case 'p':
+            if (length == NONE) {
+                conv->type = CLOG_ARG_POINTER;
+            }
+            break;
+        case '%':
+            conv->type = CLOG_ARG_NONE;
+            break;
+    }
+    if (*p) {
+        p++;
+    }
+    return p;
+}
+
+void
+_clog_append_printf(struct clog_buf *b, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    _clog_append_vprintf(b, fmt, ap);
+    va_end(ap);
+}
+
+/* Append str as binary records store strings: its length (~0 for NULL), at
+ * most its first max_len bytes (all of it if max_len is negative) and a
+ * NUL. */
+void
+_clog_append_string(struct clog_buf *b, const char *str, int max_len)
+{
+    unsigned int len = ~0u;
+    const char *nul;
+
+    if (str != NULL) {
+        if (max_len < 0) {
+            len = (unsigned int) strlen(str);
+        } else {
+            nul = (const char *) memchr(str, 0, max_len);
+            len = nul ? (unsigned int) (nul - str) : (unsigned int) max_len;
+        }
+    }
+    _clog_append_str(b, (const char *) &len, sizeof(len));
+    if (str != NULL) {
+        _clog_append_str(b, str, len);
+        _clog_append_str(b, "", 1);
+    }
+}
+
+/* Start a record in b, returning where it starts for _clog_end_record(). */
+size_t
+_clog_begin_record(struct clog_buf *b, int type, int level,
+                   unsigned int site, const struct timespec *when)
+{
+    struct clog_binary_header header;
+    size_t start = b->len;
+
+    memset(&header, 0, sizeof(header));
+    header.type = (unsigned short) type;
+    header.level = (unsigned short) level;
+    header.site = site;
+    if (when) {
+        header.sec = (long) when->tv_sec;
+        header.nsec = (unsigned int) when->tv_nsec;
+    }
+    _clog_append_str(b, (const char *) &header, sizeof(header));
+    return start;
+}
+
+/* Fill in the size of the record in b from start. */
+void
+_clog_end_record(struct clog_buf *b, size_t start)
+{
+    unsigned int size = (unsigned int) (b->len - start);
+
+    /* size is the first member of the header. */
+    if (!b->failed) {
+        memcpy(b->data + start, &size, sizeof(size));
+    }
+}
+
+void
+_clog_append_site(struct clog_buf *b, unsigned int id, const char *file,
+                  int line, const char *fmt)
+{
+    size_t start = _clog_begin_record(b, CLOG_BINARY_SITE, 0, id, NULL);
+    _clog_append_str(b, (const char *) &line, sizeof(line));
+    _clog_append_string(b, file, -1);
+    _clog_append_string(b, fmt, -1);
+    _clog_end_record(b, start);
+}
+
+/* The id of the call site at file and line with format fmt, in sites of
+ * logger.  A new call site is numbered and its SITE record written to the
+ * logger before the id is published, so that no thread's LOG record for it
+ * can come first, even to a decoder reading the file as it grows.  Zero if
+ * the table is full. */
+unsigned int
+_clog_site(struct clog *logger, struct clog_sites *sites,
+           enum clog_level level, const char *file, int line,
+           const char *fmt)
+{
+    size_t i = (((size_t) fmt >> 3) ^ (size_t) line * 31) % CLOG_SITES;
+    size_t probes;
+    unsigned int id;
+    char buf[256];
+    struct clog_buf b;
+
+    for (probes = 0; probes < CLOG_SITES; ++probes, i = (i + 1) % CLOG_SITES) {
+        struct clog_site *site = &sites->sites[i];
+        const char *claimed = _clog_load_acquire(&site->fmt);
+
+        if (claimed == NULL && _clog_cas(&site->fmt, &claimed, fmt)) {
+            site->file = file;
+            site->line = line;
+            id = _clog_add(&sites->next_id, 1);
+            _clog_buf_init(&b, buf, sizeof(buf));
+            _clog_append_site(&b, id, file, line, fmt);
+            if (b.failed
+                || _clog_write(logger, level, b.data, b.len) == -1) {
+                _clog_err("Unable to write a call site.\n");
+            }
+            _clog_buf_free(&b);
+            _clog_store_release(&site->id, id);
+            return id;
+        }
+        if (claimed != fmt) {
+            continue;
+        }
+        /* Same format: wait for its file and line. */
+        while ((id = _clog_load_acquire(&site->id)) == 0) {
+            _clog_yield();
+        }
+        if (site->file == file && site->line == line) {
+            return id;
+        }
+    }
+    return 0;
+}
+
+/* Append the arguments in ap for format fmt as LOG records store them.
+ * Non-zero if some cannot be stored. */
+int
+_clog_append_args(struct clog_buf *b, const char *fmt, va_list ap)
+{
+    struct clog_conv conv;
+    const char *p = fmt;
+    va_list args;
+
+    va_copy(args, ap);
+    while ((p = strchr(p, '%')) != NULL) {
+        int precision;
+        p = _clog_parse_conv(p + 1, &conv);
+        precision = conv.precision;
+        if (conv.width_star) {
+            int width = va_arg(args, int);
+            _clog_append_str(b, (const char *) &width, sizeof(width));
+        }
+        if (conv.precision_star) {
+            precision = va_arg(args, int);
+            _clog_append_str(b, (const char *) &precision, sizeof(precision));
+        }
+        switch (conv.type) {
+            case CLOG_ARG_NONE:
+                break;
+            case CLOG_ARG_INT: {
+                int value = va_arg(args, int);
+                _clog_append_str(b, (const char *) &value, sizeof(value));
+                break;
+            }
+            case CLOG_ARG_LONG: {
+                long value = va_arg(args, long);
+                _clog_append_str(b, (const char *) &value, sizeof(value));
+                break;
+            }
+#ifdef CLOG_C99
+            case CLOG_ARG_LLONG: {
+                long long value = va_arg(args, long long);
+                _clog_append_str(b, (const char *) &value, sizeof(value));
+                break;
+            }
+            case CLOG_ARG_INTMAX: {
+                intmax_t value = va_arg(args, intmax_t);
+                _clog_append_str(b, (const char *) &value, sizeof(value));
+                break;
+            }
+#endif
+            case CLOG_ARG_SIZE: {
+                size_t value = va_arg(args, size_t);
+                _clog_append_str(b, (const char *) &value, sizeof(value));
+                break;
+            }
+            case CLOG_ARG_PTRDIFF: {
+                ptrdiff_t value = va_arg(args, ptrdiff_t);
+                _clog_append_str(b, (const char *) &value, sizeof(value));
+                break;
+            }
+            case CLOG_ARG_DOUBLE: {
+                double value = va_arg(args, double);
+                _clog_append_str(b, (const char *) &value, sizeof(value));
+                break;
+            }
+            case CLOG_ARG_LDOUBLE: {
+                long double value = va_arg(args, long double);
+                _clog_append_str(b, (const char *) &value, sizeof(value));
+                break;
+            }
+            case CLOG_ARG_POINTER: {
+                void *value = va_arg(args, void *);
+                _clog_append_str(b, (const char *) &value, sizeof(value));
+                break;
+            }
+            case CLOG_ARG_STRING:
+                _clog_append_string(b, va_arg(args, const char *), precision);
+                break;
+            default:
+                va_end(args);
+                return 1;
+        }
+    }
+    va_end(args);
+    return 0;
+}
+
+int
+_clog_encode(struct clog *logger, struct clog_buf *b,
+             const char *sfile, int sline, enum clog_level level,
+             const char *fmt, va_list ap)
+{
+    struct clog_sites *sites = _clog_load_acquire(&logger->sites);
+    unsigned int site = 0;
+    struct timespec now;
+    size_t start;
+
+    _clog_now(&now, 1);
+    if (sites != NULL) {
+        site = _clog_site(logger, sites, level, sfile, sline, fmt);
+    }
+    start = _clog_begin_record(b, CLOG_BINARY_LOG, level, site, &now);
+    if (site == 0 || _clog_append_args(b, fmt, ap)) {
+        /* No call site, or arguments that cannot be stored: store the
+         * formatted message instead. */
+        b->len = start;
+        start = _clog_begin_record(b, CLOG_BINARY_TEXT, level, 0, &now);
+        _clog_append_str(b, (const char *) &sline, sizeof(sline));
+        _clog_append_string(b, sfile, -1);
+        _clog_append_vprintf(b, fmt, ap);
+    }
+    _clog_end_record(b, start);
+    return b->failed;
+}
+
+void
+_clog_binary_start(struct clog *logger, struct clog_buf *b)
+{
+    unsigned char sizes[4];
+    struct timespec real, mono;
+    size_t start;
+
+    sizes[0] = sizeof(int);
+    sizes[1] = sizeof(long);
+    sizes[2] = sizeof(long double);
+    sizes[3] = sizeof(void *);
+
+    /* The real time of logger->start, for %r. */
+    _clog_now(&real, 1);
+    _clog_monotonic(&mono);
+    real.tv_sec -= mono.tv_sec - logger->start.tv_sec;
+    real.tv_nsec -= mono.tv_nsec - logger->start.tv_nsec;
+    if (real.tv_nsec < 0) {
+        real.tv_sec--;
+        real.tv_nsec += 1000000000L;
+    } else if (real.tv_nsec >= 1000000000L) {
+        real.tv_sec++;
+        real.tv_nsec -= 1000000000L;
+    }
+
+    start = _clog_begin_record(b, CLOG_BINARY_START, 0, 0, &real);
+    _clog_append_str(b, CLOG_BINARY_MAGIC, strlen(CLOG_BINARY_MAGIC));
+    _clog_append_str(b, (const char *) sizes, sizeof(sizes));
+    _clog_end_record(b, start);
+}
+
+/* Append the SITE records of the call sites of logger numbered first or
+ * higher.  Only with the config lock held. */
+void
+_clog_dump_sites(struct clog *logger, struct clog_buf *b, unsigned int first)
+{
+    size_t i;
+    unsigned int id;
+
+    for (i = 0; i < CLOG_SITES; ++i) {
+        struct clog_site *site = &logger->sites->sites[i];
+        if (_clog_load_acquire(&site->fmt) == NULL) {
+            continue;
+        }
+        while ((id = _clog_load_acquire(&site->id)) == 0) {
+            _clog_yield();
+        }
+        if (id >= first) {
+            _clog_append_site(b, id, site->file, site->line, site->fmt);
+        }
+    }
+}
+
+int
+clog_set_binary(int id, int binary)
+{
+    struct clog *logger;
+    struct clog_sites *sites;
+    char buf[4096];
+    struct clog_buf b;
+    int result = 1;
+
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger == NULL) {
+        _clog_err("clog_set_binary: No such logger: %d\n", id);
+    } else if (!binary) {
+        /* Encoding log calls are done before binary records are turned on
+         * again, which starts a new session. */
+        _clog_store(&logger->binary, 0);
+        _clog_synchronize(id);
+        result = 0;
+    } else if (logger->binary) {
+        result = 0;
+    } else {
+        if (logger->sites == NULL) {
+            sites = (struct clog_sites *)
+                _clog_calloc(1, sizeof(struct clog_sites));
+            if (sites == NULL) {
+                _clog_err("Failed to allocate call sites: %s\n",
+                          strerror(errno));
+                _clog_unlock_config();
+                return 1;
+            }
+            sites->next_id = 1;
+            _clog_store_release(&logger->sites, sites);
+        }
+        _clog_buf_init(&b, buf, sizeof(buf));
+        _clog_binary_start(logger, &b);
+        _clog_dump_sites(logger, &b, 0);
+        if (b.failed || _clog_write(logger, CLOG_ERROR, b.data, b.len) == -1) {
+            _clog_err("clog_set_binary: Unable to write to log file.\n");
+        } else {
+            _clog_store(&logger->binary, 1);
+            result = 0;
+        }
+        _clog_buf_free(&b);
+    }
+    _clog_unlock_config();
+    return result;
+}
+
+int
+clog_set_json(int id, int json)
+{
+    struct clog *logger;
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger) {
+        _clog_store(&logger->json, json != 0);
+    }
+    _clog_unlock_config();
+    return logger == NULL;
+}
+
+/* Length of the start of s, of len bytes, that a JSON string holds as is:
+ * up to the first quote, backslash or control character. */
+size_t
+_clog_json_plain(const char *s, size_t len)
+{
+    size_t i = 0;
+#ifdef CLOG_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(' ');
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        /* Bytes under ' ' are the ones that max() changes. */
+        int ok = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, space), v));
+        int special = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                         _mm_cmpeq_epi8(v, backslash)));
+        int mask = special | (~ok & 0xffff);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned char c = (unsigned char) s[i];
+        if (c < ' ' || c == '"' || c == '\\') {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Append s, of len bytes, as a JSON string. */
+void
+_clog_append_json_string(struct clog_buf *b, const char *s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    char escape[6] = { '\\', 'u', '0', '0', 0, 0 };
+
+    _clog_append_str(b, "\"", 1);
+    for (;;) {
+        size_t plain = _clog_json_plain(s, len);
+        _clog_append_str(b, s, plain);
+        s += plain;
+        len -= plain;
+        if (len == 0) {
+            break;
+        }
+        switch (*s) {
+            case '"':
+                _clog_append_str(b, "\\\"", 2);
+                break;
+            case '\\':
+                _clog_append_str(b, "\\\\", 2);
+                break;
+            case '\n':
+                _clog_append_str(b, "\\n", 2);
+                break;
+            case '\r':
+                _clog_append_str(b, "\\r", 2);
+                break;
+            case '\t':
+                _clog_append_str(b, "\\t", 2);
+                break;
+            default:
+                escape[4] = hex[(unsigned char) *s >> 4];
+                escape[5] = hex[*s & 15];
+                _clog_append_str(b, escape, 6);
+        }
+        s++;
+        len--;
+    }
+    _clog_append_str(b, "\"", 1);
+}
+
+/* Append value as short as it reads back the same, or null if JSON has no
+ * way to write it. */
+void
+_clog_append_double(struct clog_buf *b, double value, int json)
+{
+    const char *point;
+    char buf[40];
+    size_t len, point_len;
+    char *p;
+
+    if (value != value || value - value != 0) {
+        /* NaN or infinite. */
+        if (json) {
+            _clog_append_str(b, "null", 4);
+        } else {
+            _clog_append_printf(b, "%g", value);
+        }
+        return;
+    }
+    snprintf(buf, sizeof(buf), "%.15g", value);
+    if (strtod(buf, NULL) != value) {
+        snprintf(buf, sizeof(buf), "%.17g", value);
+    }
+    len = strlen(buf);
+
+    /* snprintf() writes the locale's decimal point, which may be a ',' or
+     * more than one byte; JSON and readers of fields want a '.'. */
+    point = localeconv()->decimal_point;
+    point_len = point != NULL ? strlen(point) : 0;
+    if (point_len > 0 && (point_len != 1 || point[0] != '.')) {
+        p = strstr(buf, point);
+        if (p != NULL) {
+            *p = '.';
+            memmove(p + 1, p + point_len, len - (p - buf) - point_len + 1);
+            len -= point_len - 1;
+        }
+    }
+    _clog_append_str(b, buf, len);
+}
+
+void
+_clog_append_hex(struct clog_buf *b, const char *data, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    char pair[2];
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        pair[0] = hex[(unsigned char) data[i] >> 4];
+        pair[1] = hex[data[i] & 15];
+        _clog_append_str(b, pair, 2);
+    }
+}
+
+/* Append fields as " key=value" to the text of a message. */
+void
+_clog_append_fields(struct clog_buf *b, const struct clog_field *fields,
+                    size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        const struct clog_field *field = &fields[i];
+        _clog_append_str(b, " ", 1);
+        _clog_append_str(b, field->key, strlen(field->key));
+        _clog_append_str(b, "=", 1);
+        switch (field->type) {
+            case CLOG_FIELD_INT:
+                _clog_append_int(b, field->value.i);
+                break;
+            case CLOG_FIELD_DOUBLE:
+                _clog_append_double(b, field->value.d, 0);
+                break;
+            case CLOG_FIELD_STRING:
+                /* Quoted if it would not read back as one value. */
+                if (field->len == 0
+                    || _clog_json_plain(field->value.s, field->len)
+                       < field->len
+                    || memchr(field->value.s, ' ', field->len)
+                    || memchr(field->value.s, '=', field->len)) {
+                    _clog_append_json_string(b, field->value.s, field->len);
+                } else {
+                    _clog_append_str(b, field->value.s, field->len);
+                }
+                break;
+            case CLOG_FIELD_BYTES:
+                _clog_append_hex(b, field->value.s, field->len);
+                break;
+        }
+    }
+}
+
+/* Format a line as a JSON object, with msg (of len bytes) and fields. */
+int
+_clog_format_json(struct clog_buf *b, const char *sfile, int sline,
+                  enum clog_level level, const char *msg, size_t len,
+                  const struct clog_field *fields, size_t count)
+{
+    const struct clog_time_cache *cache;
+    struct timespec now;
+    char fraction[8];
+    long usec;
+    size_t i;
+
+    _clog_now(&now, 1);
+    cache = _clog_get_json_time(now.tv_sec);
+    usec = now.tv_nsec / 1000;
+    fraction[0] = '.';
+    for (i = 6; i > 0; i--) {
+        fraction[i] = (char) ('0' + usec % 10);
+        usec /= 10;
+    }
+    fraction[7] = 'Z';
+    _clog_append_str(b, "{\"time\":\"", 9);
+    _clog_append_str(b, cache->date, cache->date_len);
+    _clog_append_str(b, fraction, sizeof(fraction));
+    _clog_append_str(b, "\",\"level\":\"", 11);
+    _clog_append_str(b, CLOG_LEVEL_NAMES[level], _clog_level_lengths[level]);
+    _clog_append_str(b, "\",\"file\":", 9);
+    _clog_append_json_string(b, sfile, strlen(sfile));
+    _clog_append_str(b, ",\"line\":", 8);
+    _clog_append_int(b, sline);
+    _clog_append_str(b, ",\"msg\":", 7);
+    _clog_append_json_string(b, msg, len);
+
+    for (i = 0; i < count; i++) {
+        const struct clog_field *field = &fields[i];
+        _clog_append_str(b, ",", 1);
+        _clog_append_json_string(b, field->key, strlen(field->key));
+        _clog_append_str(b, ":", 1);
+        switch (field->type) {
+            case CLOG_FIELD_INT:
+                _clog_append_int(b, field->value.i);
+                break;
+            case CLOG_FIELD_DOUBLE:
+                _clog_append_double(b, field->value.d, 1);
+                break;
+            case CLOG_FIELD_STRING:
+                _clog_append_json_string(b, field->value.s, field->len);
+                break;
+            case CLOG_FIELD_BYTES:
+                _clog_append_str(b, "\"", 1);
+                _clog_append_hex(b, field->value.s, field->len);
+                _clog_append_str(b, "\"", 1);
+                break;
+        }
+    }
+    _clog_append_str(b, "}\n", 2);
+    return b->failed;
+}
+
+/* Take size bytes at *p, before end, into value.  Non-zero if there are not
+ * that many. */
+int
+_clog_take(const char **p, const char *end, void *value, size_t size)
+{
+    if ((size_t) (end - *p) < size) {
+        return 1;
+    }
+    memcpy(value, *p, size);
+    *p += size;
+    return 0;
+}
+
+/* Take a string stored by _clog_append_string() at *p, before end. */
+int
+_clog_take_string(const char **p, const char *end, const char **str)
+{
+    unsigned int len;
+
+    if (_clog_take(p, end, &len, sizeof(len))) {
+        return 1;
+    }
+    if (len == ~0u) {
+        *str = NULL;
+        return 0;
+    }
+    if ((size_t) (end - *p) <= len || (*p)[len] != 0) {
+        return 1;
+    }
+    *str = *p;
+    *p += len + 1;
+    return 0;
+}
+
+/* Take the header of the record at *p, before end, and point *p at its
+ * payload.  Non-zero if the record is cut short. */
+int
+_clog_take_header(const char **p, const char *end,
+                  struct clog_binary_header *header)
+{
+    if (_clog_take(p, end, header, sizeof(*header))) {
+        return 1;
+    }
+    if (header->size < sizeof(*header)
+        || header->size - sizeof(*header) > (size_t) (end - *p)) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Format the message of a LOG record with format fmt and the arguments from
+ * p up to end into b.  Non-zero if the arguments do not match fmt. */
+int
+_clog_decode_message(struct clog_buf *b, const char *fmt,
+                     const char *p, const char *end)
+{
+    struct clog_conv conv;
+    const char *next, *s;
+    char spec[64];
+    size_t len;
+
+    while ((next = strchr(fmt, '%')) != NULL) {
+        int width = 0, precision = -1;
+
+        _clog_append_str(b, fmt, next - fmt);
+        fmt = _clog_parse_conv(next + 1, &conv);
+        if (conv.width_star && _clog_take(&p, end, &width, sizeof(width))) {
+            return 1;
+        }
+        if (conv.precision_star
+            && _clog_take(&p, end, &precision, sizeof(precision))) {
+            return 1;
+        }
+
+        /* The specification, with the width and precision arguments written
+         * in (a negative precision is as if there were none). */
+        len = 0;
+        for (s = next; s < fmt && len < sizeof(spec) - 16; ++s) {
+            if (*s != '*') {
+                spec[len++] = *s;
+            } else if (s[-1] != '.') {
+                len += sprintf(spec + len, "%d", width);
+            } else if (precision >= 0) {
+                len += sprintf(spec + len, "%d", precision);
+            } else {
+                len--;
+            }
+        }
+        if (s < fmt) {
+            return 1;
+        }
+        spec[len] = 0;
+
+        switch (conv.type) {
+            case CLOG_ARG_NONE:
+                _clog_append_printf(b, spec);
+                break;
+            case CLOG_ARG_INT: {
+                int value;
+                if (_clog_take(&p, end, &value, sizeof(value))) {
+                    return 1;
+                }
+                _clog_append_printf(b, spec, value);
+                break;
+            }
+            case CLOG_ARG_LONG: {
+                long value;
+                if (_clog_take(&p, end, &value, sizeof(value))) {
+                    return 1;
+                }
+                _clog_append_printf(b, spec, value);
+                break;
+            }
+#ifdef CLOG_C99
+            case CLOG_ARG_LLONG: {
+                long long value;
+                if (_clog_take(&p, end, &value, sizeof(value))) {
+                    return 1;
+                }
+                _clog_append_printf(b, spec, value);
+                break;
+            }
+            case CLOG_ARG_INTMAX: {
+                intmax_t value;
+                if (_clog_take(&p, end, &value, sizeof(value))) {
+                    return 1;
+                }
+                _clog_append_printf(b, spec, value);
+                break;
+            }
+#endif
+            case CLOG_ARG_SIZE: {
+                size_t value;
+                if (_clog_take(&p, end, &value, sizeof(value))) {
+                    return 1;
+                }
+                _clog_append_printf(b, spec, value);
+                break;
+            }
+            case CLOG_ARG_PTRDIFF: {
+                ptrdiff_t value;
+                if (_clog_take(&p, end, &value, sizeof(value))) {
+                    return 1;
+                }
+                _clog_append_printf(b, spec, value);
+                break;
+            }
+            case CLOG_ARG_DOUBLE: {
+                double value;
+                if (_clog_take(&p, end, &value, sizeof(value))) {
+                    return 1;
+                }
+                _clog_append_printf(b, spec, value);
+                break;
+            }
+            case CLOG_ARG_LDOUBLE: {
+                long double value;
+                if (_clog_take(&p, end, &value, sizeof(value))) {
+                    return 1;
+                }
+                _clog_append_printf(b, spec, value);
+                break;
+            }
+            case CLOG_ARG_POINTER: {
+                void *value;
+                if (_clog_take(&p, end, &value, sizeof(value))) {
+                    return 1;
+                }
+                _clog_append_printf(b, spec, value);
+                break;
+            }
+            case CLOG_ARG_STRING: {
+                const char *value;
+                if (_clog_take_string(&p, end, &value)) {
+                    return 1;
+                }
+                _clog_append_printf(b, spec, value);
+                break;
+            }
+            default:
+                return 1;
+        }
+    }
+    _clog_append_str(b, fmt, strlen(fmt));
+    return p != end;
+}
+
+/* _clog_format() with the message formatted from fmt and the arguments
+ * after it. */
+int
+_clog_format_args(struct clog *logger, struct clog_buf *b,
+                  const char *sfile, int sline, enum clog_level level,
+                  const struct timespec *when, const char *fmt, ...)
+{
+    va_list ap;
+    int result;
+    va_start(ap, fmt);
+    result = _clog_format(logger, b, sfile, sline, level, when, fmt, ap);
+    va_end(ap);
+    return result;
+}
+
+int
+clog_decode(int in_fd, int out_fd, const char *fmt,
+            const char *date_fmt, const char *time_fmt)
+{
+    static const unsigned char sizes[4] = {
+        sizeof(int), sizeof(long), sizeof(long double), sizeof(void *)
+    };
+    struct clog_decoded_site *sites = NULL;
+    struct clog_binary_header header;
+    struct clog logger;
+    struct clog_buf in, out, message;
+    char in_buf[4096], out_buf[4096], message_buf[4096];
+    const char *p, *q, *end, *session_end;
+    unsigned long skipped = 0;
+    int truncated = 0;
+    int result = 1;
+    ssize_t got;
+
+    if ((fmt && strlen(fmt) >= CLOG_FORMAT_LENGTH)
+        || (date_fmt && strlen(date_fmt) >= CLOG_FORMAT_LENGTH)
+        || (time_fmt && strlen(time_fmt) >= CLOG_FORMAT_LENGTH)) {
+        _clog_err("clog_decode: Format specifier too long.\n");
+        return 1;
+    }
+
+    /* Lines are rendered by a logger writing to out_fd. */
+    memset(&logger, 0, sizeof(logger));
+    logger.fd = out_fd;
+    logger.id = -1;
+    logger.format = _clog_compile_format(
+        fmt ? fmt : CLOG_DEFAULT_FORMAT,
+        date_fmt ? date_fmt : CLOG_DEFAULT_DATE_FORMAT,
+        time_fmt ? time_fmt : CLOG_DEFAULT_TIME_FORMAT);
+    sites = (struct clog_decoded_site *)
+        _clog_malloc((CLOG_SITES + 2) * sizeof(struct clog_decoded_site));
+    _clog_buf_init(&in, in_buf, sizeof(in_buf));
+    _clog_buf_init(&out, out_buf, sizeof(out_buf));
+    _clog_buf_init(&message, message_buf, sizeof(message_buf));
+    if (logger.format == NULL || sites == NULL) {
+        _clog_err("clog_decode: Out of memory.\n");
+        goto done;
+    }
+
+    /* Read all of it: a call site numbered while the logger switched files
+     * has its SITE record repeated in the new file, but possibly after
+     * records from it. */
+    for (;;) {
+        if (_clog_buf_reserve(&in, 65536)) {
+            _clog_err("clog_decode: Out of memory.\n");
+            goto done;
+        }
+        got = read(in_fd, in.data + in.len, in.size - in.len - 1);
+        if (got == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _clog_err("clog_decode: Unable to read: %s\n", strerror(errno));
+            goto done;
+        }
+        if (got == 0) {
+            break;
+        }
+        in.len += got;
+    }
+
+    p = in.data;
+    end = in.data + in.len;
+    while (p < end && !truncated) {
+        /* A session: a START record and the records up to the next one. */
+        if (_clog_take_header(&p, end, &header)
+            || header.type != CLOG_BINARY_START
+            || header.size != sizeof(header) + strlen(CLOG_BINARY_MAGIC)
+                              + sizeof(sizes)
+            || memcmp(p, CLOG_BINARY_MAGIC, strlen(CLOG_BINARY_MAGIC))) {
+            _clog_err("clog_decode: Not a binary log.\n");
+            goto done;
+        }
+        p += strlen(CLOG_BINARY_MAGIC);
+        if (memcmp(p, sizes, sizeof(sizes))) {
+            _clog_err("clog_decode: Log written on a different kind of "
+                      "machine.\n");
+            goto done;
+        }
+        p += sizeof(sizes);
+        logger.start.tv_sec = header.sec;
+        logger.start.tv_nsec = header.nsec;
+
+        /* First the call sites. */
+        memset(sites, 0, (CLOG_SITES + 2) * sizeof(struct clog_decoded_site));
+        for (q = p; q < end; q += header.size - sizeof(header)) {
+            const char *record = q;
+            struct clog_decoded_site site;
+            if (_clog_take_header(&q, end, &header)) {
+                truncated = 1;
+                q = record;
+                break;
+            }
+            if (header.type == CLOG_BINARY_START) {
+                q = record;
+                break;
+            }
+            if (header.type == CLOG_BINARY_SITE
+                && header.site > 0 && header.site < CLOG_SITES + 2) {
+                const char *payload = q;
+                const char *payload_end = q + header.size - sizeof(header);
+                if (!_clog_take(&payload, payload_end, &site.line,
+                                sizeof(site.line))
+                    && !_clog_take_string(&payload, payload_end, &site.file)
+                    && !_clog_take_string(&payload, payload_end, &site.fmt)
+                    && site.file != NULL && site.fmt != NULL) {
+                    sites[header.site] = site;
+                }
+            }
+        }
+        session_end = q;
+
+        /* Then the lines. */
+        for (q = p; q < session_end; q += header.size - sizeof(header)) {
+            const char *payload, *payload_end, *file, *text;
+            struct timespec when;
+            size_t text_len;
+            int line;
+
+            _clog_take_header(&q, session_end, &header);
+            payload = q;
+            payload_end = q + header.size - sizeof(header);
+            if (header.type != CLOG_BINARY_LOG
+                && header.type != CLOG_BINARY_TEXT) {
+                continue;
+            }
+            if (header.level > CLOG_ERROR) {
+                skipped++;
+                continue;
+            }
+            message.len = 0;
+            if (header.type == CLOG_BINARY_LOG) {
+                const struct clog_decoded_site *site =
+                    header.site < CLOG_SITES + 2 ? &sites[header.site] : NULL;
+                if (site == NULL || site->fmt == NULL
+                    || _clog_decode_message(&message, site->fmt,
+                                            payload, payload_end)) {
+                    skipped++;
+                    continue;
+                }
+                file = site->file;
+                line = site->line;
+                text = message.data;
+                text_len = message.len;
+            } else {
+                if (_clog_take(&payload, payload_end, &line, sizeof(line))
+                    || _clog_take_string(&payload, payload_end, &file)
+                    || file == NULL) {
+                    skipped++;
+                    continue;
+                }
+                text = payload;
+                text_len = payload_end - payload;
+            }
+
+            when.tv_sec = header.sec;
+            when.tv_nsec = header.nsec;
+            _clog_format_args(&logger, &out, _clog_basename(file), line,
+                              (enum clog_level) header.level, &when, "%.*s",
+                              (int) text_len, text);
+            if (out.failed || message.failed) {
+                _clog_err("clog_decode: Out of memory.\n");
+                goto done;
+            }
+            if (out.len >= 65536) {
+                if (_clog_write_fd(&logger, out.data, out.len) == -1) {
+                    _clog_err("clog_decode: Unable to write: %s\n",
+                              strerror(errno));
+                    goto done;
+                }
+                out.len = 0;
+            }
+        }
+        p = session_end;
+    }
+
+    if (_clog_write_fd(&logger, out.data, out.len) == -1) {
+        _clog_err("clog_decode: Unable to write: %s\n", strerror(errno));
+        goto done;
+    }
+    if (truncated) {
+        _clog_err("clog_decode: The last record is cut short.\n");
+    } else if (skipped) {
+        _clog_err("clog_decode: Skipped %lu records that could not be "
+                  "decoded.\n", skipped);
+    } else {
+        result = 0;
+    }
+
+done:
+    _clog_free(logger.format);
+    _clog_free(sites);
+    _clog_buf_free(&in);
+    _clog_buf_free(&out);
+    _clog_buf_free(&message);
+    return result;
+}
+
+/* Microseconds from start to end, for the write time of clog_stats().
+ * Counted in microseconds, a 32-bit unsigned long lasts over an hour of
+ * writing; the nanoseconds short of a whole one carry over to the thread's
+ * next write, so that short writes still add up. */
+unsigned long
+_clog_usec_between(const struct timespec *start, const struct timespec *end)
+{
+    double nsec = ((double) end->tv_sec - (double) start->tv_sec) * 1e9
+                  + (double) (end->tv_nsec - start->tv_nsec)
+                  + (double) _clog_nsec_carry;
+    double usec;
+
+    if (nsec <= 0) {
+        return 0;
+    }
+    usec = (double) (unsigned long) (nsec / 1000);
+    _clog_nsec_carry = (unsigned int) (nsec - usec * 1000);
+    return usec < (double) (unsigned long) -1 ? (unsigned long) usec
+                                              : (unsigned long) -1;
+}
+
+/* Write all of data to fd, counting the retries, errors and time (if
+ * timed) for logger if it is not NULL. */
+ssize_t
+_clog_write_counted(struct clog *logger, int fd, const char *data, size_t sz)
+{
+    struct timespec start, end;
+    size_t written = 0;
+    ssize_t result;
+    int timed = logger != NULL && _clog_load_relaxed(&logger->write_timing);
+
+    if (timed) {
+        _clog_monotonic(&start);
+    }
+    /* Short writes continue where they stopped. */
+    while (written < sz) {
+        result = write(fd, data + written, sz - written);
+        if (result == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                if (logger != NULL) {
+                    _clog_add_stat(logger, CLOG_COUNT_RETRIES, 1);
+                }
+                _clog_yield();
+                continue;
+            }
+            if (logger != NULL) {
+                _clog_add_stat(logger, CLOG_COUNT_ERRORS, 1);
+            }
+            return -1;
+        }
+        written += result;
+    }
+    if (timed) {
+        _clog_monotonic(&end);
+        _clog_add_stat(logger, CLOG_COUNT_WRITE_USEC,
+                       _clog_usec_between(&start, &end));
+    }
+    return (ssize_t) written;
+}
+
+ssize_t
+_clog_write_all(int fd, const char *data, size_t sz)
+{
+    return _clog_write_counted(NULL, fd, data, sz);
+}
+
+ssize_t
+_clog_write_fd(struct clog *logger, const char *data, size_t sz)
+{
+    int fd = _clog_load(&logger->fd);
+    ssize_t result = _clog_write_counted(logger, fd, data, sz);
+    if (result != -1 && logger->isatty)
+    {
+        fsync(fd);
+    }
+    return result;
+}
+
+#ifdef CLOG_THREADS
+int
+_clog_writev_fd(struct clog *logger, struct iovec *iov, int count)
+{
+    int fd = _clog_load(&logger->fd);
+    int timed = _clog_load_relaxed(&logger->write_timing);
+    struct timespec start, end;
+    ssize_t result;
+
+    if (timed) {
+        _clog_monotonic(&start);
+    }
+    while (count > 0) {
+        result = writev(fd, iov,
+                        count < CLOG_IOV_MAX ? count : CLOG_IOV_MAX);
+        if (result == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                _clog_add_stat(logger, CLOG_COUNT_RETRIES, 1);
+                _clog_yield();
+                continue;
+            }
+            _clog_add_stat(logger, CLOG_COUNT_ERRORS, 1);
+            return -1;
+        }
+        /* Skip what was written, which may end in the middle of a line. */
+        while (count > 0 && (size_t) result >= iov->iov_len) {
+            result -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + result;
+            iov->iov_len -= result;
+        }
+    }
+    if (timed) {
+        _clog_monotonic(&end);
+        _clog_add_stat(logger, CLOG_COUNT_WRITE_USEC,
+                       _clog_usec_between(&start, &end));
+    }
+    if (logger->isatty)
+    {
+        fsync(fd);
+    }
+    return 0;
+}
+#endif
+
+int
+clog_log(struct clog *logger, const char *data, size_t sz)
+{
+    /* Raw data is never dropped as debug output. */
+    return _clog_write(logger, CLOG_ERROR, data, sz);
+}
+
+#ifdef CLOG_THREADS
+
+/* Record headers: length << 2 | flags.  Zero means not yet published. */
+#define CLOG_RECORD_READY 1
+#define CLOG_RECORD_PAD 2
+#define CLOG_RECORD_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+/* Wake the writer and give it a moment to make room. */
+void
+_clog_async_wait(struct clog_async *async)
+{
+    struct timespec pause = { 0, 100000 };
+    pthread_mutex_lock(&async->lock);
+    pthread_cond_signal(&async->wakeup);
+    pthread_mutex_unlock(&async->lock);
+    nanosleep(&pause, NULL);
+}
+
+int
+_clog_async_push(struct clog *logger, enum clog_level level,
+                 const char *data, size_t sz)
+{
+    struct clog_async *async = logger->async;
+    enum clog_overflow overflow = _clog_load_relaxed(&async->overflow);
+    size_t need = CLOG_RECORD_ALIGN(sizeof(unsigned int) + sz);
+    size_t head, tail, offset, total;
+
+    if (need > async->size) {
+        /* Would never fit: write it from this thread instead, once the
+         * lines queued before it are out. */
+        size_t mark = _clog_load(&async->head);
+        for (;;) {
+            head = _clog_load(&async->head);
+            tail = _clog_load_acquire(&async->tail);
+            if (tail - mark <= head - mark) {
+                break;
+            }
+            _clog_async_wait(async);
+        }
+        return _clog_write_fd(logger, data, sz);
+    }
+
+    for (;;) {
+        head = _clog_load(&async->head);
+        tail = _clog_load_acquire(&async->tail);
+        offset = head & (async->size - 1);
+        total = need;
+        if (offset + need > async->size) {
+            /* Records do not wrap; pad to the end of the ring. */
+            total += async->size - offset;
+        }
+        if (level == CLOG_DEBUG
+            && overflow == CLOG_OVERFLOW_DROP_DEBUG
+            && head - tail + total > async->size / 2) {
+            _clog_count(&async->dropped, 1);
+            return 0;
+        }
+        if (head - tail + total > async->size) {
+            if (overflow != CLOG_OVERFLOW_BLOCK) {
+                _clog_count(&async->dropped, 1);
+                return 0;
+            }
+            _clog_async_wait(async);
+            continue;
+        }
+        if (_clog_cas(&async->head, &head, head + total)) {
+            break;
+        }
+    }
+
+    if (total != need) {
+        _clog_store_release((unsigned int *) (async->ring + offset),
+            (unsigned int) ((async->size - offset - sizeof(unsigned int)) << 2
+                            | CLOG_RECORD_PAD | CLOG_RECORD_READY));
+        offset = 0;
+    }
+    memcpy(async->ring + offset + sizeof(unsigned int), data, sz);
+    _clog_store_release((unsigned int *) (async->ring + offset),
+                        (unsigned int) (sz << 2 | CLOG_RECORD_READY));
+
+    if (_clog_load(&async->sleeping)) {
+        pthread_mutex_lock(&async->lock);
+        pthread_cond_signal(&async->wakeup);
+        pthread_mutex_unlock(&async->lock);
+    }
+    return (int) sz;
+}
+
+/* Write out published records at the tail of the ring, up to CLOG_IOV_MAX
+ * of them.  Returns the number of bytes consumed. */
+size_t
+_clog_async_drain(struct clog *logger)
+{
+    struct clog_async *async = logger->async;
+    size_t tail = async->tail;
+    size_t head = _clog_load(&async->head);
+    size_t start = tail;
+    int count = 0;
+
+    while (tail != head && count < CLOG_IOV_MAX) {
+        size_t offset = tail & (async->size - 1);
+        unsigned int header = _clog_load_acquire(
+            (unsigned int *) (async->ring + offset));
+        size_t len = header >> 2;
+
+        if (!(header & CLOG_RECORD_READY)) {
+            /* Still being copied in. */
+            break;
+        }
+        if (!(header & CLOG_RECORD_PAD)) {
+            async->iov[count].iov_base = async->ring + offset
+                                         + sizeof(unsigned int);
+            async->iov[count].iov_len = len;
+            count++;
+        }
+        tail += CLOG_RECORD_ALIGN(sizeof(unsigned int) + len);
+    }
+
+    if (count > 0 && _clog_writev_fd(logger, async->iov, count) == -1) {
+        _clog_err("Unable to write to log file: %s\n", strerror(errno));
+    }
+
+    /* Consumed space must read as unpublished before producers reuse it. */
+    if (tail != start) {
+        size_t from = start & (async->size - 1);
+        size_t len = tail - start;
+        if (from + len > async->size) {
+            memset(async->ring + from, 0, async->size - from);
+            memset(async->ring, 0, len - (async->size - from));
+        } else {
+            memset(async->ring + from, 0, len);
+        }
+        _clog_store_release(&async->tail, tail);
+    }
+    return tail - start;
+}
+
+void *
+_clog_async_main(void *arg)
+{
+    struct clog *logger = (struct clog *) arg;
+    struct clog_async *async = logger->async;
+
+    for (;;) {
+        /* Writing to the fd is a log call, which clog_rotate waits for. */
+        unsigned int token = _clog_read_lock(logger->id);
+        size_t drained = _clog_async_drain(logger);
+        _clog_read_unlock(logger->id, token);
+        if (drained > 0) {
+            continue;
+        }
+        if (_clog_load(&async->head) != async->tail) {
+            /* A producer is still copying its line in. */
+            struct timespec pause = { 0, 10000 };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        if (_clog_load(&async->stop)) {
+            break;
+        }
+
+        pthread_mutex_lock(&async->lock);
+        _clog_store(&async->sleeping, 1);
+        if (_clog_load(&async->head) == async->tail
+            && !_clog_load(&async->stop)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&async->wakeup, &async->lock, &deadline);
+        }
+        _clog_store(&async->sleeping, 0);
+        pthread_mutex_unlock(&async->lock);
+    }
+    return NULL;
+}
+
+int
+_clog_start_async(struct clog *logger, size_t ring_bytes)
+{
+    struct clog_async *async;
+    size_t size = 4096;
+
+    while (size < ring_bytes) {
+        size *= 2;
+    }
+
+    async = (struct clog_async *) _clog_calloc(1, sizeof(struct clog_async));
+    if (async == NULL) {
+        _clog_err("Failed to allocate logger: %s\n", strerror(errno));
+        return 1;
+    }
+    async->size = size;
+    async->ring = (char *) _clog_calloc(1, size);
+    async->overflow = CLOG_OVERFLOW_BLOCK;
+    if (async->ring == NULL) {
+        _clog_err("Failed to allocate ring buffer: %s\n", strerror(errno));
+        _clog_free(async);
+        return 1;
+    }
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->wakeup, NULL);
+
+    _clog_register_atexit();
+    _clog_watch_fork();
+    logger->async = async;
+    async->running = 1;
+    if (pthread_create(&async->thread, NULL, _clog_async_main, logger) != 0) {
+        _clog_err("Unable to start log writer thread.\n");
+        logger->async = NULL;
+        pthread_mutex_destroy(&async->lock);
+        pthread_cond_destroy(&async->wakeup);
+        _clog_free(async->ring);
+        _clog_free(async);
+        return 1;
+    }
+    return 0;
+}
+
+void
+_clog_stop_async(struct clog *logger)
+{
+    struct clog_async *async = logger->async;
+
+    pthread_mutex_lock(&async->lock);
+    _clog_store(&async->stop, 1);
+    pthread_cond_signal(&async->wakeup);
+    pthread_mutex_unlock(&async->lock);
+    if (async->running) {
+        pthread_join(async->thread, NULL);
+    }
+
+    logger->async = NULL;
+    pthread_mutex_destroy(&async->lock);
+    pthread_cond_destroy(&async->wakeup);
+    _clog_free(async->ring);
+    _clog_free(async);
+}
+
+#else /* CLOG_THREADS */
+
+int
+_clog_start_async(struct clog *logger, size_t ring_bytes)
+{
+    (void) logger;
+    (void) ring_bytes;
+    _clog_err("Asynchronous logging needs threads.\n");
+    return 1;
+}
+
+void
+_clog_stop_async(struct clog *logger)
+{
+    (void) logger;
+}
+
+#endif /* CLOG_THREADS */
+
+#ifdef CLOG_MMAP
+
+/* Map the part of fd from end on, extending the file so that the segment
+ * holds at least min_bytes more. */
+struct clog_segment *
+_clog_map_segment(int fd, off_t end, size_t min_bytes, size_t segment_bytes)
+{
+    struct clog_segment *segment;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    off_t aligned = end - end % (off_t) page;
+    size_t size = segment_bytes;
+    int error;
+
+    if (size < (size_t) (end - aligned) + min_bytes) {
+        size = (size_t) (end - aligned) + min_bytes;
+    }
+    size = (size + page - 1) / page * page;
+
+    /* Allocate the blocks now: running out of space later would kill the
+     * process with SIGBUS in the middle of a log call.  Without
+     * posix_fallocate() the file is only extended. */
+#if defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L
+    error = posix_fallocate(fd, aligned, (off_t) size);
+#else
+    error = EINVAL;
+#endif
+    if (error == EINVAL || error == EOPNOTSUPP) {
+        error = ftruncate(fd, aligned + (off_t) size) == -1 ? errno : 0;
+    }
+    if (error) {
+        _clog_err("Unable to extend log file: %s\n", strerror(error));
+        return NULL;
+    }
+
+    segment =
+        (struct clog_segment *) _clog_calloc(1, sizeof(struct clog_segment));
+    if (segment == NULL) {
+        _clog_err("Out of memory mapping log file.\n");
+        return NULL;
+    }
+    segment->map = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, fd, aligned);
+    if (segment->map == (char *) MAP_FAILED) {
+        _clog_err("Unable to map log file: %s\n", strerror(errno));
+        _clog_free(segment);
+        return NULL;
+    }
+#if defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L
+    posix_madvise(segment->map, size, POSIX_MADV_SEQUENTIAL);
+#endif
+    segment->size = size;
+    segment->fd = fd;
+    segment->offset = aligned;
+    segment->reserved = segment->committed = (size_t) (end - aligned);
+    return segment;
+}
+
+/* Stop new lines going to a segment.  Returns the number of bytes of it
+ * reserved. */
+size_t
+_clog_seal_segment(struct clog_segment *segment)
+{
+    size_t reserved = _clog_load(&segment->reserved);
+    while (!(reserved & CLOG_SEGMENT_CLOSED)
+           && !_clog_cas(&segment->reserved, &reserved,
+                         reserved | CLOG_SEGMENT_CLOSED)) {
+    }
+    return reserved & ~CLOG_SEGMENT_CLOSED;
+}
+
+/* Start writeback of a segment now rather than when the kernel gets to it,
+ * and unmap it. */
+void
+_clog_unmap_segment(char *map, size_t size)
+{
+    msync(map, size, MS_ASYNC);
+    munmap(map, size);
+}
+
+/* Stop new lines going to a segment, wait for the ones copied into it to
+ * finish and unmap it.  Returns the offset in the file after its last line.
+ * Called with the mmap lock held. */
+off_t
+_clog_close_segment(struct clog_segment *segment)
+{
+    size_t reserved = _clog_seal_segment(segment);
+    if (segment->map != NULL) {
+        while (_clog_load(&segment->committed) != reserved) {
+            sched_yield();
+        }
+        _clog_unmap_segment(segment->map, segment->size);
+        segment->map = NULL;
+    }
+    return segment->offset + (off_t) reserved;
+}
+
+/* Free segments no log call is using any more. */
+void
+_clog_free_segments(struct clog_segment *segment)
+{
+    while (segment != NULL) {
+        struct clog_segment *retired = segment->retired;
+        if (segment->map != NULL) {
+            _clog_unmap_segment(segment->map, segment->size);
+        }
+        _clog_free(segment);
+        segment = retired;
+    }
+}
+
+/* Replace a segment that is full (or could not be replaced before) with
+ * one holding at least sz more bytes: the spare if the line fits, or one
+ * mapped here.  Lines still being copied into the full segment finish on
+ * their own; the background thread unmaps it and maps the next spare. */
+int
+_clog_mmap_roll(struct clog *logger, struct clog_segment *full, size_t sz)
+{
+    struct clog_mmap *mapped = logger->mapped;
+    struct clog_segment *next, *spare;
+    off_t end;
+    int result = 0;
+
+    pthread_mutex_lock(&mapped->lock);
+    if (mapped->segment == full) {
+        end = full->offset + (off_t) _clog_seal_segment(full);
+        spare = mapped->spare;
+        if (spare != NULL && end >= spare->offset
+            && (size_t) (end - spare->offset) + sz <= spare->size) {
+            next = spare;
+            next->reserved = next->committed = (size_t) (end - spare->offset);
+            mapped->spare = NULL;
+        } else {
+            next = _clog_map_segment(full->fd, end, sz,
+                                     mapped->segment_bytes);
+        }
+        if (next == NULL) {
+            result = 1;
+        } else {
+            next->retired = full;
+            _clog_store_release(&mapped->segment, next);
+        }
+    }
+    pthread_mutex_unlock(&mapped->lock);
+    _clog_bg_tend_mmap();
+    return result;
+}
+
+int
+_clog_mmap_write(struct clog *logger, const char *data, size_t sz)
+{
+    struct clog_mmap *mapped = logger->mapped;
+    struct clog_segment *segment;
+    size_t reserved;
+
+    for (;;) {
+        segment = _clog_load_acquire(&mapped->segment);
+        reserved = _clog_load(&segment->reserved);
+        if ((reserved & CLOG_SEGMENT_CLOSED)
+            || reserved + sz > segment->size) {
+            if (_clog_mmap_roll(logger, segment, sz)) {
+                return -1;
+            }
+        } else if (_clog_cas(&segment->reserved, &reserved,
+                             reserved + sz)) {
+            break;
+        }
+    }
+    memcpy(segment->map + reserved, data, sz);
+    _clog_add(&segment->committed, sz);
+    return (int) sz;
+}
+
+int
+_clog_start_mmap(struct clog *logger, size_t segment_bytes)
+{
+    struct clog_mmap *mapped;
+    off_t end = lseek(logger->fd, 0, SEEK_END);
+    if (end == -1) {
+        _clog_err("Unable to map log file: %s\n", strerror(errno));
+        return 1;
+    }
+    mapped = (struct clog_mmap *) _clog_calloc(1, sizeof(struct clog_mmap));
+    if (mapped == NULL) {
+        _clog_err("Out of memory mapping log file.\n");
+        return 1;
+    }
+    mapped->segment_bytes = segment_bytes;
+    mapped->segment = _clog_map_segment(logger->fd, end, 0, segment_bytes);
+    if (mapped->segment == NULL) {
+        _clog_free(mapped);
+        return 1;
+    }
+    pthread_mutex_init(&mapped->lock, NULL);
+    logger->mapped = mapped;
+    return 0;
+}
+
+/* Drop the spare segment, which maps the logger's current file. */
+void
+_clog_drop_spare(struct clog_mmap *mapped)
+{
+    if (mapped->spare != NULL) {
+        _clog_free_segments(mapped->spare);
+        mapped->spare = NULL;
+    }
+}
+
+/* Background work for a memory-mapped logger: unmap the segments replaced
+ * whose lines are all copied, and map a spare for the next roll. */
+void
+_clog_mmap_tend(struct clog *logger)
+{
+    struct clog_mmap *mapped = logger->mapped;
+    struct clog_segment *segment, *current, *spare;
+    char *maps[8];
+    size_t sizes[8], page = (size_t) sysconf(_SC_PAGESIZE);
+    off_t start;
+    int count = 0, i;
+
+    pthread_mutex_lock(&mapped->lock);
+    current = mapped->segment;
+    for (segment = current->retired; segment && count < 8;
+         segment = segment->retired) {
+        size_t reserved = _clog_load(&segment->reserved);
+        if (segment->map != NULL && (reserved & CLOG_SEGMENT_CLOSED)
+            && _clog_load(&segment->committed)
+               == (reserved & ~CLOG_SEGMENT_CLOSED)) {
+            maps[count] = segment->map;
+            sizes[count++] = segment->size;
+            segment->map = NULL;
+        }
+    }
+    /* A spare left behind by a roll it could not take is mapped anew. */
+    start = current->offset + (off_t) (current->size - page);
+    spare = mapped->spare;
+    if (spare != NULL && spare->offset != start) {
+        mapped->spare = NULL;
+    } else {
+        spare = NULL;
+    }
+    if (mapped->spare == NULL) {
+        mapped->spare = _clog_map_segment(current->fd, start,
+                                          page + mapped->segment_bytes,
+                                          mapped->segment_bytes);
+    }
+    pthread_mutex_unlock(&mapped->lock);
+
+    for (i = 0; i < count; i++) {
+        _clog_unmap_segment(maps[i], sizes[i]);
+    }
+    _clog_free_segments(spare);
+}
+
+/* Map the end of fd, the logger's next file, and send log calls there.  The
+ * old file is cut off after its last line. */
+int
+_clog_mmap_switch(struct clog *logger, int fd)
+{
+    struct clog_mmap *mapped = logger->mapped;
+    struct clog_segment *next, *old;
+    struct stat st;
+    off_t end;
+
+    if (fstat(fd, &st) == -1) {
+        _clog_err("Unable to map log file: %s\n", strerror(errno));
+        return 1;
+    }
+    next = _clog_map_segment(fd, st.st_size, 0, mapped->segment_bytes);
+    if (next == NULL) {
+        return 1;
+    }
+    pthread_mutex_lock(&mapped->lock);
+    _clog_drop_spare(mapped);
+    old = mapped->segment;
+    end = _clog_close_segment(old);
+    if (ftruncate(old->fd, end) == -1) {
+        _clog_err("Unable to truncate log file: %s\n", strerror(errno));
+    }
+    next->retired = old;
+    _clog_store_release(&mapped->segment, next);
+    pthread_mutex_unlock(&mapped->lock);
+    _clog_bg_tend_mmap();
+    return 0;
+}
+
+/* Free the segments replaced so far, once no log call can be using them. */
+void
+_clog_mmap_retire(struct clog *logger)
+{
+    struct clog_mmap *mapped = logger->mapped;
+    struct clog_segment *retired;
+
+    pthread_mutex_lock(&mapped->lock);
+    retired = mapped->segment->retired;
+    mapped->segment->retired = NULL;
+    pthread_mutex_unlock(&mapped->lock);
+    _clog_free_segments(retired);
+}
+
+void
+_clog_stop_mmap(struct clog *logger)
+{
+    struct clog_mmap *mapped = logger->mapped;
+    struct clog_segment *segment = mapped->segment;
+    off_t end;
+
+    _clog_drop_spare(mapped);
+    end = _clog_close_segment(segment);
+    if (ftruncate(segment->fd, end) == -1) {
+        _clog_err("Unable to truncate log file: %s\n", strerror(errno));
+    }
+    _clog_free_segments(segment);
+    logger->mapped = NULL;
+    pthread_mutex_destroy(&mapped->lock);
+    _clog_free(mapped);
+}
+
+int
+clog_init_path_mmap(int id, const char *const path, size_t segment_bytes)
+{
+    struct clog *logger;
+    int fd = open(path, O_CREAT | O_RDWR, 0666);
+    if (fd == -1) {
+        _clog_err("Unable to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    logger = _clog_new(id, fd);
+    if (logger == NULL) {
+        close(fd);
+        return 1;
+    }
+    logger->opened = 1;
+    logger->path = _clog_copy_path(path);
+    if (logger->path == NULL || _clog_start_mmap(logger, segment_bytes)) {
+        _clog_destroy(logger);
+        return 1;
+    }
+    if (_clog_publish(logger)) {
+        return 1;
+    }
+    /* Have the background thread map the next segment ahead. */
+    _clog_bg_schedule(0);
+    _clog_bg_tend_mmap();
+    return 0;
+}
+
+#else /* CLOG_MMAP */
+
+int
+_clog_mmap_write(struct clog *logger, const char *data, size_t sz)
+{
+    (void) logger;
+    (void) data;
+    (void) sz;
+    return -1;
+}
+
+int
+_clog_mmap_switch(struct clog *logger, int fd)
+{
+    (void) logger;
+    (void) fd;
+    return 1;
+}
+
+void
+_clog_mmap_retire(struct clog *logger)
+{
+    (void) logger;
+}
+
+void
+_clog_stop_mmap(struct clog *logger)
+{
+    (void) logger;
+}
+
+void
+_clog_mmap_tend(struct clog *logger)
+{
+    (void) logger;
+}
+
+int
+clog_init_path_mmap(int id, const char *const path, size_t segment_bytes)
+{
+    (void) id;
+    (void) path;
+    (void) segment_bytes;
+    _clog_err("Memory-mapped logging needs mmap() and threads.\n");
+    return 1;
+}
+
+#endif /* CLOG_MMAP */
+
+unsigned long
+_clog_millis(void)
+{
+    struct timespec now;
+    _clog_monotonic(&now);
+    return (unsigned long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int
+_clog_buffer_flush(struct clog *logger, struct clog_buffer *buffer)
+{
+    size_t state, used;
+    int index, expected = 0, result = 0;
+
+    while (!_clog_cas(&buffer->flushing, &expected, 1)) {
+        expected = 0;
+        _clog_yield();
+    }
+    if (buffer->previous) {
+        _clog_buffer_flush(logger, buffer->previous);
+    }
+
+    /* Switch buffers, then wait for copies into the old one to finish. */
+    state = _clog_load(&buffer->state);
+    while (!_clog_cas(&buffer->state, &state,
+                      (state & CLOG_BUFFER_SWAP) ^ CLOG_BUFFER_SWAP)) {
+    }
+    index = (state & CLOG_BUFFER_SWAP) ? 1 : 0;
+    used = state & ~CLOG_BUFFER_SWAP;
+    while (_clog_load(&buffer->writers[index]) != 0) {
+        _clog_yield();
+    }
+
+    if (used > 0) {
+        result = _clog_write_fd(logger, buffer->data[index], used);
+        if (result == -1) {
+            _clog_err("Unable to write to log file: %s\n", strerror(errno));
+        }
+    }
+    _clog_store_release(&buffer->last_flush, _clog_millis());
+    _clog_store(&buffer->flushing, 0);
+    return result == -1 ? 1 : 0;
+}
+
+int
+_clog_buffer_write(struct clog *logger, struct clog_buffer *buffer,
+                   enum clog_level level, const char *data, size_t sz)
+{
+    size_t state, used;
+    int index;
+
+    if (sz > buffer->size) {
+        /* Too large to buffer: write out what is there, then the line. */
+        _clog_buffer_flush(logger, buffer);
+        return _clog_write_fd(logger, data, sz);
+    }
+
+    for (;;) {
+        state = _clog_load(&buffer->state);
+        index = (state & CLOG_BUFFER_SWAP) ? 1 : 0;
+        used = state & ~CLOG_BUFFER_SWAP;
+        if (used + sz > buffer->size) {
+            _clog_buffer_flush(logger, buffer);
+            continue;
+        }
+        _clog_add(&buffer->writers[index], 1);
+        if (_clog_cas(&buffer->state, &state, state + sz)) {
+            break;
+        }
+        _clog_sub(&buffer->writers[index], 1);
+    }
+    memcpy(buffer->data[index] + used, data, sz);
+    _clog_sub(&buffer->writers[index], 1);
+
+    if (level >= _clog_load_relaxed(&logger->flush_level)) {
+        _clog_buffer_flush(logger, buffer);
+    }
+#ifndef CLOG_THREADS
+    /* No background thread to do time-based flushes. */
+    else if (buffer->flush_ms > 0
+             && _clog_millis() - buffer->last_flush >= buffer->flush_ms) {
+        _clog_buffer_flush(logger, buffer);
+    }
+#endif
+    return (int) sz;
+}
+
+void
+_clog_free_buffer(struct clog_buffer *buffer)
+{
+    _clog_free(buffer->data[0]);
+    _clog_free(buffer->data[1]);
+    _clog_free(buffer);
+}
+
+/* Rotate the loggers whose policy says so, and reopen those asked to. */
+void
+_clog_switch_files(void)
+{
+    time_t now = time(NULL);
+    int id;
+
+    _clog_lock_config();
+    for (id = 0; id < _clog_id_limit(); id++) {
+        struct clog *logger = _clog_get(id);
+        int reopen = _clog_swap(_clog_reopen_slot(id), 0) != 0;
+        if (logger == NULL) {
+            continue;
+        }
+        if (_clog_load(&logger->rotate_requested)
+            || (logger->rotate_due > 0 && now >= logger->rotate_due)) {
+            _clog_rotate(id, NULL);
+        } else if (reopen && logger->path != NULL) {
+            _clog_switch_file(id, NULL, 0);
+        }
+    }
+    _clog_unlock_config();
+}
+
+#ifdef CLOG_THREADS
+/* The background thread doing time-based flushes and rotations, started on
+ * first use. */
+pthread_mutex_t _clog_bg_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _clog_bg_wakeup = PTHREAD_COND_INITIALIZER;
+int _clog_bg_started = 0;
+unsigned int _clog_bg_interval = 0;
+
+/* Set when a log call asks for a rotation, or a rotation policy is set. */
+int _clog_bg_rotate = 0;
+
+/* Set when a memory-mapped logger has segments to unmap or map ahead. */
+int _clog_bg_mmap = 0;
+
+/* Files rotated out, to be synced and closed. */
+int *_clog_bg_closing = NULL;
+size_t _clog_bg_closing_count = 0;
+size_t _clog_bg_closing_size = 0;
+
+/**
+ * A rotation asked for by clog_rotate(), whose older files are still to be
+ * shifted up before old_path, the file it rotated out, takes the first
+ * place.
+ */
+struct clog_shift_job {
+    struct clog_shift_job *next;
+    char *path;
+    char *old_path;
+    unsigned int keep;
+    int compress;
+};
+
+/* Rotations waiting for the background thread to shift their files, in the
+ * order they were made. */
+struct clog_shift_job *_clog_bg_shifting = NULL;
+
+/* Do the shifts of the rotations waiting for them.  Called with the config
+ * lock held, which keeps them in order. */
+void
+_clog_bg_shift(void)
+{
+    struct clog_shift_job *job, *next;
+
+    pthread_mutex_lock(&_clog_bg_lock);
+    job = _clog_bg_shifting;
+    _clog_bg_shifting = NULL;
+    pthread_mutex_unlock(&_clog_bg_lock);
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+        _clog_place_rotated(job->path, job->keep, job->old_path,
+                            job->compress);
+        _clog_free(job);
+    }
+}
+
+/* Sync and close the files rotated out, off the threads that log. */
+void
+_clog_bg_close(void)
+{
+    int *closing;
+    size_t count, i;
+
+    pthread_mutex_lock(&_clog_bg_lock);
+    closing = _clog_bg_closing;
+    count = _clog_bg_closing_count;
+    _clog_bg_closing = NULL;
+    _clog_bg_closing_count = _clog_bg_closing_size = 0;
+    pthread_mutex_unlock(&_clog_bg_lock);
+
+    for (i = 0; i < count; i++) {
+        fsync(closing[i]);
+        close(closing[i]);
+    }
+    _clog_free(closing);
+}
+
+void *
+_clog_bg_main(void *arg)
+{
+    time_t checked = 0;
+    (void) arg;
+    pthread_mutex_lock(&_clog_bg_lock);
+    for (;;) {
+        struct timespec deadline;
+        unsigned long now;
+        int id, rotate, mmap_work, shift;
+
+        if (_clog_bg_rotate || _clog_bg_mmap || _clog_bg_closing_count > 0
+            || _clog_bg_shifting != NULL) {
+            /* Work to do already. */
+        } else if (_clog_bg_interval == 0) {
+            pthread_cond_wait(&_clog_bg_wakeup, &_clog_bg_lock);
+        } else {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += _clog_bg_interval / 1000;
+            deadline.tv_nsec += (_clog_bg_interval % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&_clog_bg_wakeup, &_clog_bg_lock,
+                                   &deadline);
+        }
+        rotate = _clog_bg_rotate || _clog_swap(&_clog_reopen_pending, 0);
+        _clog_bg_rotate = 0;
+        mmap_work = _clog_bg_mmap;
+        _clog_bg_mmap = 0;
+        shift = _clog_bg_shifting != NULL;
+        pthread_mutex_unlock(&_clog_bg_lock);
+
+        if (shift) {
+            _clog_lock_config();
+            _clog_bg_shift();
+            _clog_unlock_config();
+        }
+
+        /* Time-based rotations are checked once a second, the others when
+         * asked for. */
+        if (rotate || time(NULL) != checked) {
+            checked = time(NULL);
+            _clog_switch_files();
+        }
+        _clog_bg_close();
+
+        /* Like a log call, keep each logger and its buffer from being freed
+         * while flushing it. */
+        now = _clog_millis();
+        for (id = 0; id < _clog_id_limit(); id++) {
+            unsigned int token = _clog_read_lock(id);
+            struct clog *logger = _clog_get(id);
+            struct clog_buffer *buffer = NULL;
+            if (logger != NULL) {
+                buffer = _clog_load(&logger->buffer);
+            }
+            if (buffer && buffer->flush_ms > 0
+                && now - _clog_load_acquire(&buffer->last_flush)
+                   >= buffer->flush_ms) {
+                _clog_buffer_flush(logger, buffer);
+            }
+            if (mmap_work && logger != NULL && logger->mapped != NULL) {
+                _clog_mmap_tend(logger);
+            }
+            if (logger != NULL && _clog_load(&logger->repeated) != NULL) {
+                _clog_report_repeats(logger, 1);
+            }
+            _clog_read_unlock(id, token);
+        }
+        pthread_mutex_lock(&_clog_bg_lock);
+    }
+    return NULL;
+}
+
+/* Have the background thread wake up at least every interval ms (zero
+ * only starts it). */
+int
+_clog_bg_schedule(unsigned int interval)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&_clog_bg_lock);
+    if (interval > 0
+        && (_clog_bg_interval == 0 || interval < _clog_bg_interval)) {
+        _clog_bg_interval = interval;
+        pthread_cond_signal(&_clog_bg_wakeup);
+    }
+    if (!_clog_bg_started) {
+        pthread_t thread;
+        _clog_watch_fork();
+        if (pthread_create(&thread, NULL, _clog_bg_main, NULL) == 0) {
+            pthread_detach(thread);
+            _clog_bg_started = 1;
+        } else {
+            _clog_err("Unable to start log flush thread.\n");
+            result = 1;
+        }
+    }
+    pthread_mutex_unlock(&_clog_bg_lock);
+    return result;
+}
+
+/* Have the background thread look after the memory-mapped loggers. */
+void
+_clog_bg_tend_mmap(void)
+{
+    pthread_mutex_lock(&_clog_bg_lock);
+    _clog_bg_mmap = 1;
+    pthread_cond_signal(&_clog_bg_wakeup);
+    pthread_mutex_unlock(&_clog_bg_lock);
+}
+
+/* Called by a log call that took its logger past its rotation size. */
+void
+_clog_request_rotation(struct clog *logger)
+{
+    if (_clog_swap(&logger->rotate_requested, 1) == 0) {
+        pthread_mutex_lock(&_clog_bg_lock);
+        _clog_bg_rotate = 1;
+        pthread_cond_signal(&_clog_bg_wakeup);
+        pthread_mutex_unlock(&_clog_bg_lock);
+    }
+}
+#endif /* CLOG_THREADS */
+
+/* Called by a log call that found reopens pending: have the background
+ * thread do them, or do them here if there is none. */
+void
+_clog_reopen_pending_files(void)
+{
+    if (_clog_swap(&_clog_reopen_pending, 0) == 0) {
+        return;
+    }
+#ifdef CLOG_THREADS
+    pthread_mutex_lock(&_clog_bg_lock);
+    _clog_bg_rotate = 1;
+    pthread_cond_signal(&_clog_bg_wakeup);
+    pthread_mutex_unlock(&_clog_bg_lock);
+    if (_clog_bg_schedule(0) == 0) {
+        return;
+    }
+#endif
+    _clog_switch_files();
+}
+
+int
+clog_request_reopen(int id)
+{
+    struct clog **slot;
+    int result = 1;
+
+    /* Atomic loads and stores only, no locks and nothing thread-local: this
+     * runs in signal handlers. */
+
+    if (id == -1) {
+        for (id = 0; id < _clog_id_limit(); id++) {
+            if (clog_request_reopen(id) == 0) {
+                result = 0;
+            }
+        }
+        return result;
+    }
+    slot = _clog_slot(id);
+    if (slot == NULL || _clog_load(slot) == NULL) {
+        return 1;
+    }
+    _clog_store(_clog_reopen_slot(id), 1);
+    _clog_store(&_clog_reopen_pending, 1);
+    return 0;
+}
+
+int
+clog_reopen(int id)
+{
+    int result;
+    _clog_lock_config();
+    result = _clog_switch_file(id, NULL, 0);
+    _clog_unlock_config();
+    return result;
+}
+
+/* Hand the shift of the files rotated out of path to the background thread,
+ * with old_path to take the first place, or do it here if there is none.
+ * Called with the config lock held. */
+void
+_clog_shift_later(const char *path, unsigned int keep, const char *old_path,
+                  int compress)
+{
+#ifdef CLOG_THREADS
+    size_t len = strlen(path), old_len = strlen(old_path);
+    struct clog_shift_job *job, **last;
+
+    job = (struct clog_shift_job *)
+        _clog_malloc(sizeof(struct clog_shift_job) + len + old_len + 2);
+    if (job != NULL) {
+        job->path = (char *) (job + 1);
+        memcpy(job->path, path, len + 1);
+        job->old_path = job->path + len + 1;
+        memcpy(job->old_path, old_path, old_len + 1);
+        job->keep = keep;
+        job->compress = compress;
+        job->next = NULL;
+
+        pthread_mutex_lock(&_clog_bg_lock);
+        for (last = &_clog_bg_shifting; *last; last = &(*last)->next) {
+        }
+        *last = job;
+        pthread_cond_signal(&_clog_bg_wakeup);
+        pthread_mutex_unlock(&_clog_bg_lock);
+        if (_clog_bg_schedule(0)) {
+            _clog_bg_shift();
+        }
+        return;
+    }
+#endif
+    _clog_place_rotated(path, keep, old_path, compress);
+}
+
+/* Hand a rotated file to the background thread to sync and close, or do
+ * it here if there is none. */
+void
+_clog_close_later(int fd)
+{
+#ifdef CLOG_THREADS
+    int *closing;
+
+    pthread_mutex_lock(&_clog_bg_lock);
+    if (_clog_bg_closing_count == _clog_bg_closing_size) {
+        size_t size = _clog_bg_closing_size ? _clog_bg_closing_size * 2 : 4;
+        closing = (int *) _clog_realloc(_clog_bg_closing, size * sizeof(int));
+        if (closing != NULL) {
+            _clog_bg_closing = closing;
+            _clog_bg_closing_size = size;
+        }
+    }
+    if (_clog_bg_closing_count < _clog_bg_closing_size) {
+        _clog_bg_closing[_clog_bg_closing_count++] = fd;
+        pthread_cond_signal(&_clog_bg_wakeup);
+        pthread_mutex_unlock(&_clog_bg_lock);
+        if (_clog_bg_schedule(0)) {
+            _clog_bg_close();
+        }
+        return;
+    }
+    pthread_mutex_unlock(&_clog_bg_lock);
+#endif
+    fsync(fd);
+    close(fd);
+}
+
+/*
+ * clog's LZ format, for compressing rotated files without zlib: "CLZ1",
+ * then blocks of at most CLOG_LZ_BLOCK bytes.  Each block has its size and
+ * its stored size (32-bit little-endian; equal if stored as is), then, if
+ * compressed, sequences as in LZ4: a token of the number of literals and the
+ * match length minus 4 (a nibble each, 15 meaning more bytes of up to 255
+ * follow), the literals, and the match's 16-bit little-endian distance back
+ * and further length bytes, except after the block's last literals.
+ */
+#define CLOG_LZ_MAGIC "CLZ1"
+#define CLOG_LZ_BLOCK 65536
+#define CLOG_LZ_BOUND (CLOG_LZ_BLOCK + CLOG_LZ_BLOCK / 255 + 16)
+#define CLOG_LZ_HASH_BITS 12
+
+void
+_clog_lz_length(unsigned char *out, size_t *o, size_t len)
+{
+    while (len >= 255) {
+        out[(*o)++] = 255;
+        len -= 255;
+    }
+    out[(*o)++] = (unsigned char) len;
+}
+
+/* Append count literals, then a match of len bytes distance back unless len
+ * is zero. */
+void
+_clog_lz_sequence(unsigned char *out, size_t *o, const unsigned char *literals,
+                  size_t count, size_t distance, size_t len)
+{
+    size_t match = len > 0 ? len - 4 : 0;
+
+    out[(*o)++] = (unsigned char) ((count < 15 ? count : 15) << 4
+                                   | (match < 15 ? match : 15));
+    if (count >= 15) {
+        _clog_lz_length(out, o, count - 15);
+    }
+    memcpy(out + *o, literals, count);
+    *o += count;
+    if (len > 0) {
+        out[(*o)++] = (unsigned char) (distance & 0xff);
+        out[(*o)++] = (unsigned char) (distance >> 8);
+        if (match >= 15) {
+            _clog_lz_length(out, o, match - 15);
+        }
+    }
+}
+
+/* Compress n bytes, at most CLOG_LZ_BLOCK, into out, which has room for
+ * CLOG_LZ_BOUND.  Returns the compressed size. */
+size_t
+_clog_lz_compress(const unsigned char *in, size_t n, unsigned char *out)
+{
+    unsigned int table[1 << CLOG_LZ_HASH_BITS];
+    unsigned int seq, other;
+    size_t i = 0, anchor = 0, o = 0;
+
+    /* Positions plus one of the last 4 bytes seen with each hash. */
+    memset(table, 0, sizeof(table));
+    while (i + 8 <= n) {
+        size_t candidate, len;
+        unsigned int hash;
+
+        memcpy(&seq, in + i, 4);
+        hash = ((seq * 2654435761U) & 0xffffffffU) >> (32 - CLOG_LZ_HASH_BITS);
+        candidate = table[hash];
+        table[hash] = (unsigned int) i + 1;
+        if (candidate == 0 || i - (candidate - 1) > 0xffff) {
+            i++;
+            continue;
+        }
+        candidate--;
+        memcpy(&other, in + candidate, 4);
+        if (other != seq) {
+            i++;
+            continue;
+        }
+        len = 4;
+        while (i + len < n && in[candidate + len] == in[i + len]) {
+            len++;
+        }
+        _clog_lz_sequence(out, &o, in + anchor, i - anchor, i - candidate,
+                          len);
+        i += len;
+        anchor = i;
+    }
+    _clog_lz_sequence(out, &o, in + anchor, n - anchor, 0, 0);
+    return o;
+}
+
+/* Uncompress size bytes of a block that holds n bytes.  Returns non-zero if
+ * it is corrupt. */
+int
+_clog_lz_uncompress(const unsigned char *in, size_t size,
+                    unsigned char *out, size_t n)
+{
+    size_t i = 0, o = 0;
+
+    while (i < size) {
+        size_t count = in[i] >> 4, len = in[i] & 15, distance;
+        i++;
+        if (count == 15) {
+            do {
+                if (i >= size) {
+                    return 1;
+                }
+                count += in[i];
+            } while (in[i++] == 255);
+        }
+        if (count > size - i || count > n - o) {
+            return 1;
+        }
+        memcpy(out + o, in + i, count);
+        i += count;
+        o += count;
+        if (o == n) {
+            break;
+        }
+
+        if (size - i < 2) {
+            return 1;
+        }
+        distance = in[i] | (size_t) in[i + 1] << 8;
+        i += 2;
+        if (len == 15) {
+            do {
+                if (i >= size) {
+                    return 1;
+                }
+                len += in[i];
+            } while (in[i++] == 255);
+        }
+        len += 4;
+        if (distance == 0 || distance > o || len > n - o) {
+            return 1;
+        }
+        /* Byte by byte: the match may overlap what it produces. */
+        for (; len > 0; len--, o++) {
+            out[o] = out[o - distance];
+        }
+    }
+    return i != size || o != n;
+}
+
+void
+_clog_put_le32(unsigned char *p, size_t value)
+{
+    p[0] = (unsigned char) (value & 0xff);
+    p[1] = (unsigned char) (value >> 8 & 0xff);
+    p[2] = (unsigned char) (value >> 16 & 0xff);
+    p[3] = (unsigned char) (value >> 24 & 0xff);
+}
+
+size_t
+_clog_get_le32(const unsigned char *p)
+{
+    return p[0] | (size_t) p[1] << 8 | (size_t) p[2] << 16
+           | (size_t) p[3] << 24;
+}
+
+/* Read up to sz bytes, stopping early only at the end of the file.  Returns
+ * the number read, or -1. */
+ssize_t
+_clog_read_all(int fd, void *data, size_t sz)
+{
+    size_t got = 0;
+    ssize_t result;
+
+    while (got < sz) {
+        result = read(fd, (char *) data + got, sz - got);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result == -1) {
+            return -1;
+        }
+        if (result == 0) {
+            break;
+        }
+        got += result;
+    }
+    return (ssize_t) got;
+}
+
+/* Write n bytes of data as a block, compressed in out (of CLOG_LZ_BOUND
+ * bytes) if that makes it smaller. */
+int
+_clog_lz_write_block(int fd, const unsigned char *data, size_t n,
+                     unsigned char *out)
+{
+    size_t size = _clog_lz_compress(data, n, out + 8);
+    if (size >= n) {
+        size = n;
+        memcpy(out + 8, data, n);
+    }
+    _clog_put_le32(out, n);
+    _clog_put_le32(out + 4, size);
+    return _clog_write_all(fd, (const char *) out, size + 8) == -1;
+}
+
+int
+clog_uncompress(int in_fd, int out_fd)
+{
+    unsigned char header[8];
+    unsigned char *in, *out;
+    size_t n, size;
+    ssize_t got;
+    int result = 1;
+
+    in = (unsigned char *) _clog_malloc(CLOG_LZ_BLOCK);
+    out = (unsigned char *) _clog_malloc(CLOG_LZ_BLOCK);
+    if (in == NULL || out == NULL) {
+        _clog_err("clog_uncompress: Out of memory.\n");
+        goto done;
+    }
+    if (_clog_read_all(in_fd, header, 4) != 4
+        || memcmp(header, CLOG_LZ_MAGIC, 4) != 0) {
+        _clog_err("clog_uncompress: Not a clog LZ file.\n");
+        goto done;
+    }
+    for (;;) {
+        got = _clog_read_all(in_fd, header, 8);
+        if (got == 0) {
+            result = 0;
+            break;
+        }
+        if (got != 8) {
+            _clog_err("clog_uncompress: Truncated block.\n");
+            break;
+        }
+        n = _clog_get_le32(header);
+        size = _clog_get_le32(header + 4);
+        if (n > CLOG_LZ_BLOCK || size > n
+            || _clog_read_all(in_fd, in, size) != (ssize_t) size) {
+            _clog_err("clog_uncompress: Corrupt or truncated block.\n");
+            break;
+        }
+        if (size == n) {
+            memcpy(out, in, n);
+        } else if (_clog_lz_uncompress(in, size, out, n)) {
+            _clog_err("clog_uncompress: Corrupt block.\n");
+            break;
+        }
+        if (_clog_write_all(out_fd, (const char *) out, n) == -1) {
+            _clog_err("clog_uncompress: %s\n", strerror(errno));
+            break;
+        }
+    }
+
+done:
+    _clog_free(in);
+    _clog_free(out);
+    return result;
+}
+
+/* Compress path to path CLOG_COMPRESS_SUFFIX, through a temporary file, and
+ * remove it.  Calls throttle, if given, after each block. */
+int
+_clog_compress_file(const char *path, void (*throttle)(void))
+{
+    char out_path[4096], tmp_path[4096 + 8];
+    unsigned char *in, *out;
+    int in_fd, out_fd;
+    int result = 0;
+    ssize_t n;
+#ifdef CLOG_ZLIB
+    gzFile gz = NULL;
+#endif
+
+    snprintf(out_path, sizeof(out_path), "%s" CLOG_COMPRESS_SUFFIX, path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+    in_fd = open(path, O_RDONLY);
+    if (in_fd == -1) {
+        _clog_err("Unable to compress %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    out_fd = open(tmp_path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (out_fd == -1) {
+        _clog_err("Unable to create %s: %s\n", tmp_path, strerror(errno));
+        close(in_fd);
+        return 1;
+    }
+    in = (unsigned char *) _clog_malloc(CLOG_LZ_BLOCK);
+    out = (unsigned char *) _clog_malloc(CLOG_LZ_BOUND + 8);
+#ifdef CLOG_ZLIB
+    gz = gzdopen(out_fd, "wb6");
+    if (gz == NULL) {
+        close(out_fd);
+    }
+    if (in == NULL || out == NULL || gz == NULL) {
+        result = 1;
+    }
+#else
+    if (in == NULL || out == NULL
+        || _clog_write_all(out_fd, CLOG_LZ_MAGIC, 4) == -1) {
+        result = 1;
+    }
+#endif
+
+    while (result == 0 && (n = _clog_read_all(in_fd, in, CLOG_LZ_BLOCK)) != 0) {
+#ifdef CLOG_ZLIB
+        result = n == -1 || gzwrite(gz, in, (unsigned int) n) != (int) n;
+#else
+        result = n == -1 || _clog_lz_write_block(out_fd, in, (size_t) n, out);
+#endif
+        if (throttle) {
+            throttle();
+        }
+    }
+
+#ifdef CLOG_ZLIB
+    if (gz != NULL && gzclose(gz) != Z_OK) {
+        result = 1;
+    }
+#else
+    if (close(out_fd) == -1) {
+        result = 1;
+    }
+#endif
+    close(in_fd);
+    _clog_free(in);
+    _clog_free(out);
+    if (result || rename(tmp_path, out_path) == -1) {
+        _clog_err("Unable to compress %s.\n", path);
+        unlink(tmp_path);
+        return 1;
+    }
+    unlink(path);
+    return 0;
+}
+
+#ifdef CLOG_THREADS
+/* Rotated files waiting to be compressed, oldest first, and the one being
+ * compressed.  The lock also keeps the compressing thread from moving a
+ * finished file into place while a rotation renumbers the others. */
+pthread_mutex_t _clog_compress_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _clog_compress_wakeup = PTHREAD_COND_INITIALIZER;
+struct clog_compress_job *_clog_compress_queue = NULL;
+struct clog_compress_job *_clog_compressing = NULL;
+int _clog_compress_started = 0;
+
+/* Numbers the names rotated files have while waiting. */
+unsigned long _clog_compress_serial = 0;
+
+/* Sleep long enough for the compressing thread to stay within its share of
+ * a CPU. */
+void
+_clog_compress_throttle(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    static struct timespec last;
+    struct timespec now, pause;
+    double used;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    used = (double) (now.tv_sec - last.tv_sec)
+           + (now.tv_nsec - last.tv_nsec) / 1e9;
+    last = now;
+    if (used <= 0 || used > 1) {
+        return;
+    }
+    used = used * (100 - CLOG_COMPRESS_CPU) / CLOG_COMPRESS_CPU;
+    pause.tv_sec = (time_t) used;
+    pause.tv_nsec = (long) ((used - (double) pause.tv_sec) * 1e9);
+    nanosleep(&pause, NULL);
+#endif
+}
+
+/* Move a job's file, compressed or not, to the rotated file it now is, or
+ * remove it if that has been rotated out.  Called with the compress lock
+ * held. */
+void
+_clog_compress_place(const struct clog_compress_job *job, int compressed)
+{
+    char from[4096 + 8], to[4096 + 32];
+    const char *suffix = compressed ? CLOG_COMPRESS_SUFFIX : "";
+
+    snprintf(from, sizeof(from), "%s%s", job->path, suffix);
+    if (job->slot > job->keep) {
+        unlink(from);
+        return;
+    }
+    if (job->slot == 0) {
+        snprintf(to, sizeof(to), "%s.old%s", job->base, suffix);
+    } else {
+        snprintf(to, sizeof(to), "%s.%u%s", job->base, job->slot, suffix);
+    }
+    rename(from, to);
+}
+
+void *
+_clog_compress_main(void *arg)
+{
+    struct clog_compress_job *job;
+    int failed;
+#ifdef SCHED_IDLE
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+    (void) arg;
+
+    pthread_mutex_lock(&_clog_compress_lock);
+    for (;;) {
+        while (_clog_compress_queue == NULL) {
+            pthread_cond_wait(&_clog_compress_wakeup, &_clog_compress_lock);
+        }
+        job = _clog_compress_queue;
+        _clog_compress_queue = job->next;
+        _clog_compressing = job;
+        pthread_mutex_unlock(&_clog_compress_lock);
+
+        _clog_compress_throttle();
+        failed = _clog_compress_file(job->path, _clog_compress_throttle);
+
+        pthread_mutex_lock(&_clog_compress_lock);
+        _clog_compress_place(job, !failed);
+        _clog_compressing = NULL;
+        _clog_free(job);
+    }
+    return NULL;
+}
+
+/* Give the file rotated out of path a name of its own, so that it need not
+ * be renamed while it is compressed. */
+void
+_clog_compress_name(const char *path, char *old_path, size_t size)
+{
+    unsigned long serial;
+    pthread_mutex_lock(&_clog_compress_lock);
+    serial = ++_clog_compress_serial;
+    pthread_mutex_unlock(&_clog_compress_lock);
+    snprintf(old_path, size, "%s.rotated.%ld.%lu", path, (long) getpid(),
+             serial);
+}
+
+/* Queue old_path, named by _clog_compress_name(), for the compressing
+ * thread, starting it if need be, or compress it here if it cannot be
+ * started. */
+void
+_clog_compress_later(const char *path, const char *old_path,
+                     unsigned int keep)
+{
+    size_t len = strlen(old_path), base_len = strlen(path);
+    struct clog_compress_job *job, **last;
+
+    job = (struct clog_compress_job *)
+        _clog_malloc(sizeof(struct clog_compress_job) + len + base_len + 2);
+    if (job == NULL) {
+        _clog_err("Out of memory compressing %s.\n", old_path);
+        return;
+    }
+    job->path = (char *) (job + 1);
+    memcpy(job->path, old_path, len + 1);
+    job->base = job->path + len + 1;
+    memcpy(job->base, path, base_len + 1);
+    job->slot = keep > 0;
+    job->keep = keep;
+    job->next = NULL;
+
+    pthread_mutex_lock(&_clog_compress_lock);
+    if (!_clog_compress_started) {
+        pthread_t thread;
+        _clog_watch_fork();
+        if (pthread_create(&thread, NULL, _clog_compress_main, NULL) != 0) {
+            _clog_compress_place(job, !_clog_compress_file(old_path, NULL));
+            pthread_mutex_unlock(&_clog_compress_lock);
+            _clog_free(job);
+            return;
+        }
+        pthread_detach(thread);
+        _clog_compress_started = 1;
+    }
+    for (last = &_clog_compress_queue; *last; last = &(*last)->next) {
+    }
+    *last = job;
+    pthread_cond_signal(&_clog_compress_wakeup);
+    pthread_mutex_unlock(&_clog_compress_lock);
+}
+
+/* Called around renumbering the files rotated out of path: the files still
+ * waiting for compression move up one with them. */
+void
+_clog_compress_shift(const char *path)
+{
+    struct clog_compress_job *job;
+
+    pthread_mutex_lock(&_clog_compress_lock);
+    if (_clog_compressing && _clog_compressing->slot > 0
+        && strcmp(_clog_compressing->base, path) == 0) {
+        _clog_compressing->slot++;
+    }
+    for (job = _clog_compress_queue; job; job = job->next) {
+        if (job->slot > 0 && strcmp(job->base, path) == 0) {
+            job->slot++;
+        }
+    }
+}
+
+void
+_clog_compress_shift_done(void)
+{
+    pthread_mutex_unlock(&_clog_compress_lock);
+}
+
+#else /* CLOG_THREADS */
+
+void
+_clog_compress_name(const char *path, char *old_path, size_t size)
+{
+    (void) path;
+    (void) old_path;
+    (void) size;
+}
+
+void
+_clog_compress_later(const char *path, const char *old_path,
+                     unsigned int keep)
+{
+    (void) path;
+    (void) keep;
+    _clog_compress_file(old_path, NULL);
+}
+
+void
+_clog_compress_shift(const char *path)
+{
+    (void) path;
+}
+
+void
+_clog_compress_shift_done(void)
+{
+}
+
+#endif /* CLOG_THREADS */
+
+#ifdef CLOG_THREADS
+/* Set in the child of a fork(), which has none of clog's threads, for the
+ * next log call to start them again: CLOG_FORKED, plus CLOG_FORKED_BG if
+ * the background thread was running. */
+#define CLOG_FORKED 1
+#define CLOG_FORKED_BG 2
+unsigned long _clog_forked = 0;
+pthread_once_t _clog_fork_once = PTHREAD_ONCE_INIT;
+
+/* Hold clog's locks across fork(), so that the child gets them free and
+ * what they protect in one piece.  Config lock first, as everywhere. */
+void
+_clog_fork_prepare(void)
+{
+    int id;
+    pthread_mutex_lock(&_clog_config_lock);
+    for (id = 0; id < _clog_id_limit(); id++) {
+        struct clog *logger = _clog_get(id);
+        if (logger != NULL && logger->async != NULL) {
+            pthread_mutex_lock(&logger->async->lock);
+        }
+        if (logger != NULL && logger->mapped != NULL) {
+            pthread_mutex_lock(&logger->mapped->lock);
+        }
+    }
+    pthread_mutex_lock(&_clog_bg_lock);
+    pthread_mutex_lock(&_clog_compress_lock);
+}
+
+void
+_clog_fork_parent(void)
+{
+    int id;
+    pthread_mutex_unlock(&_clog_compress_lock);
+    pthread_mutex_unlock(&_clog_bg_lock);
+    for (id = 0; id < _clog_id_limit(); id++) {
+        struct clog *logger = _clog_get(id);
+        if (logger != NULL && logger->mapped != NULL) {
+            pthread_mutex_unlock(&logger->mapped->lock);
+        }
+        if (logger != NULL && logger->async != NULL) {
+            pthread_mutex_unlock(&logger->async->lock);
+        }
+    }
+    pthread_mutex_unlock(&_clog_config_lock);
+}
+
+/* Forget the threads that did not come along: the log calls they were in,
+ * the lines they were copying, and the background and compressing threads,
+ * whose work on the parent's files is the parent's. */
+void
+_clog_fork_child(void)
+{
+    struct clog_rcu *rcu;
+    int id, i;
+
+    for (id = 0; id < _clog_id_limit(); id++) {
+        struct clog *logger = _clog_get(id);
+        struct clog_buffer *buffer;
+        rcu = _clog_rcu_of(id);
+        memset(rcu->stripes, 0, sizeof(rcu->stripes));
+        buffer = logger != NULL ? logger->buffer : NULL;
+        for (; buffer != NULL; buffer = buffer->previous) {
+            buffer->state &= CLOG_BUFFER_SWAP;
+            buffer->writers[0] = buffer->writers[1] = 0;
+            buffer->flushing = 0;
+        }
+        if (logger != NULL && logger->async != NULL) {
+            struct clog_async *async = logger->async;
+            memset(async->ring, 0, async->size);
+            async->tail = async->head;
+            async->running = 0;
+            async->sleeping = 0;
+            pthread_cond_init(&async->wakeup, NULL);
+        }
+#ifdef CLOG_MMAP
+        if (logger != NULL && logger->mapped != NULL) {
+            struct clog_segment *segment = logger->mapped->segment;
+            for (; segment != NULL; segment = segment->retired) {
+                segment->committed = segment->reserved & ~CLOG_SEGMENT_CLOSED;
+            }
+        }
+#endif
+    }
+    for (i = 0; i < _clog_num_chunks; i++) {
+        memset(_clog_chunks[i]->rcu.stripes, 0,
+               sizeof(_clog_chunks[i]->rcu.stripes));
+    }
+
+    _clog_forked = CLOG_FORKED | (_clog_bg_started ? CLOG_FORKED_BG : 0);
+    _clog_bg_started = 0;
+    _clog_bg_mmap = 1;
+    _clog_bg_shifting = NULL;
+    pthread_cond_init(&_clog_bg_wakeup, NULL);
+    _clog_compress_started = 0;
+    _clog_compress_queue = NULL;
+    _clog_compressing = NULL;
+    pthread_cond_init(&_clog_compress_wakeup, NULL);
+    _clog_fork_parent();
+}
+
+void
+_clog_watch_fork_once(void)
+{
+    pthread_atfork(_clog_fork_prepare, _clog_fork_parent, _clog_fork_child);
+}
+
+/* Called before starting a thread. */
+void
+_clog_watch_fork(void)
+{
+    pthread_once(&_clog_fork_once, _clog_watch_fork_once);
+}
+
+/* Called by log calls in the child of a fork(): start the threads again. */
+void
+_clog_after_fork(void)
+{
+    unsigned long forked = _clog_swap(&_clog_forked, 0);
+    int id;
+
+    if (forked & CLOG_FORKED_BG) {
+        _clog_bg_schedule(0);
+    }
+    for (id = 0; forked && id < _clog_id_limit(); id++) {
+        unsigned int token = _clog_read_lock(id);
+        struct clog *logger = _clog_get(id);
+        struct clog_async *async = logger ? logger->async : NULL;
+        if (async != NULL && !async->running) {
+            if (pthread_create(&async->thread, NULL, _clog_async_main,
+                               logger) == 0) {
+                async->running = 1;
+            } else {
+                _clog_err("Unable to restart log writer thread.\n");
+            }
+        }
+        _clog_read_unlock(id, token);
+    }
+}
+#endif /* CLOG_THREADS */
+
+int
+clog_set_compress(int id, int compress)
+{
+    struct clog *logger;
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger) {
+        logger->compress = compress != 0;
+    }
+    _clog_unlock_config();
+    return logger == NULL;
+}
+
+void
+_clog_atexit(void)
+{
+    int id;
+    for (id = 0; id < _clog_id_limit(); id++) {
+        unsigned int token = _clog_read_lock(id);
+        struct clog *logger = _clog_get(id);
+        if (logger) {
+            _clog_flush(logger);
+        }
+        _clog_read_unlock(id, token);
+    }
+}
+
+/* Make sure pending lines are written when the program exits. */
+void
+_clog_register_atexit(void)
+{
+    static int registered = 0;
+    if (!registered) {
+        atexit(_clog_atexit);
+        registered = 1;
+    }
+}
+
+int
+_clog_set_buffer(int id, size_t size, unsigned int flush_ms)
+{
+    struct clog *logger = _clog_get(id);
+    struct clog_buffer *buffer = NULL, *old;
+
+    if (logger == NULL) {
+        _clog_err("clog_set_buffer: No such logger: %d\n", id);
+        return 1;
+    }
+    if (logger->async) {
+        _clog_err("clog_set_buffer: Logger %d is asynchronous.\n", id);
+        return 1;
+    }
+    if (logger->mapped) {
+        _clog_err("clog_set_buffer: Logger %d is memory-mapped.\n", id);
+        return 1;
+    }
+
+    old = logger->buffer;
+    if (size == 0 && old == NULL) {
+        return 0;
+    }
+
+    /* With size zero, a buffer that holds nothing: every line flushes it,
+     * and so whatever is left in the old one, before being written. */
+    buffer =
+        (struct clog_buffer *) _clog_calloc(1, sizeof(struct clog_buffer));
+    if (buffer == NULL
+        || (size > 0
+            && ((buffer->data[0] = (char *) _clog_malloc(size)) == NULL
+                || (buffer->data[1] = (char *) _clog_malloc(size)) == NULL))) {
+        _clog_err("Failed to allocate log buffer: %s\n", strerror(errno));
+        if (buffer) {
+            _clog_free_buffer(buffer);
+        }
         return 1;
     }
-    _clog_loggers[id]->opened = 1;
-    _clog_loggers[id]->isatty = isatty(fd);
+    buffer->size = size;
+    buffer->flush_ms = flush_ms;
+    buffer->last_flush = _clog_millis();
+    if (size > 0) {
+#ifdef CLOG_THREADS
+        if (flush_ms > 0 && _clog_bg_schedule(flush_ms)) {
+            _clog_free_buffer(buffer);
+            return 1;
+        }
+#endif
+        _clog_register_atexit();
+    }
+
+    /* Log calls move to the new buffer at once.  Once none of them can
+     * reach the old one, write it out for the last time and free it. */
+    buffer->previous = old;
+    _clog_store(&logger->buffer, buffer);
+    _clog_synchronize(id);
+    if (old) {
+        int expected = 0;
+        while (!_clog_cas(&buffer->flushing, &expected, 1)) {
+            expected = 0;
+            _clog_yield();
+        }
+        _clog_buffer_flush(logger, old);
+        buffer->previous = NULL;
+        _clog_store(&buffer->flushing, 0);
+        _clog_free_buffer(old);
+    }
+
+    if (size == 0) {
+        _clog_store(&logger->buffer, NULL);
+        _clog_synchronize(id);
+        _clog_free_buffer(buffer);
+    }
     return 0;
 }
 
 int
-clog_rotate(int id, const char *const path)
+clog_set_buffer(int id, size_t size, unsigned int flush_ms)
 {
-    struct clog *logger = _clog_loggers[id];
-    int fd;
-    char old_path[4096] = { 0 };
+    int result;
+    _clog_lock_config();
+    result = _clog_set_buffer(id, size, flush_ms);
+    _clog_unlock_config();
+    return result;
+}
+
+int
+clog_set_flush_level(int id, enum clog_level level)
+{
+    struct clog *logger;
+    if ((unsigned) level > CLOG_ERROR) {
+        return 1;
+    }
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger) {
+        _clog_store(&logger->flush_level, level);
+    }
+    _clog_unlock_config();
+    return logger == NULL;
+}
+
+int
+_clog_set_rotation(int id, size_t max_bytes, unsigned int interval_sec,
+                   unsigned int keep)
+{
+    struct clog *logger = _clog_get(id);
+    struct stat st;
+
     if (logger == NULL) {
-        _clog_err("Logger %d not initialized.\n", id);
+        _clog_err("clog_set_rotation: No such logger: %d\n", id);
+        return 1;
+    }
+    if (logger->path == NULL) {
+        _clog_err("clog_set_rotation: Logger %d has no path.\n", id);
+        return 1;
+    }
+#ifdef CLOG_THREADS
+    /* Count from the size of the file so far; a mapped file's size
+     * includes the unused end of its segment. */
+    if (logger->mapped == NULL && fstat(logger->fd, &st) == 0) {
+        _clog_store(&logger->written, (size_t) st.st_size);
+    }
+    logger->rotate_keep = keep;
+    logger->rotate_interval = interval_sec;
+    logger->rotate_due = 0;
+    if (interval_sec > 0) {
+        logger->rotate_due = (time(NULL) / interval_sec + 1) * interval_sec;
+    }
+    _clog_store(&logger->rotate_bytes, max_bytes);
+
+    if (_clog_bg_schedule(interval_sec > 0 ? 1000 : 0)) {
+        return 1;
+    }
+    if (max_bytes > 0 && _clog_load(&logger->written) >= max_bytes) {
+        _clog_request_rotation(logger);
+    }
+    return 0;
+#else
+    (void) st;
+    (void) max_bytes;
+    (void) interval_sec;
+    (void) keep;
+    _clog_err("Rotation policies need threads.\n");
+    return 1;
+#endif
+}
+
+int
+clog_set_rotation(int id, size_t max_bytes, unsigned int interval_sec,
+                  unsigned int keep)
+{
+    int result;
+    _clog_lock_config();
+    result = _clog_set_rotation(id, max_bytes, interval_sec, keep);
+    _clog_unlock_config();
+    return result;
+}
+
+int
+clog_set_rate_limit(int id, unsigned int lines_per_sec, unsigned int burst)
+{
+    struct clog *logger;
+    unsigned long interval = 0;
+    if (lines_per_sec > 1000000 || burst == 0) {
+        return 1;
+    }
+    if (lines_per_sec > 0) {
+        interval = 1000000UL / lines_per_sec;
+    }
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger) {
+        _clog_store(&logger->rate_burst, interval * (burst - 1));
+        _clog_store(&logger->rate_interval, interval);
+    }
+    _clog_unlock_config();
+    return logger == NULL;
+}
+
+int
+clog_set_dedup(int id, int dedup)
+{
+    struct clog *logger;
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger) {
+        _clog_store(&logger->dedup, dedup != 0);
+#ifdef CLOG_THREADS
+        /* Repeats still going on are reported about once a second. */
+        if (dedup) {
+            _clog_bg_schedule(1000);
+        }
+#endif
+    }
+    _clog_unlock_config();
+    return logger == NULL;
+}
+
+void
+_clog_free_sink(struct clog_sink *sink)
+{
+    if (sink->opened) {
+        close(sink->fd);
+    }
+    _clog_free(sink->format);
+    _clog_free(sink);
+}
+
+/* Publish a logger's new list of sinks, and free the old one once no log
+ * call uses it.  Only with the config lock held. */
+void
+_clog_replace_sinks(struct clog *logger, struct clog_sinks *sinks)
+{
+    struct clog_sinks *old = logger->sinks;
+    _clog_store(&logger->sinks, sinks);
+    _clog_synchronize(logger->id);
+    _clog_free(old);
+}
+
+int
+_clog_add_sink(int id, int fd, int opened, enum clog_level level,
+               const char *fmt)
+{
+    struct clog *logger;
+    struct clog_sink *sink;
+    struct clog_sinks *sinks;
+
+    if ((unsigned) level > CLOG_ERROR) {
+        return -1;
+    }
+    if (fmt && strlen(fmt) >= CLOG_FORMAT_LENGTH) {
+        _clog_err("clog_add_sink: Format specifier too long.\n");
+        return -1;
+    }
+    logger = _clog_get(id);
+    if (logger == NULL) {
+        _clog_err("clog_add_sink: No such logger: %d\n", id);
+        return -1;
+    }
+    if (logger->sinks && logger->sinks->count == CLOG_MAX_SINKS) {
+        _clog_err("clog_add_sink: Logger %d has too many sinks.\n", id);
+        return -1;
+    }
+
+    sink = (struct clog_sink *) _clog_malloc(sizeof(struct clog_sink));
+    sinks = (struct clog_sinks *) _clog_malloc(sizeof(struct clog_sinks));
+    if (sink == NULL || sinks == NULL) {
+        _clog_err("Failed to allocate sink: %s\n", strerror(errno));
+        _clog_free(sink);
+        _clog_free(sinks);
+        return -1;
+    }
+    sink->fd = fd;
+    sink->opened = opened;
+    sink->level = level;
+    sink->format = NULL;
+    if (fmt) {
+        sink->format = _clog_compile_format(fmt, logger->date_fmt,
+                                            logger->time_fmt);
+        if (sink->format == NULL) {
+            _clog_free(sink);
+            _clog_free(sinks);
+            return -1;
+        }
+    }
+    sink->id = logger->next_sink++;
+
+    sinks->count = 0;
+    if (logger->sinks) {
+        *sinks = *logger->sinks;
+    }
+    sinks->sinks[sinks->count++] = sink;
+    _clog_replace_sinks(logger, sinks);
+    return sink->id;
+}
+
+int
+clog_add_sink_fd(int id, int fd, enum clog_level level, const char *fmt)
+{
+    int result;
+    _clog_lock_config();
+    result = _clog_add_sink(id, fd, 0, level, fmt);
+    _clog_unlock_config();
+    return result;
+}
+
+int
+clog_add_sink_path(int id, const char *path, enum clog_level level,
+                   const char *fmt)
+{
+    int result;
+    int fd = _clog_open(path);
+    if (fd == -1) {
+        return -1;
+    }
+    _clog_lock_config();
+    result = _clog_add_sink(id, fd, 1, level, fmt);
+    _clog_unlock_config();
+    if (result == -1) {
+        close(fd);
+    }
+    return result;
+}
+
+int
+clog_remove_sink(int id, int sink)
+{
+    struct clog *logger;
+    struct clog_sinks *sinks;
+    struct clog_sink *removed = NULL;
+    int i;
+
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger == NULL || logger->sinks == NULL) {
+        _clog_unlock_config();
+        return 1;
+    }
+    sinks = (struct clog_sinks *) _clog_malloc(sizeof(struct clog_sinks));
+    if (sinks == NULL) {
+        _clog_unlock_config();
+        return 1;
+    }
+    sinks->count = 0;
+    for (i = 0; i < logger->sinks->count; i++) {
+        if (logger->sinks->sinks[i]->id == sink) {
+            removed = logger->sinks->sinks[i];
+        } else {
+            sinks->sinks[sinks->count++] = logger->sinks->sinks[i];
+        }
+    }
+    if (removed == NULL) {
+        _clog_free(sinks);
+        _clog_unlock_config();
+        return 1;
+    }
+    _clog_replace_sinks(logger, sinks);
+    _clog_free_sink(removed);
+    _clog_unlock_config();
+    return 0;
+}
+
+int
+clog_stats(int id, struct clog_stats *stats)
+{
+    unsigned long counts[CLOG_COUNTERS] = { 0 };
+    unsigned int token;
+    struct clog *logger;
+    int i, j;
+
+    memset(stats, 0, sizeof(*stats));
+    if (_clog_slot(id) == NULL) {
+        return 1;
+    }
+    token = _clog_read_lock(id);
+    logger = _clog_get(id);
+    if (logger != NULL) {
+        for (i = 0; i < CLOG_RCU_STRIPES; i++) {
+            for (j = 0; j < CLOG_COUNTERS; j++) {
+                counts[j] +=
+                    _clog_load_relaxed(&logger->counters[i].counts[j]);
+            }
+        }
+        stats->lines = counts[CLOG_COUNT_LINES];
+        stats->bytes = counts[CLOG_COUNT_BYTES];
+        for (i = 0; i < CLOG_RCU_STRIPES; i++) {
+            stats->filtered +=
+                _clog_load_relaxed(_clog_filtered_slot(id, i));
+        }
+        stats->suppressed = _clog_load_relaxed(&logger->suppressed);
+#ifdef CLOG_THREADS
+        if (logger->async != NULL) {
+            stats->dropped = _clog_load_relaxed(&logger->async->dropped);
+        }
+#endif
+        stats->heap_lines = counts[CLOG_COUNT_HEAP];
+        stats->write_errors = counts[CLOG_COUNT_ERRORS];
+        stats->write_retries = counts[CLOG_COUNT_RETRIES];
+        stats->write_usec = counts[CLOG_COUNT_WRITE_USEC];
+    }
+    _clog_read_unlock(id, token);
+    return logger == NULL;
+}
+
+int
+clog_set_write_timing(int id, int timing)
+{
+    struct clog *logger;
+    _clog_lock_config();
+    logger = _clog_get(id);
+    if (logger) {
+        _clog_store(&logger->write_timing, timing != 0);
+    }
+    _clog_unlock_config();
+    return logger == NULL;
+}
+
+unsigned long
+clog_suppressed(int id)
+{
+    unsigned int token;
+    struct clog *logger;
+    unsigned long suppressed = 0;
+
+    if (_clog_slot(id) == NULL) {
+        return 0;
+    }
+    token = _clog_read_lock(id);
+    logger = _clog_get(id);
+    if (logger != NULL) {
+        suppressed = _clog_load_relaxed(&logger->suppressed);
+    }
+    _clog_read_unlock(id, token);
+    return suppressed;
+}
+
+/* Whether site may write a line under the rate limit of logger (a generic
+ * cell rate algorithm: each line moves the site's due time on by the
+ * interval, and lines are dropped while it is further ahead of now than
+ * the rest of a burst takes). */
+int
+_clog_rate_allows(struct clog *logger, struct clog_callsite *site)
+{
+    unsigned long interval = _clog_load_relaxed(&logger->rate_interval);
+    unsigned long burst, now, due, base;
+    struct timespec ts;
+
+    if (interval == 0) {
+        return 1;
+    }
+    burst = _clog_load_relaxed(&logger->rate_burst);
+    _clog_monotonic(&ts);
+    now = (unsigned long) ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+    due = _clog_load_relaxed(&site->due);
+    do {
+        /* A due time in the past, or further ahead than any can be after
+         * the clock wrapped around, counts from now. */
+        base = due - now - 1 < burst + interval ? due : now;
+        if (base - now > burst) {
+            _clog_count(&site->limited, 1);
+            _clog_count(&logger->suppressed, 1);
+            return 0;
+        }
+    } while (!_clog_cas(&site->due, &due, base + interval));
+    return 1;
+}
+
+#if defined(ULONG_MAX) && ULONG_MAX > 4294967295UL
+#define CLOG_FNV_OFFSET 14695981039346656037UL
+#define CLOG_FNV_PRIME 1099511628211UL
+#else
+#define CLOG_FNV_OFFSET 2166136261UL
+#define CLOG_FNV_PRIME 16777619UL
+#endif
+
+/* Hold the last message of site, for the few instructions it takes to
+ * compare or replace it. */
+void
+_clog_hold_last(struct clog_callsite *site)
+{
+    while (_clog_swap(&site->last_busy, 1) != 0) {
+#ifdef CLOG_THREADS
+        sched_yield();
+#endif
+    }
+}
+
+void
+_clog_release_last(struct clog_callsite *site)
+{
+    _clog_store_release(&site->last_busy, 0);
+}
+
+/* Put site on the list of sites whose repeats logger reports. */
+void
+_clog_list_repeats(struct clog *logger, struct clog_callsite *site)
+{
+    struct clog_callsite *next = _clog_load(&logger->repeated);
+    do {
+        site->next_repeated = next;
+    } while (!_clog_cas(&logger->repeated, &next, site));
+}
+
+/* Whether the message of fmt and ap differs from the last one site logged,
+ * counting it as a repeat if not. */
+int
+_clog_dedup_allows(struct clog *logger, struct clog_callsite *site,
+                   const char *fmt, va_list ap)
+{
+    char buf[256];
+    struct clog_buf args;
+    unsigned long hash = CLOG_FNV_OFFSET;
+    size_t i, kept;
+    int repeat;
+
+    /* FNV-1a over the arguments as binary records store them; equal
+     * hashes are then confirmed on the bytes the site keeps of them. */
+    _clog_buf_init(&args, buf, sizeof(buf));
+    if (_clog_append_args(&args, fmt, ap) || args.failed) {
+        /* Nothing to compare with next time. */
+        fmt = NULL;
+    }
+    for (i = 0; i < args.len; i++) {
+        hash = (hash ^ (unsigned char) args.data[i]) * CLOG_FNV_PRIME;
+    }
+    kept = args.len < CLOG_DEDUP_BYTES ? args.len : CLOG_DEDUP_BYTES;
+
+    _clog_hold_last(site);
+    repeat = fmt != NULL && site->last_fmt == fmt && site->last_hash == hash
+             && site->last_len == args.len
+             && memcmp(site->last_args, args.data, kept) == 0;
+    if (!repeat) {
+        site->last_fmt = fmt;
+        site->last_hash = hash;
+        site->last_len = args.len;
+        memcpy(site->last_args, args.data, kept);
+    }
+    _clog_release_last(site);
+    _clog_buf_free(&args);
+    if (!repeat) {
         return 1;
     }
-    if (!logger->opened) {
-        _clog_err("Logger %d not opened by clog.\n", id);
-        return 1;
+
+    _clog_count(&site->repeats, 1);
+    _clog_count(&logger->suppressed, 1);
+    if (_clog_load_relaxed(&site->repeat_listed) != CLOG_REPEATS_FRESH
+        && _clog_swap(&site->repeat_listed, CLOG_REPEATS_FRESH)
+           == CLOG_REPEATS_UNLISTED) {
+        _clog_list_repeats(logger, site);
+    }
+    return 0;
+}
+
+/* Forget the last message of site, which was not written after all. */
+void
+_clog_dedup_forget(struct clog_callsite *site)
+{
+    _clog_hold_last(site);
+    site->last_fmt = NULL;
+    _clog_release_last(site);
+}
+
+/* Write the "Last message repeated" lines of the call sites of logger, or
+ * with aged_only, of those not repeated since the last such call (which the
+ * background thread makes about once a second). */
+void
+_clog_report_repeats(struct clog *logger, int aged_only)
+{
+    struct clog_callsite *site = _clog_load(&logger->repeated);
+    struct clog_callsite *next;
+    unsigned long state, repeats;
+
+    while (site != NULL && !_clog_cas(&logger->repeated, &site, NULL)) {
+    }
+    for (; site != NULL; site = next) {
+        next = site->next_repeated;
+        state = CLOG_REPEATS_FRESH;
+        if (aged_only
+            && (_clog_cas(&site->repeat_listed, &state, CLOG_REPEATS_AGED)
+                || state != CLOG_REPEATS_AGED
+                || !_clog_cas(&site->repeat_listed, &state,
+                              CLOG_REPEATS_UNLISTED))) {
+            /* Repeated lately: check again next time. */
+            _clog_list_repeats(logger, site);
+            continue;
+        }
+        _clog_store(&site->repeat_listed, CLOG_REPEATS_UNLISTED);
+        repeats = _clog_swap(&site->repeats, 0);
+        if (repeats > 0) {
+            _clog_site_name(site);
+            _clog_note(logger, site, "Last message repeated %lu times",
+                       repeats);
+        }
     }
+}
 
-    snprintf(old_path, sizeof(old_path), "%s.old", path);
-    rename(path, old_path);
+int
+_clog_flush(struct clog *logger)
+{
+    struct clog_buffer *buffer;
 
-    fd = logger->fd;
-    logger->fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0666);
-    if (logger->fd == -1) {
-        _clog_err("Unable to rotate %s: %s\n", path, strerror(errno));
-        return 1;
+    _clog_report_repeats(logger, 0);
+#ifdef CLOG_THREADS
+    if (logger->async) {
+        struct clog_async *async = logger->async;
+        size_t head = _clog_load(&async->head);
+        for (;;) {
+            /* Done once tail reaches head (or passes it, making this
+             * difference wrap around). */
+            size_t pending = head - _clog_load_acquire(&async->tail);
+            if (pending == 0 || pending > async->size) {
+                break;
+            }
+            pthread_mutex_lock(&async->lock);
+            pthread_cond_signal(&async->wakeup);
+            pthread_mutex_unlock(&async->lock);
+            _clog_yield();
+        }
+        return 0;
+    }
+#endif
+    buffer = _clog_load(&logger->buffer);
+    if (buffer) {
+        return _clog_buffer_flush(logger, buffer);
     }
-
-    fsync(fd);
-    close(fd);
     return 0;
 }
 
 int
-clog_init_fd(int id, int fd)
+clog_flush(int id)
 {
+    unsigned int token;
     struct clog *logger;
+    int result = 1;
 
-    if (_clog_loggers[id] != NULL) {
-        _clog_err("Logger %d already initialized.\n", id);
+    if (_clog_slot(id) == NULL) {
+        _clog_err("clog_flush: No such logger: %d\n", id);
         return 1;
     }
-
-    logger = (struct clog *) malloc(sizeof(struct clog));
+    token = _clog_read_lock(id);
+    logger = _clog_get(id);
     if (logger == NULL) {
-        _clog_err("Failed to allocate logger: %s\n", strerror(errno));
-        return 1;
+        _clog_err("clog_flush: No such logger: %d\n", id);
+    } else {
+        result = _clog_flush(logger);
     }
-
-    logger->level = CLOG_DEBUG;
-    logger->fd = fd;
-    logger->opened = 0;
-    strcpy(logger->fmt, CLOG_DEFAULT_FORMAT);
-    strcpy(logger->date_fmt, CLOG_DEFAULT_DATE_FORMAT);
-    strcpy(logger->time_fmt, CLOG_DEFAULT_TIME_FORMAT);
-
-    _clog_loggers[id] = logger;
-    return 0;
+    _clog_read_unlock(id, token);
+    return result;
 }
 
-void
-clog_free(int id)
+int
+_clog_write(struct clog *logger, enum clog_level level,
+            const char *data, size_t sz)
 {
-    if (_clog_loggers[id]) {
-        if (_clog_loggers[id]->opened) {
-            close(_clog_loggers[id]->fd);
+    struct clog_buffer *buffer;
+    int result;
+#ifdef CLOG_THREADS
+    size_t limit;
+    if (_clog_expect(_clog_load_relaxed(&_clog_forked) != 0, 0)) {
+        _clog_after_fork();
+    }
+    if (logger->async) {
+        result = _clog_async_push(logger, level, data, sz);
+    } else
+#endif
+    if (logger->mapped) {
+        result = _clog_mmap_write(logger, data, sz);
+        if (result == -1) {
+            _clog_add_stat(logger, CLOG_COUNT_ERRORS, 1);
+        }
+    } else {
+        buffer = _clog_load(&logger->buffer);
+        if (buffer) {
+            result = _clog_buffer_write(logger, buffer, level, data, sz);
+        } else {
+            result = _clog_write_fd(logger, data, sz);
+        }
+    }
+    /* Dropped lines come back as zero bytes. */
+    if (result > 0) {
+        _clog_add_stat(logger, CLOG_COUNT_LINES, 1);
+        _clog_add_stat(logger, CLOG_COUNT_BYTES, (unsigned long) result);
+    }
+#ifdef CLOG_THREADS
+    /* Rotation by size only costs log calls a count. */
+    limit = _clog_load_relaxed(&logger->rotate_bytes);
+    if (limit > 0 && result != -1) {
+        _clog_count(&logger->written, sz);
+        if (_clog_load_relaxed(&logger->written) >= limit
+            && !_clog_load_relaxed(&logger->rotate_requested)) {
+            _clog_request_rotation(logger);
         }
-        free(_clog_loggers[id]);
-        _clog_loggers[id] = NULL;
     }
+#endif
+    return result;
 }
 
 int
-clog_set_level(int id, enum clog_level level)
+clog_init_fd_async(int id, int fd, size_t ring_bytes)
 {
-    if (_clog_loggers[id] == NULL) {
+    struct clog *logger = _clog_new(id, fd);
+    if (logger == NULL) {
         return 1;
     }
-    if ((unsigned) level > CLOG_ERROR) {
+    if (_clog_start_async(logger, ring_bytes)) {
+        _clog_destroy(logger);
         return 1;
     }
-    _clog_loggers[id]->level = level;
-    return 0;
+    return _clog_publish(logger);
 }
 
 int
-clog_set_time_fmt(int id, const char *fmt)
+clog_init_path_async(int id, const char *const path, size_t ring_bytes)
 {
-    struct clog *logger = _clog_loggers[id];
+    struct clog *logger = _clog_new_path(id, path);
     if (logger == NULL) {
-        _clog_err("clog_set_time_fmt: No such logger: %d\n", id);
         return 1;
     }
-    if (strlen(fmt) >= CLOG_FORMAT_LENGTH) {
-        _clog_err("clog_set_time_fmt: Format specifier too long.\n");
+    if (_clog_start_async(logger, ring_bytes)) {
+        _clog_destroy(logger);
         return 1;
     }
-    strcpy(logger->time_fmt, fmt);
-    return 0;
+    return _clog_publish(logger);
 }
 
 int
-clog_set_date_fmt(int id, const char *fmt)
+_clog_set_overflow(int id, enum clog_overflow policy)
 {
-    struct clog *logger = _clog_loggers[id];
+    struct clog *logger = _clog_get(id);
     if (logger == NULL) {
-        _clog_err("clog_set_date_fmt: No such logger: %d\n", id);
+        _clog_err("clog_set_overflow: No such logger: %d\n", id);
         return 1;
     }
-    if (strlen(fmt) >= CLOG_FORMAT_LENGTH) {
-        _clog_err("clog_set_date_fmt: Format specifier too long.\n");
+    if (logger->async == NULL) {
+        _clog_err("clog_set_overflow: Logger %d is not asynchronous.\n", id);
+        return 1;
+    }
+    if ((unsigned) policy > CLOG_OVERFLOW_DROP_DEBUG) {
         return 1;
     }
-    strcpy(logger->date_fmt, fmt);
+#ifdef CLOG_THREADS
+    _clog_store(&logger->async->overflow, policy);
+#endif
     return 0;
 }
 
 int
-clog_set_fmt(int id, const char *fmt)
+clog_set_overflow(int id, enum clog_overflow policy)
 {
-    struct clog *logger = _clog_loggers[id];
-    if (logger == NULL) {
-        _clog_err("clog_set_fmt: No such logger: %d\n", id);
-        return 1;
+    int result;
+    _clog_lock_config();
+    result = _clog_set_overflow(id, policy);
+    _clog_unlock_config();
+    return result;
+}
+
+unsigned long
+clog_dropped(int id)
+{
+    unsigned int token;
+    struct clog *logger;
+    unsigned long dropped = 0;
+
+    if (_clog_slot(id) == NULL) {
+        return 0;
     }
-    if (strlen(fmt) >= CLOG_FORMAT_LENGTH) {
-        _clog_err("clog_set_fmt: Format specifier too long.\n");
-        return 1;
+    token = _clog_read_lock(id);
+    logger = _clog_get(id);
+    if (logger != NULL && logger->async != NULL) {
+#ifdef CLOG_THREADS
+        dropped = _clog_load_relaxed(&logger->async->dropped);
+#endif
     }
-    strcpy(logger->fmt, fmt);
-    return 0;
+    _clog_read_unlock(id, token);
+    return dropped;
 }
 
-/* Internal functions */
-
-size_t
-_clog_append_str(char **dst, char *orig_buf, const char *src, size_t cur_size)
+/* Format a line, as JSON for JSON loggers, or encode it for binary
+ * loggers. */
+int
+_clog_render(struct clog *logger, struct clog_buf *b,
+             const char *sfile, int sline, enum clog_level level,
+             const char *fmt, va_list ap)
 {
-    size_t new_size = cur_size;
+    char buf[256];
+    struct clog_buf msg;
+    int result;
 
-    while (strlen(*dst) + strlen(src) >= new_size) {
-        new_size *= 2;
+    if (_clog_load_relaxed(&logger->binary)) {
+        return _clog_encode(logger, b, sfile, sline, level, fmt, ap);
     }
-    if (new_size != cur_size) {
-        if (*dst == orig_buf) {
-            *dst = (char *) malloc(new_size);
-            strcpy(*dst, orig_buf);
-        } else {
-            *dst = (char *) realloc(*dst, new_size);
-        }
+    if (!_clog_load_relaxed(&logger->json)) {
+        return _clog_format(logger, b, sfile, sline, level, NULL, fmt, ap);
     }
+    _clog_buf_init(&msg, buf, sizeof(buf));
+    _clog_append_vprintf(&msg, fmt, ap);
+    result = msg.failed
+             || _clog_format_json(b, sfile, sline, level, msg.data, msg.len,
+                                  NULL, 0);
+    _clog_buf_free(&msg);
+    return result;
+}
+
+/* Write a line about site from clog itself. */
+void
+_clog_note(struct clog *logger, struct clog_callsite *site,
+           const char *fmt, ...)
+{
+    char buf[256];
+    struct clog_buf line;
+    va_list ap;
 
-    strcat(*dst, src);
-    return new_size;
+    _clog_buf_init(&line, buf, sizeof(buf));
+    va_start(ap, fmt);
+    if (!_clog_render(logger, &line, site->name, site->line, site->level,
+                      fmt, ap)) {
+        _clog_write(logger, site->level, line.data, line.len);
+    }
+    va_end(ap);
+    _clog_buf_free(&line);
 }
 
-size_t
-_clog_append_int(char **dst, char *orig_buf, long int d, size_t cur_size)
+/* The base name of the file of site, worked out on first use. */
+const char *
+_clog_site_name(struct clog_callsite *site)
 {
-    char buf[40]; /* Enough for 128-bit decimal */
-    if (snprintf(buf, 40, "%ld", d) >= 40) {
-        return cur_size;
+    const char *name = _clog_load_relaxed(&site->name);
+    if (name == NULL) {
+        /* Threads racing here store the same pointer. */
+        name = _clog_basename(site->file);
+        _clog_store_release(&site->name, name);
     }
-    return _clog_append_str(dst, orig_buf, buf, cur_size);
+    return name;
 }
 
-size_t
-_clog_append_time(char **dst, char *orig_buf, struct tm *lt,
-                  const char *fmt, size_t cur_size)
+/* The message from the callback of clog_lazy(), appended to b. */
+void
+_clog_append_message(struct clog_buf *b, clog_message_fn message, void *ctx)
 {
-    char buf[CLOG_DATETIME_LENGTH];
-    size_t result = strftime(buf, CLOG_DATETIME_LENGTH, fmt, lt);
+    int result;
 
-    if (result > 0) {
-        return _clog_append_str(dst, orig_buf, buf, cur_size);
+    if (b->failed) {
+        return;
     }
-
-    return cur_size;
+    result = message(b->data + b->len, b->size - b->len, ctx);
+    if (result < 0) {
+        b->failed = 1;
+        return;
+    }
+    if ((size_t) result >= b->size - b->len) {
+        /* Too large for the remaining space: grow and call again. */
+        if (_clog_buf_reserve(b, result)) {
+            return;
+        }
+        message(b->data + b->len, b->size - b->len, ctx);
+    }
+    b->len += result;
 }
 
-const char *
-_clog_basename(const char *path)
+/* The message of text with its fields, appended to b, which text is told
+ * the place of. */
+void
+_clog_append_text(struct clog_buf *b, struct clog_text *text)
 {
-    const char *slash = strrchr(path, '/');
-    if (slash) {
-        path = slash + 1;
-    }
-#ifdef _WIN32
-    slash = strrchr(path, '\\');
-    if (slash) {
-        path = slash + 1;
+    text->offset = b->len;
+    if (text->message != NULL) {
+        _clog_append_message(b, text->message, text->ctx);
+    } else {
+        _clog_append_vprintf(b, text->fmt, text->ap);
     }
-#endif
-    return path;
+    _clog_append_fields(b, text->fields, text->count);
+    text->len = b->len - text->offset;
 }
 
-char *
-_clog_format(const struct clog *logger, char buf[], size_t buf_size,
-             const char *sfile, int sline, const char *level,
-             const char *message)
+/* _clog_render() with the message formatted from fmt and the arguments
+ * after it. */
+int
+_clog_render_args(struct clog *logger, struct clog_buf *b,
+                  const char *sfile, int sline, enum clog_level level,
+                  const char *fmt, ...)
 {
-    size_t cur_size = buf_size;
-    char *result = buf;
-    enum { NORMAL, SUBST } state = NORMAL;
-    size_t fmtlen = strlen(logger->fmt);
-    size_t i;
-    time_t t = time(NULL);
-    struct tm *lt = localtime(&t);
+    va_list ap;
+    int result;
+    va_start(ap, fmt);
+    result = _clog_render(logger, b, sfile, sline, level, fmt, ap);
+    va_end(ap);
+    return result;
+}
 
-    sfile = _clog_basename(sfile);
-    result[0] = 0;
-    for (i = 0; i < fmtlen; ++i) {
-        if (state == NORMAL) {
-            if (logger->fmt[i] == '%') {
-                state = SUBST;
-            } else {
-                char str[2] = { 0 };
-                str[0] = logger->fmt[i];
-                cur_size = _clog_append_str(&result, buf, str, cur_size);
-            }
-        } else {
-            switch (logger->fmt[i]) {
-                case '%':
-                    cur_size = _clog_append_str(&result, buf, "%", cur_size);
-                    break;
-                case 't':
-                    cur_size = _clog_append_time(&result, buf, lt,
-                                                 logger->time_fmt, cur_size);
-                    break;
-                case 'd':
-                    cur_size = _clog_append_time(&result, buf, lt,
-                                                 logger->date_fmt, cur_size);
-                    break;
-                case 'l':
-                    cur_size = _clog_append_str(&result, buf, level, cur_size);
-                    break;
-                case 'n':
-                    cur_size = _clog_append_int(&result, buf, sline, cur_size);
-                    break;
-                case 'f':
-                    cur_size = _clog_append_str(&result, buf, sfile, cur_size);
-                    break;
-                case 'm':
-                    cur_size = _clog_append_str(&result, buf, message,
-                                                cur_size);
-                    break;
+/* The sinks of logger, if any of them takes lines of level. */
+const struct clog_sinks *
+_clog_sinks_for(struct clog *logger, enum clog_level level)
+{
+    const struct clog_sinks *sinks = _clog_load(&logger->sinks);
+    int i;
+
+    if (sinks != NULL) {
+        for (i = 0; i < sinks->count; i++) {
+            if (level >= sinks->sinks[i]->level) {
+                return sinks;
             }
-            state = NORMAL;
         }
     }
+    return NULL;
+}
 
+/* _clog_format_line() with the message formatted from fmt and the arguments
+ * after it. */
+int
+_clog_format_line_args(const struct clog_format *format,
+                       const struct timespec *start, struct clog_buf *b,
+                       const char *sfile, int sline, enum clog_level level,
+                       const char *fmt, ...)
+{
+    va_list ap;
+    int result;
+    va_start(ap, fmt);
+    result = _clog_format_line(format, start, b, sfile, sline, level, NULL,
+                               fmt, ap);
+    va_end(ap);
     return result;
 }
 
-int
-clog_log(struct clog *logger, const char *data, size_t sz)
+/* Write a line to the sinks that take its level.  line is the line as
+ * written to the logger's own file, and text (of len bytes) its message. */
+void
+_clog_write_sinks(struct clog *logger, const struct clog_sinks *sinks,
+                  const char *sfile, int sline, enum clog_level level,
+                  const struct clog_buf *line, const char *text, size_t len)
 {
-    int result = 0;
+    char buf[256];
+    struct clog_buf own;
+    const struct clog_sink *sink;
+    int i;
 
-    do {
-        result = write(logger->fd, data, sz);
-        if (logger->isatty)
-        {
-            fsync(logger->fd);
+    _clog_buf_init(&own, buf, sizeof(buf));
+    for (i = 0; i < sinks->count; i++) {
+        sink = sinks->sinks[i];
+        if (level < sink->level) {
+            continue;
         }
-    } while (result==-1 && errno == EAGAIN);
-    return result;
+        if (sink->format == NULL && !_clog_load_relaxed(&logger->binary)) {
+            /* Same format: the same line. */
+            _clog_write_all(sink->fd, line->data, line->len);
+            continue;
+        }
+        own.len = 0;
+        if (!_clog_format_line_args(sink->format ? sink->format
+                                                 : _clog_load(&logger->format),
+                                    &logger->start, &own, sfile, sline, level,
+                                    "%.*s", (int) len, text)) {
+            _clog_write_all(sink->fd, own.data, own.len);
+        }
+        own.failed = 0;
+    }
+    _clog_buf_free(&own);
 }
 
+/* Log a message formatted from fmt and ap, or if message is not NULL, one
+ * it writes given ctx, followed by count fields. */
 void
-_clog_log(const char *sfile, int sline, enum clog_level level,
-          int id, const char *fmt, va_list ap)
+_clog_log(struct clog_callsite *site, int id, clog_message_fn message,
+          void *ctx, const struct clog_field *fields, size_t count,
+          const char *fmt, va_list ap)
 {
-    /* For speed: Use a stack buffer until message exceeds 4096, then switch
+    /* For speed: Use a stack buffer until the line exceeds 4096, then switch
      * to dynamically allocated.  This should greatly reduce the number of
-     * memory allocations (and subsequent fragmentation). */
-    char buf[4096];
-    size_t buf_size = 4096;
-    char *dynbuf = buf;
-    char *message;
-    va_list ap_copy;
-    int result;
-    struct clog *logger = _clog_loggers[id];
+     * memory allocations (and subsequent fragmentation).  The message alone
+     * is only needed for JSON and binary lines, and for sinks when the
+     * format has no %m; it takes the thread's scratch buffers when long. */
+    char buf[4096], msg_buf[256];
+    struct clog_buf line, msg;
+    struct clog_text text;
+    int result, failed;
+    unsigned int token;
+    struct clog **slot;
+    struct clog *logger;
+    enum clog_level level = site->level;
+    const char *sfile;
+    const struct clog_sinks *sinks;
+    int json, binary, alone, dedup;
+
+    /* Quick check before entering the logger. */
+    if ((int) level < _clog_level(id)) {
+        _clog_count_filtered(id);
+        return;
+    }
+    if (_clog_load_relaxed(&_clog_reopen_pending)) {
+        _clog_reopen_pending_files();
+    }
 
+    slot = _clog_slot(id);
+    if (!slot) {
+        _clog_err("No such logger: %d\n", id);
+        return;
+    }
+    token = _clog_read_lock(id);
+    logger = _clog_load(slot);
     if (!logger) {
+        _clog_read_unlock(id, token);
         _clog_err("No such logger: %d\n", id);
         return;
     }
 
-    if (level < logger->level) {
+    if (level < _clog_load_relaxed(&logger->level)) {
+        _clog_count_filtered(id);
+        _clog_read_unlock(id, token);
         return;
     }
-
-    /* Format the message text with the argument list. */
-    va_copy(ap_copy, ap);
-    result = vsnprintf(dynbuf, buf_size, fmt, ap);
-    if ((size_t) result >= buf_size) {
-        buf_size = result + 1;
-        dynbuf = (char *) malloc(buf_size);
-        result = vsnprintf(dynbuf, buf_size, fmt, ap_copy);
-        if ((size_t) result >= buf_size) {
-            /* Formatting failed -- too large */
-            _clog_err("Formatting failed (1).\n");
-            va_end(ap_copy);
-            free(dynbuf);
-            return;
+    /* Repeats are dropped before they can use up the rate limit, and a
+     * line the rate limit drops is no message to repeat. */
+    dedup = message == NULL && count == 0
+            && site->repeat_listed != CLOG_REPEATS_TRANSIENT
+            && _clog_load_relaxed(&logger->dedup);
+    if (dedup && !_clog_dedup_allows(logger, site, fmt, ap)) {
+        _clog_read_unlock(id, token);
+        return;
+    }
+    if (!_clog_rate_allows(logger, site)) {
+        if (dedup) {
+            _clog_dedup_forget(site);
         }
+        _clog_read_unlock(id, token);
+        return;
     }
-    va_end(ap_copy);
 
-    /* Format according to log format and write to log */
-    {
-        char message_buf[4096];
-        message = _clog_format(logger, message_buf, 4096, sfile, sline,
-                               CLOG_LEVEL_NAMES[level], dynbuf);
-        if (!message) {
-            _clog_err("Formatting failed (2).\n");
-            if (dynbuf != buf) {
-                free(dynbuf);
-            }
-            return;
+    /* Say what was suppressed before. */
+    sfile = _clog_site_name(site);
+    if (_clog_load_relaxed(&site->repeats) > 0) {
+        _clog_note(logger, site, "Last message repeated %lu times",
+                   _clog_swap(&site->repeats, 0));
+    }
+    if (_clog_load_relaxed(&site->limited) > 0) {
+        _clog_note(logger, site, "%lu lines dropped by the rate limit",
+                   _clog_swap(&site->limited, 0));
+    }
+
+    /* Format according to log format, with the message text formatted in
+     * place, and write to log */
+    _clog_buf_init(&line, buf, sizeof(buf));
+    _clog_buf_init(&msg, msg_buf, sizeof(msg_buf));
+    sinks = _clog_sinks_for(logger, level);
+    binary = _clog_load_relaxed(&logger->binary);
+    json = _clog_load_relaxed(&logger->json) && !binary;
+    text.fmt = fmt;
+    va_copy(text.ap, ap);
+    text.message = message;
+    text.ctx = ctx;
+    text.fields = fields;
+    text.count = json ? 0 : count;
+    text.offset = CLOG_TEXT_UNPLACED;
+    text.len = 0;
+    alone = json || (binary && (message != NULL || sinks != NULL
+                                || count > 0));
+    if (json) {
+        /* The message goes in escaped, and to sinks with its fields. */
+        _clog_append_text(&msg, &text);
+        failed = msg.failed
+                 || _clog_format_json(&line, sfile, site->line, level,
+                                      msg.data, msg.len, fields, count);
+        _clog_append_fields(&msg, fields, count);
+    } else if (alone) {
+        /* A record of the formatted message, as it has no arguments to
+         * keep. */
+        _clog_append_text(&msg, &text);
+        failed = msg.failed
+                 || _clog_render_args(logger, &line, sfile, site->line,
+                                      level, "%.*s", (int) msg.len,
+                                      msg.data);
+    } else if (binary) {
+        failed = _clog_encode(logger, &line, sfile, site->line, level, fmt,
+                              ap);
+    } else {
+        failed = _clog_format_text(_clog_load(&logger->format),
+                                   &logger->start, &line, sfile, site->line,
+                                   level, NULL, &text);
+        if (sinks != NULL && text.offset == CLOG_TEXT_UNPLACED) {
+            /* No %m in the format: the sinks still want the message. */
+            _clog_append_text(&msg, &text);
+            alone = 1;
         }
-        result = clog_log(logger, message, strlen(message));
+    }
+    if (failed) {
+        _clog_err("Formatting failed.\n");
+    } else {
+        result = _clog_write(logger, level, line.data, line.len);
         if (result == -1) {
             _clog_err("Unable to write to log file: %s\n", strerror(errno));
         }
-        if (message != message_buf) {
-            free(message);
-        }
-        if (dynbuf != buf) {
-            free(dynbuf);
+        if (sinks != NULL && alone) {
+            _clog_write_sinks(logger, sinks, sfile, site->line, level, &line,
+                              msg.data, msg.len);
+        } else if (sinks != NULL) {
+            _clog_write_sinks(logger, sinks, sfile, site->line, level, &line,
+                              line.data + text.offset, text.len);
         }
     }
+    va_end(text.ap);
+    if (line.data != line.stack || msg.data != msg.stack) {
+        _clog_add_stat(logger, CLOG_COUNT_HEAP, 1);
+    }
+    _clog_read_unlock(id, token);
+    _clog_buf_free(&msg);
+    _clog_buf_free(&line);
+}
+
+/* Describe a call site that only lasts for one call: rate limits see each
+ * call afresh, and repeats are not looked for. */
+void
+_clog_transient_site(struct clog_callsite *site, const char *sfile,
+                     int sline, enum clog_level level)
+{
+    site->file = sfile;
+    site->line = sline;
+    site->level = level;
+    site->name = NULL;
+    site->due = 0;
+    site->limited = 0;
+    site->repeats = 0;
+    site->repeat_listed = CLOG_REPEATS_TRANSIENT;
+    site->next_repeated = NULL;
+    site->last_fmt = NULL;
+    site->last_busy = 0;
+}
+
+/* Log from a call site described by the arguments alone. */
+void
+_clog_log_at(const char *sfile, int sline, enum clog_level level, int id,
+             clog_message_fn message, void *ctx, const char *fmt, va_list ap)
+{
+    struct clog_callsite site;
+    _clog_transient_site(&site, sfile, sline, level);
+    _clog_log(&site, id, message, ctx, NULL, 0, fmt, ap);
+}
+
+void
+clog_log_site(struct clog_callsite *site, int id, const char *fmt, ...)
+{
+    va_list ap;
+    if ((int) site->level < _clog_level(id)) {
+        _clog_count_filtered(id);
+        return;
+    }
+    va_start(ap, fmt);
+    _clog_log(site, id, NULL, NULL, NULL, 0, fmt, ap);
+    va_end(ap);
+}
+
+/* Both take a va_list only to share _clog_log(); the lazy path never reads
+ * it. */
+void
+_clog_lazy_site(struct clog_callsite *site, int id, clog_message_fn message,
+                void *ctx, ...)
+{
+    va_list ap;
+    va_start(ap, ctx);
+    _clog_log(site, id, message, ctx, NULL, 0, NULL, ap);
+    va_end(ap);
+}
+
+void
+clog_lazy_site(struct clog_callsite *site, int id, clog_message_fn message,
+               void *ctx)
+{
+    if ((int) site->level < _clog_level(id)) {
+        _clog_count_filtered(id);
+        return;
+    }
+    _clog_lazy_site(site, id, message, ctx);
+}
+
+void
+clog_fields_site(struct clog_callsite *site, int id,
+                 const struct clog_field *fields, size_t count,
+                 const char *fmt, ...)
+{
+    va_list ap;
+    if ((int) site->level < _clog_level(id)) {
+        _clog_count_filtered(id);
+        return;
+    }
+    va_start(ap, fmt);
+    _clog_log(site, id, NULL, NULL, fields, count, fmt, ap);
+    va_end(ap);
+}
+
+void
+clog_fields(const char *sfile, int sline, int id, enum clog_level level,
+            const struct clog_field *fields, size_t count,
+            const char *fmt, ...)
+{
+    struct clog_callsite site;
+    va_list ap;
+    if ((int) level < _clog_level(id)) {
+        _clog_count_filtered(id);
+        return;
+    }
+    _clog_transient_site(&site, sfile, sline, level);
+    va_start(ap, fmt);
+    _clog_log(&site, id, NULL, NULL, fields, count, fmt, ap);
+    va_end(ap);
+}
+
+void
+clog_lazy(const char *sfile, int sline, int id, enum clog_level level,
+          clog_message_fn message, void *ctx)
+{
+    struct clog_callsite site;
+    if ((int) level < _clog_level(id)) {
+        _clog_count_filtered(id);
+        return;
+    }
+    _clog_transient_site(&site, sfile, sline, level);
+    _clog_lazy_site(&site, id, message, ctx);
 }
 
 void
 clog_debug(const char *sfile, int sline, int id, const char *fmt, ...)
 {
     va_list ap;
+    if ((int) CLOG_DEBUG < _clog_level(id)) {
+        _clog_count_filtered(id);
+        return;
+    }
     va_start(ap, fmt);
-    _clog_log(sfile, sline, CLOG_DEBUG, id, fmt, ap);
+    _clog_log_at(sfile, sline, CLOG_DEBUG, id, NULL, NULL, fmt, ap);
     va_end(ap);
 }
 
@@ -694,8 +7745,12 @@ void
 clog_info(const char *sfile, int sline, int id, const char *fmt, ...)
 {
     va_list ap;
+    if ((int) CLOG_INFO < _clog_level(id)) {
+        _clog_count_filtered(id);
+        return;
+    }
     va_start(ap, fmt);
-    _clog_log(sfile, sline, CLOG_INFO, id, fmt, ap);
+    _clog_log_at(sfile, sline, CLOG_INFO, id, NULL, NULL, fmt, ap);
     va_end(ap);
 }
 
@@ -703,8 +7758,12 @@ void
 clog_warn(const char *sfile, int sline, int id, const char *fmt, ...)
 {
     va_list ap;
+    if ((int) CLOG_WARN < _clog_level(id)) {
+        _clog_count_filtered(id);
+        return;
+    }
     va_start(ap, fmt);
-    _clog_log(sfile, sline, CLOG_WARN, id, fmt, ap);
+    _clog_log_at(sfile, sline, CLOG_WARN, id, NULL, NULL, fmt, ap);
     va_end(ap);
 }
 
@@ -712,8 +7771,12 @@ void
 clog_error(const char *sfile, int sline, int id, const char *fmt, ...)
 {
     va_list ap;
+    if ((int) CLOG_ERROR < _clog_level(id)) {
+        _clog_count_filtered(id);
+        return;
+    }
     va_start(ap, fmt);
-    _clog_log(sfile, sline, CLOG_ERROR, id, fmt, ap);
+    _clog_log_at(sfile, sline, CLOG_ERROR, id, NULL, NULL, fmt, ap);
     va_end(ap);
 }
 
@@ -721,8 +7784,12 @@ void
 clog_do(enum clog_level lvl, const char *sfile, int sline, int id, const char *fmt, ...)
 {
     va_list ap;
+    if ((int) lvl < _clog_level(id)) {
+        _clog_count_filtered(id);
+        return;
+    }
     va_start(ap, fmt);
-    _clog_log(sfile, sline, lvl, id, fmt, ap);
+    _clog_log_at(sfile, sline, lvl, id, NULL, NULL, fmt, ap);
     va_end(ap);
 }
 
@@ -35,13 +35,12 @@ inline static int log_id(lua_State *L, int i) {
   if (lua_type(L, i) == LUA_TNUMBER)
     return lua_tointeger(L, i);
   int id = *(int *)luaL_checkudata(L, i, MT_NAME);
-  luaL_argcheck(L, id >= 0 && id < CLOG_MAX_LOGGERS, i, "Out of range");
+  luaL_argcheck(L, _clog_slot(id) != NULL, i, "Out of range");
   return id;
 }
 
 static const char* log_get_message(lua_State *L, int id, enum clog_level lvl, int idx) {
-  struct clog *log = _clog_loggers[id];
-  if (log && log->level > lvl)
+  if (!clog_enabled(id, lvl))
     return NULL;
   if (lua_isfunction(L, idx)) {
     int ret;
@@ -63,7 +62,7 @@ static const char *log_getinfo(int id, lua_State *L, int idx, lua_Debug *ar) {
   const char *fname = "?";
   int rtlvl = -1;  // default to -1, not capture stack level
 
-  struct clog *log = _clog_loggers[id];
+  struct clog *log = _clog_get(id);
   if (log == NULL) {
     luaL_error(L, "invalid logger, maybe closed");
     return fname;
@@ -119,10 +118,37 @@ static int log_tostring(lua_State *L) {
   return 1;
 }
 
+// log.init(name [, path or fd]) finds or creates a named logger
+static int log_create(lua_State *L) {
+  const char *name = lua_tostring(L, 1);
+  int id = clog_lookup(name);
+
+  if (id == -1) {
+    if (lua_type(L, 2) == LUA_TSTRING) {
+      id = clog_create_path(name, lua_tostring(L, 2));
+    } else if (lua_type(L, 2) == LUA_TNUMBER) {
+      id = clog_create_fd(name, lua_tointeger(L, 2));
+    } else
+      id = clog_create_fd(name, STDOUT_FILENO);
+  }
+  if (id != -1) {
+    *(int *)lua_newuserdata(L, sizeof(int)) = id;
+    luaL_setmetatable(L, MT_NAME);
+    return 1;
+  }
+  lua_pushnil(L);
+  lua_pushinteger(L, id);
+  return 2;
+}
+
 static int log_init(lua_State *L) {
-  int id = log_id(L, 1);
+  int id;
   int ret = -1;
-  if (_clog_loggers[id] != NULL) {
+  if (lua_type(L, 1) == LUA_TSTRING)
+    return log_create(L);
+
+  id = log_id(L, 1);
+  if (_clog_get(id) != NULL) {
     *(int *)lua_newuserdata(L, sizeof(int)) = id;
     luaL_setmetatable(L, MT_NAME);
     return 1;
@@ -146,13 +172,21 @@ static int log_init(lua_State *L) {
 
 static int log_rotate(lua_State *L) {
   int id = log_id(L, 1);
-  const char *path = luaL_checkstring(L, 2);
+  const char *path = luaL_optstring(L, 2, NULL);
 
   int ret = clog_rotate(id, path);
   lua_pushboolean(L, ret == 0);
   return ret;
 }
 
+static int log_reopen(lua_State *L) {
+  int id = log_id(L, 1);
+
+  int ret = clog_reopen(id);
+  lua_pushboolean(L, ret == 0);
+  return 1;
+}
+
 static int log_close(lua_State *L) {
   int id = log_id(L, 1);
   clog_free(id);
@@ -161,21 +195,21 @@ static int log_close(lua_State *L) {
 
 static int log_fd(lua_State *L) {
   int id = log_id(L, 1);
-  struct clog *log = _clog_loggers[id];
+  struct clog *log = _clog_get(id);
   lua_pushinteger(L, log->fd);
   return 1;
 }
 
 static int log_isatty(lua_State *L) {
   int id = log_id(L, 1);
-  struct clog *log = _clog_loggers[id];
+  struct clog *log = _clog_get(id);
   lua_pushboolean(L, log->isatty);
   return 1;
 }
 
 static int log_level(lua_State *L) {
   int id = log_id(L, 1);
-  struct clog *log = _clog_loggers[id];
+  struct clog *log = _clog_get(id);
   int level = -1;
   if (lua_type(L, 2) == LUA_TNONE) {
     lua_pushstring(L, CLOG_LEVEL_NAMES[log->level]);
@@ -195,7 +229,7 @@ static int log_level(lua_State *L) {
 
 static int log_date_fmt(lua_State *L) {
   int id = log_id(L, 1);
-  struct clog *log = _clog_loggers[id];
+  struct clog *log = _clog_get(id);
   const char *fmt;
   int ret;
   if (lua_type(L, 2) == LUA_TNONE) {
@@ -215,7 +249,7 @@ static int log_date_fmt(lua_State *L) {
 
 static int log_time_fmt(lua_State *L) {
   int id = log_id(L, 1);
-  struct clog *log = _clog_loggers[id];
+  struct clog *log = _clog_get(id);
   const char *fmt;
   int ret;
   if (lua_type(L, 2) == LUA_TNONE) {
@@ -235,7 +269,7 @@ static int log_time_fmt(lua_State *L) {
 
 static int log_fmt(lua_State *L) {
   int id = log_id(L, 1);
-  struct clog *log = _clog_loggers[id];
+  struct clog *log = _clog_get(id);
   const char *fmt;
   int ret;
   if (lua_type(L, 2) == LUA_TNONE) {
@@ -321,7 +355,7 @@ void clog_buffer(const char *sfile, int sline, int id, int level,
   size_t i, idx = 0;
   const uint8_t *base = (uint8_t *)buf.base;
   int len = buf.len;
-  struct clog *log = _clog_loggers[id];
+  struct clog *log = _clog_get(id);
 
   /* lvl under log->level, do nothing */
   if (log->level > level)
@@ -370,7 +404,7 @@ void clog_buffer(const char *sfile, int sline, int id, int level,
 
 static int log_buffer(lua_State *L) {
   int id = log_id(L, 1);
-  struct clog *log = _clog_loggers[id];
+  struct clog *log = _clog_get(id);
 
   if (log && log->level == CLOG_DEBUG) {
     size_t sz;
@@ -406,6 +440,7 @@ static int log_buffer(lua_State *L) {
 
 static const luaL_Reg log_funcs[] = {{"close", log_close},
                                      {"rotate", log_rotate},
+                                     {"reopen", log_reopen},
 
                                      {"fd", log_fd},
                                      {"isatty", log_isatty},
@@ -423,13 +458,52 @@ static const luaL_Reg log_funcs[] = {{"close", log_close},
 
                                      {NULL, NULL}};
 
+// status of fixed loggers as booleans, then created loggers by id, with
+// their name (or true if they have none)
 static int log_status(lua_State *L) {
-  int i;
+  int i, limit = _clog_id_limit();
+  struct clog *log;
   lua_createtable(L, CLOG_MAX_LOGGERS, 0);
   for (i = 0; i < CLOG_MAX_LOGGERS; i++) {
-    lua_pushboolean(L, _clog_loggers[i] != NULL);
+    lua_pushboolean(L, _clog_get(i) != NULL);
     lua_rawseti(L, -2, i);
   }
+  for (i = CLOG_MAX_LOGGERS; i < limit; i++) {
+    log = _clog_get(i);
+    if (log == NULL)
+      continue;
+    if (log->name[0])
+      lua_pushstring(L, log->name);
+    else
+      lua_pushboolean(L, 1);
+    lua_rawseti(L, -2, i);
+  }
+  return 1;
+}
+
+static void log_set_count(lua_State *L, const char *name, unsigned long n) {
+  lua_pushinteger(L, (lua_Integer)n);
+  lua_setfield(L, -2, name);
+}
+
+// counters of a logger (see clog_stats()) by name, or nil if it is not
+// initialized
+static int log_stats(lua_State *L) {
+  struct clog_stats stats;
+  if (clog_stats(log_id(L, 1), &stats)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, 0, 9);
+  log_set_count(L, "lines", stats.lines);
+  log_set_count(L, "bytes", stats.bytes);
+  log_set_count(L, "filtered", stats.filtered);
+  log_set_count(L, "suppressed", stats.suppressed);
+  log_set_count(L, "dropped", stats.dropped);
+  log_set_count(L, "heap_lines", stats.heap_lines);
+  log_set_count(L, "write_errors", stats.write_errors);
+  log_set_count(L, "write_retries", stats.write_retries);
+  log_set_count(L, "write_usec", stats.write_usec);
   return 1;
 }
 
@@ -551,6 +625,10 @@ int luaopen_log(lua_State *L) {
   lua_pushcfunction(L, log_status);
   lua_rawset(L, -3);
 
+  lua_pushliteral(L, "stats");
+  lua_pushcfunction(L, log_stats);
+  lua_rawset(L, -3);
+
   lua_pushliteral(L, "hex");
   lua_pushcfunction(L, log_hex);
   lua_rawset(L, -3);
@@ -6,10 +6,18 @@
 #define _XOPEN_SOURCE 500
 #endif /* __STDC_VERSION__ */
 
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <wchar.h>
 
 #define CLOG_MAIN
 #include "clog.h"
@@ -73,7 +81,7 @@ int test_file_write_nonexistent(void)
     if (clog_init_path(0, "path-doesnt-exist/log.out") == 0) {
         return 1;
     }
-    if (_clog_loggers[0] != NULL) {
+    if (_clog_load(&_clog_loggers[0]) != NULL) {
         return 1;
     }
 
@@ -217,68 +225,1698 @@ int test_bad_format(void)
     return 0;
 }
 
+int test_format_substitutions(void)
+{
+    char buf[1024];
+    char exp[256];
+    int fd[2];
+    size_t bytes;
+    int line;
+
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "<%l> 100%% %q%f:%n|%m%m\n%"));
+    line = __LINE__; clog_warn(CLOG(0), "x=%d", 5);
+    clog_free(0);
+    close(fd[1]);
+
+    bytes = read(fd[0], buf, 1024);
+    if (bytes <= 0) {
+        close(fd[0]);
+        return 1;
+    }
+    buf[bytes] = 0;
+    close(fd[0]);
+    snprintf(exp, 256, "<WARN> 100%% %s:%d|x=5x=5\n", THIS_FILE, line);
+    CHECK_CALL(strcmp(buf, exp));
+
+    return 0;
+}
+
+int test_date_time_format(void)
+{
+    char buf[1024];
+    int fd[2];
+    size_t bytes;
+
+    /* Changing a date or time format takes effect within the same second. */
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%d|%t|%m\n"));
+    CHECK_CALL(clog_set_date_fmt(0, "date1"));
+    CHECK_CALL(clog_set_time_fmt(0, "time1"));
+    clog_info(CLOG(0), "a");
+    CHECK_CALL(clog_set_date_fmt(0, "date2"));
+    clog_info(CLOG(0), "b");
+    CHECK_CALL(clog_set_time_fmt(0, "time2"));
+    clog_info(CLOG(0), "c");
+    clog_free(0);
+    close(fd[1]);
+
+    bytes = read(fd[0], buf, 1024);
+    if (bytes <= 0) {
+        close(fd[0]);
+        return 1;
+    }
+    buf[bytes] = 0;
+    close(fd[0]);
+    CHECK_CALL(strcmp(buf,
+        "date1|time1|a\n"
+        "date2|time1|b\n"
+        "date2|time2|c\n"
+    ));
+
+    return 0;
+}
+
+int test_subsecond_format(void)
+{
+    char buf[1024];
+    char ms[16], us[16], ns[16], elapsed[32];
+    int fd[2];
+    size_t bytes;
+
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%M %u %N %r|%m\n"));
+    clog_info(CLOG(0), "a");
+    clog_free(0);
+    close(fd[1]);
+
+    bytes = read(fd[0], buf, 1024);
+    if (bytes <= 0) {
+        close(fd[0]);
+        return 1;
+    }
+    buf[bytes] = 0;
+    close(fd[0]);
+
+    /* All fractions come from the same clock reading. */
+    if (sscanf(buf, "%15s %15s %15s %31[^|]|", ms, us, ns, elapsed) != 4) {
+        return 1;
+    }
+    if (strlen(ms) != 3 || strlen(us) != 6 || strlen(ns) != 9) {
+        return 1;
+    }
+    CHECK_CALL(strncmp(us, ns, 6));
+    CHECK_CALL(strncmp(ms, us, 3));
+    if (strchr(elapsed, '.') == NULL || strlen(strchr(elapsed, '.')) != 7) {
+        return 1;
+    }
+    if (strcmp(strchr(buf, '|'), "|a\n") != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
 int test_long_message(void)
 {
-    FILE *f = NULL;
-    char buf[51000];
-    char message[50000];
-    char exp[51000];
-    memset(message, 'b', 49999);
-    message[49999] = 0;
+    FILE *f = NULL;
+    char buf[51000];
+    char message[50000];
+    char exp[51000];
+    memset(message, 'b', 49999);
+    message[49999] = 0;
+
+    /* Write to the log */
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_fmt(0, "%f: %l: %m\n"));
+    clog_debug(CLOG(0), message);
+    clog_free(0);
+
+    /* Verify what was written */
+    f = fopen(TEST_FILE, "r");
+    if (!f) {
+        return 1;
+    }
+
+    if (fgets(buf, 51000, f) == NULL) {
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+
+    snprintf(exp, 51000, "%s: DEBUG: %s\n", THIS_FILE, message);
+    CHECK_CALL(strcmp(buf, exp));
+    return 0;
+}
+
+int allocations = 0;
+
+void *count_malloc(size_t size)
+{
+    allocations++;
+    return malloc(size);
+}
+
+void *count_realloc(void *p, size_t size)
+{
+    allocations++;
+    return realloc(p, size);
+}
+
+int test_allocator(void)
+{
+    struct stat st;
+    char message[20000];
+    int i, before;
+    memset(message, 'c', sizeof(message) - 1);
+    message[sizeof(message) - 1] = 0;
+
+    CHECK_CALL(!clog_set_allocator(count_malloc, NULL, free));
+    CHECK_CALL(clog_set_allocator(count_malloc, count_realloc, free));
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    CHECK_CALL(allocations == 0);
+    CHECK_CALL(!clog_set_allocator(NULL, NULL, NULL));
+
+    /* Long lines after the first reuse its buffers. */
+    before = allocations;
+    clog_info(CLOG(0), "%s", message);
+    CHECK_CALL(allocations == before);
+    before = allocations;
+    for (i = 0; i < 10; i++) {
+        clog_info(CLOG(0), "%s", message);
+        clog_info(CLOG(0), "%.*s", 5000, message);
+    }
+    CHECK_CALL(allocations != before);
+    clog_free(0);
+
+    CHECK_CALL(stat(TEST_FILE, &st));
+    CHECK_CALL(st.st_size != 11 * 20000 + 10 * 5001);
+    CHECK_CALL(clog_set_allocator(NULL, NULL, NULL));
+    return 0;
+}
+
+#define ASYNC_THREADS 4
+#define ASYNC_LINES 5000
+
+void *async_writer(void *arg)
+{
+    int thread = *(int *) arg;
+    int i;
+    for (i = 0; i < ASYNC_LINES; i++) {
+        clog_info(CLOG(0), "thread %d line %d", thread, i);
+    }
+    return NULL;
+}
+
+/* Check that every line written by async_writer arrived whole, and in order
+ * for each thread, counting the lines of each thread in next. */
+int read_thread_lines(const char *path, int *next)
+{
+    FILE *f = NULL;
+    char buf[256];
+    const char *text;
+    int thread, line;
+
+    f = fopen(path, "r");
+    if (!f) {
+        return 1;
+    }
+    while (fgets(buf, 256, f) != NULL) {
+        text = strstr(buf, "thread ");
+        if (text == NULL
+            || sscanf(text, "thread %d line %d", &thread, &line) != 2
+            || thread < 0 || thread >= ASYNC_THREADS
+            || line != next[thread]) {
+            fclose(f);
+            return 1;
+        }
+        next[thread]++;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Log from ASYNC_THREADS threads at once, then check the lines. */
+int write_from_threads(void)
+{
+    pthread_t threads[ASYNC_THREADS];
+    int ids[ASYNC_THREADS];
+    int next[ASYNC_THREADS] = { 0 };
+    int i;
+
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        ids[i] = i;
+        CHECK_CALL(pthread_create(&threads[i], NULL, async_writer, &ids[i]));
+    }
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        CHECK_CALL(pthread_join(threads[i], NULL));
+    }
+    if (clog_dropped(0) != 0) {
+        return 1;
+    }
+    clog_free(0);
+
+    CHECK_CALL(read_thread_lines(TEST_FILE, next));
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        if (next[i] != ASYNC_LINES) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int test_async_write(void)
+{
+    CHECK_CALL(clog_init_path_async(0, TEST_FILE, 4096));
+    return write_from_threads();
+}
+
+int test_async_long_line(void)
+{
+    static char line[8192];
+    FILE *f = NULL;
+    int i;
+
+    CHECK_CALL(clog_init_path_async(0, TEST_FILE, 4096));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    for (i = 0; i < 50; i++) {
+        clog_info(CLOG(0), "%d", i);
+    }
+    /* Larger than the ring: written after the lines queued before it. */
+    memset(line, 'x', 5000);
+    clog_info(CLOG(0), "%s", line);
+    clog_info(CLOG(0), "after");
+    clog_free(0);
+
+    f = fopen(TEST_FILE, "r");
+    if (!f) {
+        return 1;
+    }
+    for (i = 0; i < 52 && fgets(line, sizeof(line), f) != NULL; i++) {
+        if (i < 50 ? atoi(line) != i
+            : strlen(line) != (i == 50 ? 5001 : 6)) {
+            break;
+        }
+    }
+    fclose(f);
+    return i != 52;
+}
+
+int test_async_overflow(void)
+{
+    FILE *f = NULL;
+    char buf[256];
+    unsigned long lines = 0, dropped;
+    int i;
+
+    CHECK_CALL(clog_init_path_async(0, TEST_FILE, 4096));
+    CHECK_CALL(clog_set_overflow(0, CLOG_OVERFLOW_DROP_NEWEST));
+    for (i = 0; i < 20000; i++) {
+        clog_info(CLOG(0), "%0100d", i);
+    }
+    dropped = clog_dropped(0);
+    clog_free(0);
+
+    /* Every line was either written or counted as dropped. */
+    f = fopen(TEST_FILE, "r");
+    if (!f) {
+        return 1;
+    }
+    while (fgets(buf, 256, f) != NULL) {
+        lines++;
+    }
+    fclose(f);
+    error("  %lu lines written, %lu dropped.\n", lines, dropped);
+    if (lines + dropped != 20000) {
+        return 1;
+    }
+
+    /* Only asynchronous loggers have an overflow policy. */
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    if (clog_set_overflow(0, CLOG_OVERFLOW_DROP_NEWEST) == 0) {
+        return 1;
+    }
+    clog_free(0);
+
+    return 0;
+}
+
+/* Read whatever is available from a non-blocking pipe. */
+size_t read_available(int fd, char *buf, size_t size)
+{
+    ssize_t bytes = read(fd, buf, size - 1);
+    if (bytes < 0) {
+        bytes = 0;
+    }
+    buf[bytes] = 0;
+    return bytes;
+}
+
+int test_buffered_write(void)
+{
+    char buf[1024];
+    int fd[2];
+    struct timespec pause = { 0, 200000000 };
+
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(fcntl(fd[0], F_SETFL, O_NONBLOCK) == -1);
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%l: %m\n"));
+    CHECK_CALL(clog_set_buffer(0, 64, 0));
+
+    /* Nothing is written until the buffer fills up or an error is logged. */
+    clog_info(CLOG(0), "one");
+    clog_warn(CLOG(0), "two");
+    if (read_available(fd[0], buf, sizeof(buf)) != 0) {
+        return 1;
+    }
+    clog_error(CLOG(0), "three");
+    read_available(fd[0], buf, sizeof(buf));
+    CHECK_CALL(strcmp(buf, "INFO: one\nWARN: two\nERROR: three\n"));
+
+    /* Overflowing the buffer writes out what came before. */
+    clog_info(CLOG(0), "%040d", 0);
+    clog_info(CLOG(0), "%040d", 1);
+    read_available(fd[0], buf, sizeof(buf));
+    CHECK_CALL(strcmp(buf, "INFO: 0000000000000000000000000000000000000000\n"));
+
+    /* An explicit flush. */
+    CHECK_CALL(clog_flush(0));
+    read_available(fd[0], buf, sizeof(buf));
+    CHECK_CALL(strcmp(buf, "INFO: 0000000000000000000000000000000000000001\n"));
+
+    /* A different flush level, and a time limit. */
+    CHECK_CALL(clog_set_flush_level(0, CLOG_WARN));
+    CHECK_CALL(clog_set_buffer(0, 1024, 50));
+    clog_warn(CLOG(0), "four");
+    read_available(fd[0], buf, sizeof(buf));
+    CHECK_CALL(strcmp(buf, "WARN: four\n"));
+    clog_info(CLOG(0), "five");
+    nanosleep(&pause, NULL);
+    read_available(fd[0], buf, sizeof(buf));
+    CHECK_CALL(strcmp(buf, "INFO: five\n"));
+
+    /* Freeing the logger writes out the rest. */
+    clog_info(CLOG(0), "six");
+    clog_free(0);
+    read_available(fd[0], buf, sizeof(buf));
+    CHECK_CALL(strcmp(buf, "INFO: six\n"));
+    close(fd[0]);
+    close(fd[1]);
+
+    return 0;
+}
+
+struct pipe_reader {
+    int fd;
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+/* Read slowly until end of file, so writers see a full pipe. */
+void *read_pipe(void *arg)
+{
+    struct pipe_reader *reader = (struct pipe_reader *) arg;
+    struct timespec pause = { 0, 100000 };
+    ssize_t bytes;
+
+    do {
+        nanosleep(&pause, NULL);
+        bytes = read(reader->fd, reader->data + reader->len,
+                     reader->size - reader->len < 4096
+                     ? reader->size - reader->len : 4096);
+        if (bytes > 0) {
+            reader->len += bytes;
+        }
+    } while (bytes > 0);
+    return NULL;
+}
+
+int test_partial_writes(void)
+{
+    const size_t LINES = 5000;
+    struct pipe_reader reader;
+    pthread_t thread;
+    char *message;
+    char exp[128];
+    int fd[2];
+    size_t i, line_len;
+    int async;
+
+    /* A non-blocking pipe makes write() and writev() stop short when the
+     * pipe fills up.  Try a direct and an asynchronous logger. */
+    message = (char *) malloc(300001);
+    reader.size = 1000000;
+    reader.data = (char *) malloc(reader.size);
+    if (!message || !reader.data) {
+        return 1;
+    }
+    memset(message, 'p', 300000);
+    message[300000] = 0;
+
+    for (async = 0; async < 2; async++) {
+        CHECK_CALL(pipe(fd));
+        CHECK_CALL(fcntl(fd[1], F_SETFL, O_NONBLOCK) == -1);
+        reader.fd = fd[0];
+        reader.len = 0;
+        CHECK_CALL(pthread_create(&thread, NULL, read_pipe, &reader));
+
+        if (async) {
+            CHECK_CALL(clog_init_fd_async(0, fd[1], 1 << 20));
+        } else {
+            CHECK_CALL(clog_init_fd(0, fd[1]));
+        }
+        CHECK_CALL(clog_set_fmt(0, "%m\n"));
+        if (async) {
+            for (i = 0; i < LINES; i++) {
+                clog_info(CLOG(0), "line %090lu", (unsigned long) i);
+            }
+        } else {
+            clog_info(CLOG(0), "%s", message);
+        }
+        clog_free(0);
+        close(fd[1]);
+        CHECK_CALL(pthread_join(thread, NULL));
+        close(fd[0]);
+
+        if (async) {
+            line_len = strlen("line \n") + 90;
+            if (reader.len != LINES * line_len) {
+                return 1;
+            }
+            for (i = 0; i < LINES; i++) {
+                snprintf(exp, sizeof(exp), "line %090lu\n", (unsigned long) i);
+                CHECK_CALL(memcmp(reader.data + i * line_len, exp, line_len));
+            }
+        } else {
+            if (reader.len != 300001
+                || memcmp(reader.data, message, 300000) != 0
+                || reader.data[300000] != '\n') {
+                return 1;
+            }
+        }
+    }
+    free(message);
+    free(reader.data);
+
+    return 0;
+}
+
+int test_buffered_threads(void)
+{
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_buffer(0, 4096, 0));
+    return write_from_threads();
+}
+
+int test_buffered_exit(void)
+{
+    FILE *f = NULL;
+    char buf[256];
+    int status;
+    pid_t pid;
+
+    /* Or the child's exit() writes out our pending output again. */
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        /* Exit without freeing the logger. */
+        if (clog_init_path(0, TEST_FILE) || clog_set_fmt(0, "%m\n")
+            || clog_set_buffer(0, 4096, 0)) {
+            _exit(1);
+        }
+        clog_info(CLOG(0), "buffered");
+        exit(0);
+    }
+    if (pid == -1 || waitpid(pid, &status, 0) != pid || status != 0) {
+        return 1;
+    }
+
+    f = fopen(TEST_FILE, "r");
+    if (!f) {
+        return 1;
+    }
+    if (fgets(buf, 256, f) == NULL) {
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+    CHECK_CALL(strcmp(buf, "buffered\n"));
+
+    return 0;
+}
+
+/* Log the same call to binary logger 0 and text logger 1, on one line. */
+#define LOG_BOTH(...) \
+    do { clog_warn(CLOG(0), __VA_ARGS__); clog_warn(CLOG(1), __VA_ARGS__); } \
+    while (0)
+
+/* Decode the binary logs at paths (NULL-terminated) into path. */
+int decode_files(const char *const *paths, const char *path, const char *fmt)
+{
+    int in, out;
+    out = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (out == -1) {
+        return 1;
+    }
+    for (; *paths; paths++) {
+        in = open(*paths, O_RDONLY);
+        if (in == -1 || clog_decode(in, out, fmt, NULL, NULL)) {
+            close(out);
+            return 1;
+        }
+        close(in);
+    }
+    close(out);
+    return 0;
+}
+
+int compare_files(const char *path1, const char *path2)
+{
+    static char buf1[16384], buf2[16384];
+    ssize_t bytes1, bytes2;
+    int fd1 = open(path1, O_RDONLY);
+    int fd2 = open(path2, O_RDONLY);
+
+    bytes1 = read(fd1, buf1, sizeof(buf1));
+    bytes2 = read(fd2, buf2, sizeof(buf2));
+    close(fd1);
+    close(fd2);
+    if (bytes1 <= 0 || bytes1 != bytes2 || memcmp(buf1, buf2, bytes1)) {
+        return 1;
+    }
+    return 0;
+}
+
+int test_mmap_write(void)
+{
+    CHECK_CALL(clog_init_path_mmap(0, TEST_FILE, 4096));
+    return write_from_threads();
+}
+
+int test_mmap_rotate(void)
+{
+    char expected[8192];
+    size_t len = 0;
+    int fd, i;
+
+    /* Lines go after what is in the file already, across segments. */
+    fd = open(TEST_FILE, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    CHECK_CALL(_clog_write_all(fd, "existing\n", 9) != 9);
+    close(fd);
+    CHECK_CALL(clog_init_path_mmap(0, TEST_FILE, 1));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    len += sprintf(expected + len, "existing\n");
+    for (i = 0; i < 500; i++) {
+        clog_info(CLOG(0), "line %d", i);
+        len += sprintf(expected + len, "line %d\n", i);
+        /* Give the background thread time to map the next segment. */
+        if (i % 100 == 0) {
+            usleep(20000);
+        }
+    }
+    CHECK_CALL(clog_rotate(0, TEST_FILE));
+    clog_info(CLOG(0), "rotated");
+    clog_free(0);
+
+    fd = open(TEST_FILE ".expected", O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    CHECK_CALL(_clog_write_all(fd, expected, len) != (int) len);
+    close(fd);
+    CHECK_CALL(compare_files(TEST_FILE ".old", TEST_FILE ".expected"));
+    fd = open(TEST_FILE ".expected", O_WRONLY | O_TRUNC);
+    CHECK_CALL(_clog_write_all(fd, "rotated\n", 8) != 8);
+    close(fd);
+    CHECK_CALL(compare_files(TEST_FILE, TEST_FILE ".expected"));
+    unlink(TEST_FILE ".old");
+    unlink(TEST_FILE ".expected");
+
+    return 0;
+}
+
+/* Wait up to two seconds for path to have size bytes. */
+int wait_for_size(const char *path, off_t size)
+{
+    struct stat st;
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        if (stat(path, &st) == 0 && st.st_size == size) {
+            return 0;
+        }
+        usleep(10000);
+    }
+    return 1;
+}
+
+/* Wait up to two seconds for logger 0 to have switched to a new, empty
+ * file at path: the file appears before the logger takes it up. */
+int wait_for_rotation(const char *path)
+{
+    struct stat st, logged;
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        if (stat(path, &st) == 0 && st.st_size == 0
+            && fstat(_clog_load(&_clog_loggers[0]->fd), &logged) == 0
+            && logged.st_ino == st.st_ino && logged.st_dev == st.st_dev) {
+            return 0;
+        }
+        usleep(10000);
+    }
+    return 1;
+}
+
+int check_file(const char *path, const char *expected)
+{
+    char buf[256];
+    ssize_t len;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return 1;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len < 0) {
+        return 1;
+    }
+    buf[len] = 0;
+    return strcmp(buf, expected) != 0;
+}
+
+int test_rotation_size(void)
+{
+    char expected[16];
+    int i;
+
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    CHECK_CALL(clog_set_rotation(0, 6, 0, 3));
+
+    /* Every line takes the file past the limit. */
+    for (i = 0; i < 5; i++) {
+        clog_info(CLOG(0), "line %d", i);
+        CHECK_CALL(wait_for_rotation(TEST_FILE));
+    }
+    clog_info(CLOG(0), "last");
+    clog_free(0);
+
+    CHECK_CALL(check_file(TEST_FILE, "last\n"));
+    for (i = 1; i <= 3; i++) {
+        char path[64];
+        sprintf(path, TEST_FILE ".%d", i);
+        sprintf(expected, "line %d\n", 5 - i);
+        CHECK_CALL(check_file(path, expected));
+        unlink(path);
+    }
+    if (access(TEST_FILE ".4", F_OK) == 0) {
+        return 1;
+    }
+
+    /* clog_rotate() without a path rotates the same way, leaving the
+     * shifts to the background thread, which keeps them in order. */
+    unlink(TEST_FILE);
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    CHECK_CALL(clog_set_rotation(0, 0, 0, 2));
+    clog_info(CLOG(0), "manual");
+    CHECK_CALL(clog_rotate(0, NULL));
+    clog_info(CLOG(0), "second");
+    CHECK_CALL(clog_rotate(0, NULL));
+    clog_info(CLOG(0), "third");
+    CHECK_CALL(clog_rotate(0, NULL));
+    clog_free(0);
+    CHECK_CALL(check_file(TEST_FILE ".1", "third\n"));
+    CHECK_CALL(check_file(TEST_FILE ".2", "second\n"));
+    if (access(TEST_FILE ".3", F_OK) == 0) {
+        return 1;
+    }
+    unlink(TEST_FILE ".1");
+    unlink(TEST_FILE ".2");
+
+    return 0;
+}
+
+int test_rotation_time(void)
+{
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    CHECK_CALL(clog_set_rotation(0, 0, 1, 1));
+    clog_info(CLOG(0), "before");
+
+    /* Rotated at the start of the next second. */
+    CHECK_CALL(wait_for_rotation(TEST_FILE));
+    clog_info(CLOG(0), "after");
+    clog_free(0);
+
+    CHECK_CALL(check_file(TEST_FILE ".1", "before\n"));
+    CHECK_CALL(check_file(TEST_FILE, "after\n"));
+    unlink(TEST_FILE ".1");
+
+    return 0;
+}
+
+/* Uncompress path, written by clog without zlib, to TEST_FILE ".plain". */
+int uncompress_file(const char *path)
+{
+    int in = open(path, O_RDONLY);
+    int out = open(TEST_FILE ".plain", O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    int result = in == -1 || out == -1 || clog_uncompress(in, out);
+    close(in);
+    close(out);
+    return result;
+}
+
+int test_compress(void)
+{
+    FILE *f = NULL;
+    char buf[256], expected[256];
+    struct stat st;
+    int i;
+
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    CHECK_CALL(clog_set_rotation(0, 0, 0, 2));
+    CHECK_CALL(clog_set_compress(0, 1));
+
+    /* More than one block. */
+    for (i = 0; i < 3000; i++) {
+        clog_info(CLOG(0), "compressible line %d of the first file", i);
+    }
+    CHECK_CALL(clog_rotate(0, NULL));
+    clog_info(CLOG(0), "second");
+    /* Renumbers the first file even if it is still being compressed. */
+    CHECK_CALL(clog_rotate(0, NULL));
+    clog_free(0);
+
+    for (i = 0; i < 500 && (access(TEST_FILE ".1.lz", F_OK) != 0
+                            || access(TEST_FILE ".2.lz", F_OK) != 0);
+         i++) {
+        usleep(10000);
+    }
+    if (access(TEST_FILE ".1", F_OK) == 0
+        || access(TEST_FILE ".2", F_OK) == 0) {
+        return 1;
+    }
+
+    CHECK_CALL(uncompress_file(TEST_FILE ".1.lz"));
+    CHECK_CALL(check_file(TEST_FILE ".plain", "second\n"));
+
+    CHECK_CALL(stat(TEST_FILE ".2.lz", &st));
+    if (st.st_size > 30000) {
+        return 1;
+    }
+    CHECK_CALL(uncompress_file(TEST_FILE ".2.lz"));
+    f = fopen(TEST_FILE ".plain", "r");
+    if (!f) {
+        return 1;
+    }
+    for (i = 0; fgets(buf, sizeof(buf), f) != NULL; i++) {
+        sprintf(expected, "compressible line %d of the first file\n", i);
+        if (strcmp(buf, expected) != 0) {
+            break;
+        }
+    }
+    fclose(f);
+    if (i != 3000) {
+        return 1;
+    }
+
+    unlink(TEST_FILE ".1.lz");
+    unlink(TEST_FILE ".2.lz");
+    unlink(TEST_FILE ".plain");
+
+    /* Rotating a logger leaves alone the files of one whose path merely
+     * starts with its own. */
+    CHECK_CALL(clog_init_path(1, TEST_FILE ".b"));
+    CHECK_CALL(clog_set_rotation(1, 0, 0, 2));
+    CHECK_CALL(clog_set_compress(1, 1));
+    clog_info(CLOG(1), "other");
+    CHECK_CALL(clog_rotate(1, NULL));
+    clog_free(1);
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_rotation(0, 0, 0, 2));
+    CHECK_CALL(clog_rotate(0, NULL));
+    clog_free(0);
+    for (i = 0; i < 500 && access(TEST_FILE ".b.1.lz", F_OK) != 0; i++) {
+        usleep(10000);
+    }
+    if (access(TEST_FILE ".b.1.lz", F_OK) != 0
+        || access(TEST_FILE ".b.2.lz", F_OK) == 0) {
+        return 1;
+    }
+
+    unlink(TEST_FILE ".b.1.lz");
+    unlink(TEST_FILE ".b");
+    unlink(TEST_FILE ".1");
+    return 0;
+}
+
+void reopen_on_hup(int sig)
+{
+    (void) sig;
+    clog_request_reopen(-1);
+}
+
+int test_reopen(void)
+{
+    int fd, i;
+
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    clog_info(CLOG(0), "one");
+
+    /* As logrotate would, then signal. */
+    CHECK_CALL(rename(TEST_FILE, TEST_FILE ".moved"));
+    signal(SIGHUP, reopen_on_hup);
+    raise(SIGHUP);
+    signal(SIGHUP, SIG_DFL);
+
+    /* This line may still go to the old file. */
+    fd = _clog_load(&_clog_loggers[0]->fd);
+    clog_info(CLOG(0), "two");
+    for (i = 0; i < 200 && _clog_load(&_clog_loggers[0]->fd) == fd; i++) {
+        usleep(10000);
+    }
+    clog_info(CLOG(0), "three");
+
+    /* And at once. */
+    CHECK_CALL(rename(TEST_FILE, TEST_FILE ".new"));
+    CHECK_CALL(clog_reopen(0));
+    clog_info(CLOG(0), "four");
+    clog_free(0);
+
+    /* Only loggers take requests, and a new logger starts without one. */
+    if (clog_request_reopen(0) == 0) {
+        return 1;
+    }
+    CHECK_CALL(clog_init_fd(0, 1));
+    if (clog_request_reopen(0) != 0) {
+        return 1;
+    }
+    clog_free(0);
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    if (_clog_load(&_clog_reopens[0]) != 0) {
+        return 1;
+    }
+    clog_free(0);
+
+    if (check_file(TEST_FILE ".moved", "one\ntwo\n") == 0) {
+        CHECK_CALL(check_file(TEST_FILE ".new", "three\n"));
+    } else {
+        CHECK_CALL(check_file(TEST_FILE ".moved", "one\n"));
+        CHECK_CALL(check_file(TEST_FILE ".new", "two\nthree\n"));
+    }
+    CHECK_CALL(check_file(TEST_FILE, "four\n"));
+    unlink(TEST_FILE ".moved");
+    unlink(TEST_FILE ".new");
+
+    return 0;
+}
+
+int test_binary_log(void)
+{
+    const char *const paths[] = { TEST_FILE ".old", TEST_FILE, NULL };
+    const char *fmt = "%f(%n): %l: %m\n";
+    int numbers[3] = { 1, 2, 3 };
+    int i;
+
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_init_path(1, TEST_FILE ".text"));
+    CHECK_CALL(clog_set_binary(0, 1));
+    CHECK_CALL(clog_set_fmt(1, fmt));
+
+    for (i = 0; i < 3; i++) {
+        LOG_BOTH("%d %s %5.2f %ld %*d|%-*d|", i, "str", 3.14159, -7L,
+                 4, i, 4, i);
+        LOG_BOTH("%.3s %.*s %% %c %p %zu %lld %Lg %08.3e", "abcdef", 2,
+                 "xyz", 'c', (void *) numbers, sizeof(numbers), 1LL << 40,
+                 (long double) 2.5, 1e10);
+        LOG_BOTH("no arguments");
+        /* Not stored as arguments, but as text. */
+        LOG_BOTH("wide %ls", L"text");
+        if (i == 1) {
+            CHECK_CALL(clog_rotate(0, TEST_FILE));
+        }
+    }
+    clog_free(0);
+    clog_free(1);
+
+    /* Lines logged before the rotation are in the old file, which has
+     * sessions of its own. */
+    CHECK_CALL(decode_files(paths, TEST_FILE ".decoded", fmt));
+    CHECK_CALL(compare_files(TEST_FILE ".decoded", TEST_FILE ".text"));
+    unlink(TEST_FILE ".old");
+    unlink(TEST_FILE ".text");
+    unlink(TEST_FILE ".decoded");
+
+    return 0;
+}
+
+int test_binary_threads(void)
+{
+    const char *const paths[] = { TEST_FILE, NULL };
+    pthread_t threads[ASYNC_THREADS];
+    int ids[ASYNC_THREADS];
+    int next[ASYNC_THREADS] = { 0 };
+    int i;
+
+    /* Threads numbering the same call site at once. */
+    CHECK_CALL(clog_init_path_async(0, TEST_FILE, 4096));
+    CHECK_CALL(clog_set_binary(0, 1));
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        ids[i] = i;
+        CHECK_CALL(pthread_create(&threads[i], NULL, async_writer, &ids[i]));
+    }
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        CHECK_CALL(pthread_join(threads[i], NULL));
+    }
+    clog_free(0);
+
+    CHECK_CALL(decode_files(paths, TEST_FILE ".decoded", "%m\n"));
+    CHECK_CALL(read_thread_lines(TEST_FILE ".decoded", next));
+    unlink(TEST_FILE ".decoded");
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        if (next[i] != ASYNC_LINES) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#define SITE_FORMATS 256
+
+char site_formats[SITE_FORMATS][32];
+
+/* Log once from each of site_formats, which other threads number at the
+ * same time. */
+void *site_writer(void *arg)
+{
+    int thread = *(int *) arg;
+    int i;
+    for (i = 0; i < SITE_FORMATS; i++) {
+        clog_info(CLOG(0), site_formats[i], thread);
+    }
+    return NULL;
+}
+
+/* Check that each record of the binary log at path comes after the SITE
+ * record of its call site, as a decoder reading the file as it grows needs
+ * them. */
+int check_sites_first(const char *path)
+{
+    static char data[1 << 20];
+    unsigned char seen[CLOG_SITES + 2];
+    struct clog_binary_header header;
+    size_t len = 0, p;
+    ssize_t bytes;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 1;
+    }
+    while ((bytes = read(fd, data + len, sizeof(data) - len)) > 0) {
+        len += bytes;
+    }
+    close(fd);
+    memset(seen, 0, sizeof(seen));
+    for (p = 0; p + sizeof(header) <= len; p += header.size) {
+        memcpy(&header, data + p, sizeof(header));
+        if (header.size < sizeof(header) || header.site >= sizeof(seen)) {
+            return 1;
+        }
+        if (header.type == CLOG_BINARY_SITE) {
+            seen[header.site] = 1;
+        } else if (header.type == CLOG_BINARY_LOG && !seen[header.site]) {
+            return 1;
+        }
+    }
+    return p != len;
+}
+
+int test_binary_site_order(void)
+{
+    pthread_t threads[ASYNC_THREADS];
+    int ids[ASYNC_THREADS];
+    int i;
+
+    for (i = 0; i < SITE_FORMATS; i++) {
+        snprintf(site_formats[i], sizeof(site_formats[i]),
+                 "site %d thread %%d", i);
+    }
+    /* A small ring keeps the threads waiting on one another. */
+    CHECK_CALL(clog_init_path_async(0, TEST_FILE, 4096));
+    CHECK_CALL(clog_set_binary(0, 1));
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        ids[i] = i;
+        CHECK_CALL(pthread_create(&threads[i], NULL, site_writer, &ids[i]));
+    }
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        CHECK_CALL(pthread_join(threads[i], NULL));
+    }
+    clog_free(0);
+
+    CHECK_CALL(check_sites_first(TEST_FILE));
+
+    return 0;
+}
+
+int test_performance(void)
+{
+    const int MICROS_PER_SEC = 1000000;
+    const size_t NUM_MESSAGES = 200000;
+    unsigned long start_time, end_time;
+    struct timeval tv;
+    size_t messages = 0;
+    double run_time;
+    unsigned long messages_per_second;
+
+    /* Init */
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+
+    /* Run test */
+    CHECK_CALL(gettimeofday(&tv, NULL));
+    start_time = tv.tv_sec * MICROS_PER_SEC + tv.tv_usec;
+    for (messages = 0; messages < NUM_MESSAGES; messages++) {
+        clog_debug(CLOG(0), "Hello, %s!", "high-performing world");
+    }
+    CHECK_CALL(gettimeofday(&tv, NULL));
+    end_time = tv.tv_sec * MICROS_PER_SEC + tv.tv_usec;
+    clog_free(0);
+
+    /* Goal: 100,000 messages per second. */
+    run_time = (end_time - start_time) / (double) MICROS_PER_SEC;
+    messages_per_second = messages / run_time;
+    error("  Target 100000 msgs/sec, got %lu.\n", messages_per_second);
+    if (messages_per_second < 100000) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Numbers are appended without snprintf(), and level names with lengths
+ * worked out once. */
+int test_integers(void)
+{
+    const long values[] = { 0, 1, -1, 9, 10, 99, 100, -100, 12345, 1000000,
+                            -987654321, LONG_MAX, LONG_MIN, LONG_MIN + 1 };
+    char buf[64], exp[64];
+    struct clog_buf b;
+    long v;
+    size_t i;
+
+    /* Same digits as snprintf(). */
+    for (i = 0; i < sizeof(values) / sizeof(values[0]) + 100000; i++) {
+        v = i < sizeof(values) / sizeof(values[0]) ? values[i]
+            : (long) (i * 2654435761UL) - LONG_MAX / 3;
+        _clog_buf_init(&b, buf, sizeof(buf));
+        _clog_append_int(&b, v);
+        snprintf(exp, sizeof(exp), "%ld", v);
+        CHECK_CALL(strcmp(b.data, exp));
+        CHECK_CALL(b.len != strlen(exp));
+    }
+    for (i = 0; i < 4; i++) {
+        CHECK_CALL(_clog_level_lengths[i] != strlen(CLOG_LEVEL_NAMES[i]));
+    }
+
+    return 0;
+}
+
+#define CREATED_LOGGERS 200
+
+int test_created_loggers(void)
+{
+    char name[32];
+    char buf[1024];
+    int ids[CREATED_LOGGERS];
+    int fd[2];
+    int i, id;
+    ssize_t bytes;
+
+    CHECK_CALL(pipe(fd));
+    for (i = 0; i < CREATED_LOGGERS; i++) {
+        snprintf(name, sizeof(name), "logger %d", i);
+        ids[i] = clog_create_fd(name, fd[1]);
+        if (ids[i] < CLOG_MAX_LOGGERS || (i > 0 && ids[i] == ids[i - 1])) {
+            return 1;
+        }
+    }
+    if (clog_create_fd("logger 7", fd[1]) != -1
+        || clog_lookup("logger 7") != ids[7]
+        || clog_lookup("no such logger") != -1
+        || clog_lookup(NULL) != -1) {
+        return 1;
+    }
+
+    CHECK_CALL(clog_set_fmt(ids[150], "%l: %m\n"));
+    CHECK_CALL(clog_set_level(ids[150], CLOG_INFO));
+    clog_debug(CLOG(ids[150]), "Hidden");
+    CLOG_DEBUG_(ids[150], "Hidden");
+    CLOG_INFO_(ids[150], "Hello, %s!", "world");
+    bytes = read(fd[0], buf, sizeof(buf) - 1);
+    if (bytes <= 0) {
+        return 1;
+    }
+    buf[bytes] = 0;
+    CHECK_CALL(strcmp(buf, "INFO: Hello, world!\n"));
+
+    /* Freed ids are handed out again. */
+    clog_free(ids[7]);
+    if (clog_lookup("logger 7") != -1) {
+        return 1;
+    }
+    id = clog_create_fd(NULL, fd[1]);
+    if (id != ids[7]) {
+        return 1;
+    }
+    clog_free(id);
+
+    for (i = 0; i < CREATED_LOGGERS; i++) {
+        clog_free(ids[i]);
+    }
+    close(fd[0]);
+    close(fd[1]);
+
+    return 0;
+}
+
+int evaluated = 0;
+
+const char *count_evaluation(void)
+{
+    evaluated++;
+    return "world";
+}
+
+int ids_taken = 0;
+
+/* Logger 0, counting how often the macros evaluate their id. */
+int take_id(void)
+{
+    ids_taken++;
+    return 0;
+}
+
+int test_variadic_macros(void)
+{
+    struct clog_field field;
+    char buf[1024];
+    int fd[2];
+    ssize_t bytes;
+
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%f: %l: %m\n"));
+    CHECK_CALL(clog_set_level(0, CLOG_INFO));
+
+    /* Filtered out before the arguments are evaluated. */
+    CLOG_DEBUG_(0, "Hello, %s!", count_evaluation());
+    CLOG_INFO_(0, "Hello, %s!", count_evaluation());
+
+    /* The id is evaluated once, whether the line is written or not. */
+    field = clog_int("n", 1);
+    CLOG_DEBUG_(take_id(), "Hidden");
+    CLOG_FIELDS_(CLOG_DEBUG, take_id(), &field, 1, "Hidden");
+    CLOG_ERROR_(take_id(), "Done.");
+    clog_free(0);
+    close(fd[1]);
+
+    bytes = read(fd[0], buf, sizeof(buf) - 1);
+    close(fd[0]);
+    if (bytes <= 0 || evaluated != 1 || ids_taken != 3) {
+        return 1;
+    }
+    buf[bytes] = 0;
+    CHECK_CALL(strcmp(buf, THIS_FILE ": INFO: Hello, world!\n"
+                           THIS_FILE ": ERROR: Done.\n"));
+
+    return 0;
+}
+
+int test_callsite(void)
+{
+    static struct clog_callsite site = { "some/dir/file.c", 42, CLOG_WARN,
+                                         NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                         { 0 } };
+    char buf[1024];
+    int fd[2];
+    ssize_t bytes;
+
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%f(%n): %l: %m\n"));
+
+    /* The base name is worked out on first use, and kept. */
+    clog_log_site(&site, 0, "first %d", 1);
+    if (site.name == NULL || strcmp(site.name, "file.c") != 0) {
+        return 1;
+    }
+    clog_log_site(&site, 0, "second");
+    CHECK_CALL(clog_set_level(0, CLOG_ERROR));
+    clog_log_site(&site, 0, "filtered");
+    clog_free(0);
+    close(fd[1]);
+
+    bytes = read(fd[0], buf, sizeof(buf) - 1);
+    close(fd[0]);
+    if (bytes <= 0) {
+        return 1;
+    }
+    buf[bytes] = 0;
+    CHECK_CALL(strcmp(buf, "file.c(42): WARN: first 1\n"
+                           "file.c(42): WARN: second\n"));
+
+    return 0;
+}
+
+/* One call site for the rate limit and duplicate tests. */
+void log_from_site(const char *text)
+{
+    CLOG_INFO_(0, "%s", text);
+}
+
+int test_fields(void)
+{
+    const char bytes[] = { 0, (char) 0xff, 0x10 };
+    const char *expected_text =
+        "INFO: done n=-42 ratio=0.1 user=bob note=\"two words\" raw=00ff10\n";
+    const char *expected_json =
+        "\",\"level\":\"WARN\",\"file\":\"x.c\",\"line\":7,"
+        "\"msg\":\"0123456789abcdef\\\"tab\\there\\u0001end\\\\\","
+        "\"n\":-42,\"ratio\":0.1,\"user\":\"bob\",\"note\":\"two words\","
+        "\"raw\":\"00ff10\"}\n";
+    struct clog_field fields[5];
+    char buf[512];
+    ssize_t len;
+    int fd;
+
+    fields[0] = clog_int("n", -42);
+    fields[1] = clog_double("ratio", 0.1);
+    fields[2] = clog_str("user", "bob");
+    fields[3] = clog_str("note", "two words");
+    fields[4] = clog_bytes("raw", bytes, sizeof(bytes));
+
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_fmt(0, "%l: %m\n"));
+    CLOG_FIELDS_(CLOG_INFO, 0, fields, 5, "%s", "done");
+    CHECK_CALL(clog_set_json(0, 1));
+    clog_fields("dir/x.c", 7, 0, CLOG_WARN, fields, 5,
+                "0123456789abcdef\"tab\there\001end\\");
+    clog_free(0);
+
+    fd = open(TEST_FILE, O_RDONLY);
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 1;
+    }
+    buf[len] = 0;
+    CHECK_CALL(strncmp(buf, expected_text, strlen(expected_text)));
+    if (strncmp(buf + strlen(expected_text), "{\"time\":\"", 9) != 0
+        || strstr(buf, expected_json) == NULL
+        || strlen(strstr(buf, expected_json)) != strlen(expected_json)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Numbers in fields keep a '.' whatever the locale's decimal point. */
+int test_fields_locale(void)
+{
+    const char *const locales[] = { "de_DE.UTF-8", "de_DE.utf8", "de_DE",
+                                    "fr_FR.UTF-8", "fr_FR.utf8", "fr_FR",
+                                    NULL };
+    struct clog_field field;
+    char buf[512];
+    ssize_t len;
+    int fd[2], i;
+
+    for (i = 0; locales[i] != NULL; i++) {
+        if (setlocale(LC_NUMERIC, locales[i]) != NULL) {
+            break;
+        }
+    }
+    snprintf(buf, sizeof(buf), "%.1f", 2.5);
+    if (strcmp(buf, "2,5") != 0) {
+        setlocale(LC_NUMERIC, "C");
+        error("  No locale with a decimal comma to test in.\n");
+        return 0;
+    }
+
+    field = clog_double("ratio", 2.5);
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    clog_fields(THIS_FILE, 1, 0, CLOG_INFO, &field, 1, "text");
+    CHECK_CALL(clog_set_json(0, 1));
+    clog_fields(THIS_FILE, 2, 0, CLOG_INFO, &field, 1, "json");
+    clog_free(0);
+    close(fd[1]);
+    setlocale(LC_NUMERIC, "C");
+
+    len = read(fd[0], buf, sizeof(buf) - 1);
+    close(fd[0]);
+    if (len <= 0) {
+        return 1;
+    }
+    buf[len] = 0;
+    if (strncmp(buf, "text ratio=2.5\n{", 16) != 0
+        || strstr(buf, "\"ratio\":2.5}") == NULL) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* The notes clog writes itself are JSON lines too. */
+int test_json_notes(void)
+{
+    const char *const texts[] = { "a", "a", "a", "b", "a" };
+    char buf[2048];
+    char *line, *end;
+    int fd[2], i, lines = 0, notes = 0;
+    ssize_t bytes;
+
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_json(0, 1));
+    CHECK_CALL(clog_set_dedup(0, 1));
+    for (i = 0; i < 5; i++) {
+        CLOG_INFO_(0, "%s", texts[i]);
+    }
+    clog_free(0);
+    close(fd[1]);
+
+    bytes = read(fd[0], buf, sizeof(buf) - 1);
+    close(fd[0]);
+    if (bytes <= 0) {
+        return 1;
+    }
+    buf[bytes] = 0;
+    for (line = buf; *line != 0; line = end + 1) {
+        end = strchr(line, '\n');
+        if (end == NULL) {
+            return 1;
+        }
+        *end = 0;
+        /* {"time":"YYYY-MM-DDTHH:MM:SS.uuuuuuZ","level":"INFO",... } */
+        if (strncmp(line, "{\"time\":\"", 9) != 0
+            || strlen(line) < 9 + 28 || line[9 + 10] != 'T'
+            || line[9 + 19] != '.' || line[9 + 26] != 'Z'
+            || strncmp(line + 9 + 27, "\",\"level\":\"INFO\",", 16) != 0
+            || strstr(line, "\"msg\":\"") == NULL || end[-1] != '}') {
+            return 1;
+        }
+        if (strstr(line, "\"msg\":\"Last message repeated 2 times\"")) {
+            notes++;
+        }
+        lines++;
+    }
+    if (lines != 4 || notes != 1) {
+        return 1;
+    }
+
+    return 0;
+}
+
+int test_rate_limit(void)
+{
+    char buf[1024];
+    int fd[2];
+    ssize_t bytes;
+    int i;
 
-    /* Write to the log */
-    CHECK_CALL(clog_init_path(0, TEST_FILE));
-    CHECK_CALL(clog_set_fmt(0, "%f: %l: %m\n"));
-    clog_debug(CLOG(0), message);
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    CHECK_CALL(clog_set_rate_limit(0, 10, 3));
+
+    /* A burst of three, then one every 100 ms. */
+    for (i = 0; i < 100; i++) {
+        log_from_site("flood");
+    }
+    usleep(150000);
+    log_from_site("after");
+    if (clog_suppressed(0) != 97) {
+        return 1;
+    }
     clog_free(0);
+    close(fd[1]);
 
-    /* Verify what was written */
-    f = fopen(TEST_FILE, "r");
-    if (!f) {
+    bytes = read(fd[0], buf, sizeof(buf) - 1);
+    close(fd[0]);
+    if (bytes <= 0) {
         return 1;
     }
+    buf[bytes] = 0;
+    CHECK_CALL(strcmp(buf, "flood\nflood\nflood\n"
+                           "97 lines dropped by the rate limit\n"
+                           "after\n"));
 
-    if (fgets(buf, 51000, f) == NULL) {
-        fclose(f);
+    return 0;
+}
+
+/* Longer than the arguments a call site keeps for dedup. */
+#define LONG_TEXT "0123456789abcdef0123456789abcdef0123456789abcdef"
+
+int test_dedup(void)
+{
+    char buf[1024];
+    int fd[2], i;
+    ssize_t bytes;
+
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    CHECK_CALL(clog_set_dedup(0, 1));
+    log_from_site("a");
+    log_from_site("a");
+    log_from_site("a");
+    log_from_site("b");
+    log_from_site("a");
+    if (clog_suppressed(0) != 2) {
         return 1;
     }
-    fclose(f);
+    clog_free(0);
+    close(fd[1]);
+
+    bytes = read(fd[0], buf, sizeof(buf) - 1);
+    close(fd[0]);
+    if (bytes <= 0) {
+        return 1;
+    }
+    buf[bytes] = 0;
+    CHECK_CALL(strcmp(buf, "a\nLast message repeated 2 times\nb\na\n"));
+
+    /* Repeats go out on a flush without waiting for another message, and
+     * do not spend the rate limit's burst. */
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    CHECK_CALL(clog_set_dedup(0, 1));
+    CHECK_CALL(clog_set_rate_limit(0, 1, 2));
+    for (i = 0; i < 4; i++) {
+        if (i == 3) {
+            CHECK_CALL(clog_flush(0));
+            bytes = read(fd[0], buf, sizeof(buf) - 1);
+            if (bytes <= 0) {
+                return 1;
+            }
+            buf[bytes] = 0;
+            CHECK_CALL(strcmp(buf, "c\nLast message repeated 2 times\n"));
+        }
+        /* A call site of its own, so test_rate_limit has not used it. */
+        CLOG_INFO_(0, "%s", i < 3 ? "c" : "d");
+    }
+    clog_free(0);
+    close(fd[1]);
+
+    bytes = read(fd[0], buf, sizeof(buf) - 1);
+    close(fd[0]);
+    if (bytes <= 0) {
+        return 1;
+    }
+    buf[bytes] = 0;
+    CHECK_CALL(strcmp(buf, "d\n"));
+
+    /* Messages alike in the bytes a site keeps of them still differ. */
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    CHECK_CALL(clog_set_dedup(0, 1));
+    for (i = 0; i < 3; i++) {
+        CLOG_INFO_(0, "%s", i < 2 ? LONG_TEXT "1" : LONG_TEXT "2");
+    }
+    clog_free(0);
+    close(fd[1]);
+
+    bytes = read(fd[0], buf, sizeof(buf) - 1);
+    close(fd[0]);
+    if (bytes <= 0) {
+        return 1;
+    }
+    buf[bytes] = 0;
+    CHECK_CALL(strcmp(buf, LONG_TEXT "1\nLast message repeated 1 times\n"
+                           LONG_TEXT "2\n"));
 
-    snprintf(exp, 51000, "%s: DEBUG: %s\n", THIS_FILE, message);
-    CHECK_CALL(strcmp(buf, exp));
     return 0;
 }
 
-int test_performance(void)
+int lazy_calls = 0;
+
+/* A message of *(int *) ctx 'x's, built piecewise as callers would. */
+int lazy_message(char *buf, size_t size, void *ctx)
 {
-    const int MICROS_PER_SEC = 1000000;
-    const size_t NUM_MESSAGES = 200000;
-    unsigned long start_time, end_time;
-    struct timeval tv;
-    size_t messages = 0;
-    double run_time;
-    unsigned long messages_per_second;
+    int len = *(int *) ctx;
+    lazy_calls++;
+    if ((size_t) len < size) {
+        memset(buf, 'x', len);
+        buf[len] = 0;
+    }
+    return len;
+}
 
-    /* Init */
-    CHECK_CALL(clog_init_path(0, TEST_FILE));
+int test_lazy(void)
+{
+    char buf[8192];
+    int fd[2];
+    ssize_t bytes;
+    int short_len = 3, long_len = 5000;
 
-    /* Run test */
-    CHECK_CALL(gettimeofday(&tv, NULL));
-    start_time = tv.tv_sec * MICROS_PER_SEC + tv.tv_usec;
-    for (messages = 0; messages < NUM_MESSAGES; messages++) {
-        clog_debug(CLOG(0), "Hello, %s!", "high-performing world");
+    CHECK_CALL(pipe(fd));
+    CHECK_CALL(clog_init_fd(0, fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%l: %m\n"));
+    CHECK_CALL(clog_set_level(0, CLOG_INFO));
+    if (clog_enabled(0, CLOG_DEBUG) || !clog_enabled(0, CLOG_INFO)) {
+        return 1;
+    }
+
+    /* Only called for lines written; called again when the first buffer
+     * is too small. */
+    clog_lazy(CLOG(0), CLOG_DEBUG, lazy_message, &short_len);
+    CLOG_LAZY_(CLOG_DEBUG, 0, lazy_message, &short_len);
+    if (lazy_calls != 0) {
+        return 1;
+    }
+    clog_lazy(CLOG(0), CLOG_INFO, lazy_message, &short_len);
+    CLOG_LAZY_(CLOG_WARN, 0, lazy_message, &long_len);
+    if (lazy_calls != 3) {
+        return 1;
     }
-    CHECK_CALL(gettimeofday(&tv, NULL));
-    end_time = tv.tv_sec * MICROS_PER_SEC + tv.tv_usec;
     clog_free(0);
+    close(fd[1]);
 
-    /* Goal: 100,000 messages per second. */
-    run_time = (end_time - start_time) / (double) MICROS_PER_SEC;
-    messages_per_second = messages / run_time;
-    error("  Target 100000 msgs/sec, got %lu.\n", messages_per_second);
-    if (messages_per_second < 100000) {
+    bytes = read(fd[0], buf, sizeof(buf) - 1);
+    close(fd[0]);
+    if (bytes != 10 + 5007) {
+        return 1;
+    }
+    buf[bytes] = 0;
+    if (strncmp(buf, "INFO: xxx\nWARN: xxxx", 20) != 0
+        || strspn(buf + 16, "x") != 5000) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Read what was written to the pipe fd and compare it with expected. */
+int check_pipe(int *fd, const char *expected)
+{
+    char buf[1024];
+    ssize_t bytes;
+
+    close(fd[1]);
+    bytes = read(fd[0], buf, sizeof(buf) - 1);
+    close(fd[0]);
+    if (bytes < 0) {
+        return 1;
+    }
+    buf[bytes] = 0;
+    return strcmp(buf, expected) != 0;
+}
+
+int test_stats(void)
+{
+    struct clog_stats stats;
+    struct timespec start = { 0, 0 }, end = { 5, 0 }, short_end = { 0, 600 };
+    char message[5000];
+    int fd;
+    memset(message, 's', sizeof(message) - 1);
+    message[sizeof(message) - 1] = 0;
+
+    CHECK_CALL(!clog_stats(0, &stats));
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    CHECK_CALL(clog_set_level(0, CLOG_INFO));
+    CHECK_CALL(clog_set_write_timing(0, 1));
+    clog_debug(CLOG(0), "filtered");
+    clog_debug(CLOG(0), "filtered");
+    CLOG_DEBUG_(0, "filtered inline, not counted");
+    clog_info(CLOG(0), "one");
+    CLOG_WARN_(0, "two");
+    clog_error(CLOG(0), "%s", message);
+    CHECK_CALL(clog_stats(0, &stats));
+    clog_free(0);
+    CHECK_CALL(stats.lines != 3);
+    CHECK_CALL(stats.bytes != 4 + 4 + sizeof(message));
+    CHECK_CALL(stats.filtered != 2);
+    CHECK_CALL(stats.heap_lines != 1);
+    CHECK_CALL(stats.write_errors != 0);
+    CHECK_CALL(stats.suppressed != 0 || stats.dropped != 0);
+
+    /* Writes to a file not open for writing fail. */
+    fd = open(TEST_FILE, O_RDONLY);
+    CHECK_CALL(fd == -1);
+    CHECK_CALL(clog_init_fd(0, fd));
+    clog_info(CLOG(0), "lost");
+    CHECK_CALL(clog_stats(0, &stats));
+    clog_free(0);
+    close(fd);
+    CHECK_CALL(stats.lines != 0 || stats.write_errors != 1);
+
+    /* Write time adds up past what 32 bits of nanoseconds hold, and short
+     * writes add up too. */
+    _clog_nsec_carry = 0;
+    CHECK_CALL(_clog_usec_between(&start, &end) != 5000000);
+    CHECK_CALL(_clog_usec_between(&start, &short_end) != 0);
+    CHECK_CALL(_clog_usec_between(&start, &short_end) != 1);
+
+    return 0;
+}
+
+int test_sinks(void)
+{
+    int main_fd[2], errors_fd[2], messages_fd[2];
+    int errors, messages;
+
+    CHECK_CALL(pipe(main_fd));
+    CHECK_CALL(pipe(errors_fd));
+    CHECK_CALL(pipe(messages_fd));
+    CHECK_CALL(clog_init_fd(0, main_fd[1]));
+    CHECK_CALL(clog_set_fmt(0, "%l: %m\n"));
+    CHECK_CALL(clog_set_level(0, CLOG_INFO));
+
+    /* One sink in the logger's format, one in its own. */
+    errors = clog_add_sink_fd(0, errors_fd[1], CLOG_ERROR, NULL);
+    messages = clog_add_sink_fd(0, messages_fd[1], CLOG_DEBUG, "[%m]\n");
+    if (errors == -1 || messages == -1 || errors == messages) {
+        return 1;
+    }
+    clog_debug(CLOG(0), "filtered by the logger");
+    clog_info(CLOG(0), "a %d", 1);
+    clog_error(CLOG(0), "b");
+    CHECK_CALL(clog_remove_sink(0, errors));
+    if (clog_remove_sink(0, errors) == 0) {
         return 1;
     }
+    clog_error(CLOG(0), "c");
+    clog_free(0);
+
+    CHECK_CALL(check_pipe(main_fd, "INFO: a 1\nERROR: b\nERROR: c\n"));
+    CHECK_CALL(check_pipe(errors_fd, "ERROR: b\n"));
+    CHECK_CALL(check_pipe(messages_fd, "[a 1]\n[b]\n[c]\n"));
 
     return 0;
 }
@@ -313,6 +1951,225 @@ int test_reuse_logger_id(void)
     return 0;
 }
 
+int test_reconfigure_while_logging(void)
+{
+    pthread_t threads[ASYNC_THREADS];
+    int ids[ASYNC_THREADS];
+    int next[ASYNC_THREADS] = { 0 };
+    int i;
+
+    unlink(TEST_FILE ".old");
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        ids[i] = i;
+        CHECK_CALL(pthread_create(&threads[i], NULL, async_writer, &ids[i]));
+    }
+    /* Change everything a log call uses while the threads log. */
+    for (i = 0; i < 200; i++) {
+        CHECK_CALL(clog_set_fmt(0, i % 2 ? "%m\n" : "%d %t.%u %l: %m\n"));
+        CHECK_CALL(clog_set_date_fmt(0, i % 2 ? "%Y" : "%Y-%m-%d"));
+        CHECK_CALL(clog_set_time_fmt(0, i % 2 ? "%H" : "%H:%M:%S"));
+        CHECK_CALL(clog_set_buffer(0, i % 3 ? 4096 : 0, 0));
+        if (i == 100) {
+            CHECK_CALL(clog_rotate(0, TEST_FILE));
+        }
+    }
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        CHECK_CALL(pthread_join(threads[i], NULL));
+    }
+    clog_free(0);
+
+    /* Lines logged before the rotation are in the old file. */
+    CHECK_CALL(read_thread_lines(TEST_FILE ".old", next));
+    CHECK_CALL(read_thread_lines(TEST_FILE, next));
+    unlink(TEST_FILE ".old");
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        if (next[i] != ASYNC_LINES) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int stop_logging = 0;
+
+void *free_writer(void *arg)
+{
+    (void) arg;
+    while (!__atomic_load_n(&stop_logging, __ATOMIC_RELAXED)) {
+        clog_info(CLOG(1), "Hello, %s!", "world");
+    }
+    return NULL;
+}
+
+#define STRESS_THREADS 10
+
+/* Setters one right after the other, each replacing what the one before
+ * published, while more threads than stripes log. */
+int test_reconfigure_back_to_back(void)
+{
+    pthread_t threads[STRESS_THREADS];
+    int fd, i;
+
+    fd = open("/dev/null", O_WRONLY);
+    if (fd == -1) {
+        return 1;
+    }
+    stop_logging = 0;
+    CHECK_CALL(clog_init_fd(1, fd));
+    for (i = 0; i < STRESS_THREADS; i++) {
+        CHECK_CALL(pthread_create(&threads[i], NULL, free_writer, NULL));
+    }
+    for (i = 0; i < 50; i++) {
+        CHECK_CALL(clog_set_fmt(1, i % 2 ? "%m\n" : "%d %t %l: %m\n"));
+        CHECK_CALL(clog_set_date_fmt(1, i % 2 ? "%Y" : "%Y-%m-%d"));
+        CHECK_CALL(clog_set_time_fmt(1, i % 2 ? "%H" : "%H:%M:%S"));
+        CHECK_CALL(clog_set_buffer(1, i % 2 ? 4096 : 0, 0));
+        if (i % 10 == 9) {
+            clog_free(1);
+            CHECK_CALL(clog_init_fd(1, fd));
+        }
+    }
+    __atomic_store_n(&stop_logging, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < STRESS_THREADS; i++) {
+        CHECK_CALL(pthread_join(threads[i], NULL));
+    }
+    clog_free(1);
+    close(fd);
+
+    return 0;
+}
+
+int test_free_while_logging(void)
+{
+    pthread_t threads[ASYNC_THREADS];
+    int fd, i;
+
+    fd = open("/dev/null", O_WRONLY);
+    if (fd == -1) {
+        return 1;
+    }
+    stop_logging = 0;
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        CHECK_CALL(pthread_create(&threads[i], NULL, free_writer, NULL));
+    }
+    /* Loggers come and go under the threads' feet. */
+    for (i = 0; i < 500; i++) {
+        CHECK_CALL(clog_init_fd(1, fd));
+        clog_free(1);
+    }
+    __atomic_store_n(&stop_logging, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        CHECK_CALL(pthread_join(threads[i], NULL));
+    }
+    close(fd);
+
+    return 0;
+}
+
+/* In the child of test_fork: log with the threads of the parent gone. */
+int fork_child(void)
+{
+    int i;
+
+    clog_info(CLOG(0), "child");
+
+    /* More than the ring holds: the writer thread is back to drain it. */
+    for (i = 0; i < 200; i++) {
+        clog_info(CLOG(2), "child");
+    }
+
+    /* The background thread is back to flush the buffer. */
+    CHECK_CALL(wait_for_size(TEST_FILE, 13));
+
+    /* No log call of the vanished threads is waited for. */
+    CHECK_CALL(clog_set_fmt(1, "%m\n"));
+    clog_free(0);
+    clog_free(1);
+    clog_free(2);
+    return 0;
+}
+
+/* Count the lines of path reading "parent" (1 each) and "child" (2 each),
+ * and any others (1000 each). */
+int count_fork_lines(const char *path)
+{
+    char buf[256];
+    int count = 0;
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        count += strcmp(buf, "parent\n") == 0 ? 1
+                 : strcmp(buf, "child\n") == 0 ? 2 : 1000;
+    }
+    fclose(f);
+    return count;
+}
+
+int test_fork(void)
+{
+    pthread_t threads[STRESS_THREADS];
+    int fd, async_fd, i, status = 1;
+    pid_t pid;
+
+    fd = open("/dev/null", O_WRONLY);
+    async_fd = open(TEST_FILE ".async", O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd == -1 || async_fd == -1) {
+        return 1;
+    }
+    stop_logging = 0;
+    CHECK_CALL(clog_init_fd(1, fd));
+    CHECK_CALL(clog_init_path(0, TEST_FILE));
+    CHECK_CALL(clog_set_fmt(0, "%m\n"));
+    CHECK_CALL(clog_set_buffer(0, 1024, 50));
+    CHECK_CALL(clog_init_fd_async(2, async_fd, 1024));
+    CHECK_CALL(clog_set_fmt(2, "%m\n"));
+    for (i = 0; i < STRESS_THREADS; i++) {
+        CHECK_CALL(pthread_create(&threads[i], NULL, free_writer, NULL));
+    }
+    clog_info(CLOG(0), "parent");
+    clog_info(CLOG(2), "parent");
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        _exit(fork_child());
+    }
+    for (i = 0; pid != -1 && i < 1000; i++) {
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            break;
+        }
+        usleep(10000);
+    }
+    if (i == 1000) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+
+    __atomic_store_n(&stop_logging, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < STRESS_THREADS; i++) {
+        CHECK_CALL(pthread_join(threads[i], NULL));
+    }
+    clog_free(0);
+    clog_free(1);
+    clog_free(2);
+    close(fd);
+    close(async_fd);
+    if (pid == -1 || status != 0) {
+        return 1;
+    }
+
+    /* The parent's buffered and queued lines are written once, by the
+     * parent. */
+    CHECK_CALL(count_fork_lines(TEST_FILE) != 1 + 2);
+    CHECK_CALL(count_fork_lines(TEST_FILE ".async") != 1 + 2 * 200);
+    unlink(TEST_FILE ".async");
+    return 0;
+}
+
 typedef int (*test_function_t)(void);
 
 typedef struct {
@@ -335,14 +2192,50 @@ int main(int argc, char *argv[])
         TEST_CASE(test_level_filtering),
         TEST_CASE(test_multiple_loggers),
         TEST_CASE(test_bad_format),
+        TEST_CASE(test_format_substitutions),
+        TEST_CASE(test_date_time_format),
+        TEST_CASE(test_subsecond_format),
         TEST_CASE(test_long_message),
+        TEST_CASE(test_allocator),
         TEST_CASE(test_reuse_logger_id),
+        TEST_CASE(test_variadic_macros),
+        TEST_CASE(test_callsite),
+        TEST_CASE(test_rate_limit),
+        TEST_CASE(test_dedup),
+        TEST_CASE(test_lazy),
+        TEST_CASE(test_sinks),
+        TEST_CASE(test_stats),
+        TEST_CASE(test_fields),
+        TEST_CASE(test_json_notes),
+        TEST_CASE(test_fields_locale),
+        TEST_CASE(test_created_loggers),
+        TEST_CASE(test_async_write),
+        TEST_CASE(test_async_long_line),
+        TEST_CASE(test_async_overflow),
+        TEST_CASE(test_buffered_write),
+        TEST_CASE(test_partial_writes),
+        TEST_CASE(test_buffered_threads),
+        TEST_CASE(test_buffered_exit),
+        TEST_CASE(test_mmap_write),
+        TEST_CASE(test_mmap_rotate),
+        TEST_CASE(test_rotation_size),
+        TEST_CASE(test_rotation_time),
+        TEST_CASE(test_compress),
+        TEST_CASE(test_reopen),
+        TEST_CASE(test_reconfigure_while_logging),
+        TEST_CASE(test_free_while_logging),
+        TEST_CASE(test_fork),
+        TEST_CASE(test_reconfigure_back_to_back),
+        TEST_CASE(test_binary_log),
+        TEST_CASE(test_binary_threads),
+        TEST_CASE(test_binary_site_order),
 
         // C++ tests
         TEST_CASE(test_cpp_hello),
 
         // Performance tests
-        TEST_CASE(test_performance)
+        TEST_CASE(test_performance),
+        TEST_CASE(test_integers)
     };
 
     const size_t num_tests = sizeof(tests) / sizeof(test_case);
@@ -375,9 +2268,13 @@ int main(int argc, char *argv[])
             printf("%s", error_text);
         }
 
-        /* Restore global state in case test didn't clean up */
+        /* Restore global state in case test didn't clean up.  The
+         * background thread may still be looking at the loggers, so they
+         * are freed the proper way. */
         for (j = 0; j < CLOG_MAX_LOGGERS; j++) {
-            _clog_loggers[j] = NULL;
+            if (_clog_load(&_clog_loggers[j]) != NULL) {
+                clog_free(j);
+            }
         }
         error_text[0] = '\0';
     }
@@ -70,6 +70,36 @@ do --- test status
   print("test status ok")
 end
 
+do --- test stats
+  local logger = log.init(3, "test.log")
+  logger:level("INFO")
+  logger:info('counted')
+  logger:debug('filtered')
+  local stats = log.stats(logger)
+  assert(stats.lines == 1 and stats.bytes > 0)
+  assert(log.stats(3).lines == 1)
+  logger:close()
+  assert(log.stats(3) == nil)
+  print("test stats ok")
+end
+
+do --- test named
+  local db = log.init("db")
+  local net = log.init("net", "test.log")
+  assert(tostring(log.init("db")) == tostring(db))
+  local status = log.status()
+  local names = {}
+  for id, v in pairs(status) do
+    if id >= log.MAX_LOGGERS then names[v] = id end
+  end
+  assert(names.db and names.net)
+  db:info('named')
+  net:close()
+  assert(log.status()[names.net] == nil)
+  db:close()
+  print("test named ok")
+end
+
 do --- test buffer
   local logger = log.init(0)
   logger:level("DEBUG")
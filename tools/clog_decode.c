@@ -0,0 +1,77 @@
+/* Render binary clog logs (see clog_set_binary()) as text, or uncompress
+ * rotated files (see clog_set_compress()). */
+
+#define _XOPEN_SOURCE 600
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CLOG_MAIN
+#include "clog.h"
+
+void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-f FORMAT] [-d DATE_FORMAT] [-t TIME_FORMAT] "
+            "[FILE...]\n"
+            "       %s -u [FILE...]\n"
+            "Writes the binary logs FILE..., or standard input, to standard "
+            "output as text.\n"
+            "With -u, writes the .lz files FILE... uncompressed instead.\n",
+            name, name);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *fmt = NULL, *date_fmt = NULL, *time_fmt = NULL;
+    int opt, fd, i;
+    int uncompress = 0;
+    int result = 0;
+
+    while ((opt = getopt(argc, argv, "f:d:t:uh")) != -1) {
+        switch (opt) {
+            case 'u':
+                uncompress = 1;
+                break;
+            case 'f':
+                fmt = optarg;
+                break;
+            case 'd':
+                date_fmt = optarg;
+                break;
+            case 't':
+                time_fmt = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if (optind == argc && uncompress) {
+        return clog_uncompress(STDIN_FILENO, STDOUT_FILENO) ? 1 : 0;
+    }
+    if (optind == argc) {
+        return clog_decode(STDIN_FILENO, STDOUT_FILENO, fmt, date_fmt,
+                           time_fmt) ? 1 : 0;
+    }
+    for (i = optind; i < argc; i++) {
+        fd = open(argv[i], O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
+            result = 1;
+            continue;
+        }
+        if (uncompress ? clog_uncompress(fd, STDOUT_FILENO)
+                       : clog_decode(fd, STDOUT_FILENO, fmt, date_fmt,
+                                     time_fmt)) {
+            fprintf(stderr, "%s: %s: Could not decode all of it.\n",
+                    argv[0], argv[i]);
+            result = 1;
+        }
+        close(fd);
+    }
+    return result;
+}